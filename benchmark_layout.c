@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #define SOKOL_IMPL
 #include "sokol_time.h"
 #undef SOKOL_IMPL
@@ -17,6 +18,11 @@ LONG WINAPI LayTestUnhandledExceptionFilter(EXCEPTION_POINTERS* ExceptionInfo)
     return EXCEPTION_EXECUTE_HANDLER;
 }
 
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 
 /*
@@ -233,6 +239,849 @@ static inline void benchmark_nested(lay_context *ctx)
     free(rows);
 }
 
+// A single chain of items, each one nested inside of the previous one. Only the
+// layout calculations are timed, not building the items.
+static inline uint64_t benchmark_deep_nest(lay_context *ctx, uint32_t depth)
+{
+    lay_id root = lay_item(ctx);
+    lay_id parent = root;
+    for (uint32_t i = 0; i < depth; ++i) {
+        lay_id item = lay_item(ctx);
+        lay_insert(ctx, parent, item);
+        parent = item;
+    }
+    lay_set_size_xy(ctx, parent, 77, 99);
+
+    uint64_t t1 = stm_now();
+    lay_run_context(ctx);
+    uint64_t diff = stm_since(t1);
+
+    LTEST_VEC4EQ(lay_get_rect(ctx, root), 0, 0, 77, 99);
+    return diff;
+}
+
+// A column of rows, each row containing a mix of fixed size and filling cells.
+// The items are created up front, and ids[n] is used as the id of the nth item
+// in tree order. If ids is NULL, the items are used in creation order.
+static void build_grid(lay_context *ctx, uint32_t num_rows, uint32_t num_cols, const lay_id *ids)
+{
+    const uint32_t num_items = 1 + num_rows * (num_cols + 1);
+    for (uint32_t i = 0; i < num_items; ++i)
+        lay_item(ctx);
+    uint32_t n = 0;
+#define GRID_NEXT_ID() (ids ? ids[n++] : (lay_id)n++)
+    lay_id root = GRID_NEXT_ID();
+    lay_set_size_xy(ctx, root, 8000, (lay_scalar)(num_rows * 10));
+    lay_set_contain(ctx, root, LAY_COLUMN);
+    for (uint32_t i = 0; i < num_rows; ++i) {
+        lay_id row = GRID_NEXT_ID();
+        lay_set_behave(ctx, row, LAY_HFILL);
+        lay_set_contain(ctx, row, LAY_ROW);
+        lay_insert(ctx, root, row);
+        lay_id prev = LAY_INVALID_ID;
+        for (uint32_t j = 0; j < num_cols; ++j) {
+            lay_id cell = GRID_NEXT_ID();
+            if (j % 3 == 0) {
+                lay_set_behave(ctx, cell, LAY_FILL);
+            } else {
+                lay_set_size_xy(ctx, cell, 20, 8);
+                lay_set_margins_ltrb(ctx, cell, 1, 1, 1, 1);
+                lay_set_behave(ctx, cell, j % 3 == 1 ? LAY_TOP : LAY_VCENTER);
+            }
+            if (prev == LAY_INVALID_ID)
+                lay_insert(ctx, row, cell);
+            else
+                lay_append(ctx, prev, cell);
+            prev = cell;
+        }
+    }
+#undef GRID_NEXT_ID
+}
+
+// A small layout like a list row: an icon, two lines of text, and some buttons.
+static lay_id build_list_row(lay_context *ctx, uint32_t index)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, (lay_scalar)(300 + index % 7), 24);
+    lay_set_contain(ctx, root, LAY_ROW);
+    lay_id icon = lay_item(ctx);
+    lay_set_size_xy(ctx, icon, 20, 20);
+    lay_set_margins_ltrb(ctx, icon, 2, 2, 2, 2);
+    lay_insert(ctx, root, icon);
+    lay_id text = lay_item(ctx);
+    lay_set_behave(ctx, text, LAY_FILL);
+    lay_set_contain(ctx, text, LAY_COLUMN);
+    lay_insert(ctx, root, text);
+    for (uint32_t i = 0; i < 2; ++i) {
+        lay_id line = lay_item(ctx);
+        lay_set_size_xy(ctx, line, 0, 10);
+        lay_set_behave(ctx, line, LAY_HFILL);
+        lay_insert(ctx, text, line);
+    }
+    for (uint32_t i = 0; i < 3 + index % 3; ++i) {
+        lay_id button = lay_item(ctx);
+        lay_set_size_xy(ctx, button, 16, 16);
+        lay_set_margins_ltrb(ctx, button, 1, 0, 1, 0);
+        lay_insert(ctx, root, button);
+    }
+    return root;
+}
+
+// A column of list rows in a single context. The rows repeat with a period of
+// 21, which makes most of them hits in the subtree cache (see lay_set_memo()).
+static void build_list(lay_context *ctx, uint32_t num_rows)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 320, 0);
+    lay_set_contain(ctx, root, LAY_COLUMN | LAY_START);
+    for (uint32_t i = 0; i < num_rows; ++i) {
+        lay_id row = build_list_row(ctx, i);
+        lay_insert(ctx, root, row);
+    }
+}
+
+// Rows with many children each. Every other row is a plain row, where the
+// children are aligned vertically by lay_arrange_overlay_squeezed_range(), and
+// the rest are overlay containers, where the children are aligned in both
+// directions by lay_arrange_overlay().
+static void build_wide_rows(lay_context *ctx, uint32_t num_rows, uint32_t num_children)
+{
+    static const uint32_t behaves[] = {
+        LAY_TOP, LAY_VCENTER, LAY_BOTTOM, LAY_VFILL,
+        LAY_LEFT | LAY_TOP, LAY_RIGHT | LAY_VCENTER, LAY_HCENTER | LAY_BOTTOM, LAY_FILL
+    };
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 30000, (lay_scalar)(num_rows * 30));
+    lay_set_contain(ctx, root, LAY_COLUMN);
+    for (uint32_t i = 0; i < num_rows; ++i) {
+        lay_id row = lay_item(ctx);
+        lay_set_size_xy(ctx, row, 0, 30);
+        lay_set_behave(ctx, row, LAY_HFILL);
+        lay_set_contain(ctx, row, i % 2 == 0 ? LAY_ROW | LAY_START : LAY_LAYOUT);
+        lay_insert(ctx, root, row);
+        for (uint32_t j = 0; j < num_children; ++j) {
+            lay_id child = lay_item(ctx);
+            lay_set_size_xy(ctx, child, (lay_scalar)(10 + j % 7), (lay_scalar)(12 + j % 13));
+            lay_set_margins_ltrb(ctx, child, 1, (lay_scalar)(j % 3), 1, (lay_scalar)(j % 2));
+            lay_set_behave(ctx, child, behaves[j % 8]);
+            lay_insert(ctx, row, child);
+        }
+    }
+}
+
+// Returns the time taken by the layout calculations averaged over num_runs runs
+// of the same context.
+static inline uint64_t benchmark_runs(lay_context *ctx, uint32_t num_runs)
+{
+    uint64_t t1 = stm_now();
+    for (uint32_t run_n = 0; run_n < num_runs; ++run_n)
+        lay_run_context(ctx);
+    return stm_since(t1) / num_runs;
+}
+
+// xorshift32. The state must not be 0.
+static inline uint32_t bench_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Fills ids with 0..count-1 in a random order, except that the root (id 0)
+// stays first.
+static void shuffled_ids(lay_id *ids, uint32_t count, uint32_t seed)
+{
+    for (uint32_t i = 0; i < count; ++i)
+        ids[i] = (lay_id)i;
+    for (uint32_t i = count - 1; i > 1; --i) {
+        uint32_t j = 1 + bench_rand(&seed) % i;
+        lay_id tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+}
+
+// Generators for the benchmark suite. Each one creates a tree of exactly
+// num_items items (at least 2), with item 0 as the root. The seed is only used
+// by the ones that are random.
+
+// Rows of up to 500 children each, in a column
+static void gen_wide_rows(lay_context *ctx, uint32_t num_items, uint32_t seed)
+{
+    (void)seed;
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 8000, 8000);
+    lay_set_contain(ctx, root, LAY_COLUMN);
+    lay_id prev_row = LAY_INVALID_ID;
+    uint32_t n = 1;
+    while (n < num_items) {
+        lay_id row = lay_item(ctx);
+        ++n;
+        lay_set_behave(ctx, row, LAY_HFILL);
+        lay_set_contain(ctx, row, LAY_ROW);
+        if (prev_row == LAY_INVALID_ID)
+            lay_insert(ctx, root, row);
+        else
+            lay_append(ctx, prev_row, row);
+        prev_row = row;
+        lay_id prev = LAY_INVALID_ID;
+        for (uint32_t j = 0; j < 500 && n < num_items; ++j, ++n) {
+            lay_id cell = lay_item(ctx);
+            if (j % 4 == 0) {
+                lay_set_size_xy(ctx, cell, 0, 10);
+                lay_set_behave(ctx, cell, LAY_HFILL | LAY_VCENTER);
+            } else {
+                lay_set_size_xy(ctx, cell, (lay_scalar)(8 + j % 5), 10);
+                lay_set_margins_ltrb(ctx, cell, 1, 0, 1, 0);
+            }
+            if (prev == LAY_INVALID_ID)
+                lay_insert(ctx, row, cell);
+            else
+                lay_append(ctx, prev, cell);
+            prev = cell;
+        }
+    }
+}
+
+// Each item is the only child of the previous one, alternating between rows
+// and columns
+static void gen_deep_chain(lay_context *ctx, uint32_t num_items, uint32_t seed)
+{
+    (void)seed;
+    lay_id parent = lay_item(ctx);
+    lay_set_size_xy(ctx, parent, 1000, 1000);
+    for (uint32_t i = 1; i < num_items; ++i) {
+        lay_id child = lay_item(ctx);
+        lay_set_contain(ctx, parent, i % 2 ? LAY_ROW : LAY_COLUMN);
+        lay_set_behave(ctx, child, LAY_FILL);
+        lay_insert(ctx, parent, child);
+        parent = child;
+    }
+}
+
+// A tree where every container has 4 children, created in breadth-first order
+static void gen_balanced(lay_context *ctx, uint32_t num_items, uint32_t seed)
+{
+    (void)seed;
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 4000, 4000);
+    lay_set_contain(ctx, root, LAY_ROW);
+    for (uint32_t i = 1; i < num_items; ++i) {
+        lay_id item = lay_item(ctx);
+        if (4 * i + 1 < num_items) {
+            lay_set_contain(ctx, item, i % 2 ? LAY_COLUMN : LAY_ROW);
+            lay_set_behave(ctx, item, LAY_FILL);
+        } else {
+            lay_set_size_xy(ctx, item, (lay_scalar)(4 + i % 9), (lay_scalar)(4 + i % 5));
+            lay_set_margins_ltrb(ctx, item, 1, 1, 1, 1);
+        }
+        lay_insert(ctx, (i - 1) / 4, item);
+    }
+}
+
+// Wrapping containers of up to 1000 children each. The children have random
+// sizes, and some of them force a line break.
+static void gen_wrap(lay_context *ctx, uint32_t num_items, uint32_t seed, uint32_t direction)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 2000, 2000);
+    lay_set_contain(ctx, root, direction == LAY_ROW ? LAY_COLUMN : LAY_ROW);
+    lay_id prev_box = LAY_INVALID_ID;
+    uint32_t n = 1;
+    while (n < num_items) {
+        lay_id box = lay_item(ctx);
+        ++n;
+        lay_set_contain(ctx, box, direction | LAY_WRAP | LAY_START);
+        lay_set_behave(ctx, box, direction == LAY_ROW ? LAY_HFILL : LAY_VFILL);
+        if (prev_box == LAY_INVALID_ID)
+            lay_insert(ctx, root, box);
+        else
+            lay_append(ctx, prev_box, box);
+        prev_box = box;
+        lay_id prev = LAY_INVALID_ID;
+        for (uint32_t j = 0; j < 1000 && n < num_items; ++j, ++n) {
+            const uint32_t r = bench_rand(&seed);
+            lay_id child = lay_item(ctx);
+            lay_set_size_xy(ctx, child, (lay_scalar)(8 + r % 33), (lay_scalar)(8 + (r >> 8) % 17));
+            lay_set_margins_ltrb(ctx, child, 1, 1, 1, 1);
+            if ((r >> 16) % 64 == 0)
+                lay_set_behave(ctx, child, LAY_BREAK);
+            if (prev == LAY_INVALID_ID)
+                lay_insert(ctx, box, child);
+            else
+                lay_append(ctx, prev, child);
+            prev = child;
+        }
+    }
+}
+
+static void gen_wrap_rows(lay_context *ctx, uint32_t num_items, uint32_t seed)
+{ gen_wrap(ctx, num_items, seed, LAY_ROW); }
+
+static void gen_wrap_columns(lay_context *ctx, uint32_t num_items, uint32_t seed)
+{ gen_wrap(ctx, num_items, seed, LAY_COLUMN); }
+
+// Random containers (rows, columns and free layouts, some of them wrapping)
+// and random behaviors. Each new item goes into one of the 64 most recently
+// created containers, so the tree gets both deep and wide.
+static void gen_random_mix(lay_context *ctx, uint32_t num_items, uint32_t seed)
+{
+    static const uint32_t contains[] = {
+        LAY_ROW, LAY_COLUMN, LAY_LAYOUT, LAY_ROW | LAY_WRAP,
+        LAY_COLUMN | LAY_WRAP, LAY_ROW | LAY_JUSTIFY, LAY_COLUMN | LAY_END, LAY_LAYOUT
+    };
+    static const uint32_t behaves[] = {
+        0, LAY_FILL, LAY_HFILL, LAY_VFILL,
+        LAY_LEFT | LAY_TOP, LAY_RIGHT | LAY_BOTTOM, LAY_HFILL | LAY_TOP, LAY_RIGHT | LAY_VFILL
+    };
+    enum { num_recent = 64 };
+    lay_id recent[num_recent];
+    uint32_t num_containers = 1;
+    // The last child of each item, so that appending is O(1)
+    lay_id *last_child = (lay_id*)malloc(num_items * sizeof(lay_id));
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 2000, 2000);
+    lay_set_contain(ctx, root, LAY_COLUMN);
+    recent[0] = root;
+    last_child[root] = LAY_INVALID_ID;
+    for (uint32_t i = 1; i < num_items; ++i) {
+        const uint32_t r = bench_rand(&seed);
+        const uint32_t r2 = bench_rand(&seed);
+        const lay_id parent = recent[r % (num_containers < num_recent ? num_containers : (uint32_t)num_recent)];
+        lay_id item = lay_item(ctx);
+        last_child[item] = LAY_INVALID_ID;
+        lay_set_behave(ctx, item, behaves[(r >> 8) % 8]);
+        lay_set_margins_ltrb(ctx, item, (lay_scalar)(r2 % 3), (lay_scalar)((r2 >> 2) % 3), 0, 0);
+        if ((r >> 12) % 4 == 0) {
+            lay_set_contain(ctx, item, contains[(r >> 16) % 8]);
+            recent[num_containers++ % num_recent] = item;
+        } else {
+            lay_set_size_xy(ctx, item, (lay_scalar)(4 + (r2 >> 4) % 32), (lay_scalar)(4 + (r2 >> 9) % 16));
+        }
+        if (last_child[parent] == LAY_INVALID_ID)
+            lay_insert(ctx, parent, item);
+        else
+            lay_append(ctx, last_child[parent], item);
+        last_child[parent] = item;
+    }
+    free(last_child);
+}
+
+typedef struct bench_generator {
+    const char *name;
+    void (*build)(lay_context *ctx, uint32_t num_items, uint32_t seed);
+} bench_generator;
+
+static const bench_generator bench_generators[] = {
+    { "wide_rows", gen_wide_rows },
+    { "deep_chain", gen_deep_chain },
+    { "balanced", gen_balanced },
+    { "wrap_rows", gen_wrap_rows },
+    { "wrap_columns", gen_wrap_columns },
+    { "random_mix", gen_random_mix },
+};
+
+// Latency distribution of a set of runs, in microseconds
+typedef struct bench_stats {
+    uint32_t runs;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} bench_stats;
+
+static int bench_compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted times
+static double bench_percentile(const uint64_t *sorted, uint32_t count, uint32_t percent)
+{ return stm_us(sorted[((uint64_t)count * percent + 99) / 100 - 1]); }
+
+// Sorts the times
+static bench_stats bench_compute_stats(uint64_t *times, uint32_t num_runs)
+{
+    qsort(times, num_runs, sizeof(uint64_t), bench_compare_u64);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < num_runs; ++i)
+        total += times[i];
+    bench_stats stats;
+    stats.runs = num_runs;
+    stats.mean = stm_us(total) / (double)num_runs;
+    stats.p50 = bench_percentile(times, num_runs, 50);
+    stats.p90 = bench_percentile(times, num_runs, 90);
+    stats.p99 = bench_percentile(times, num_runs, 99);
+    stats.max = stm_us(times[num_runs - 1]);
+    return stats;
+}
+
+typedef struct bench_result {
+    const char *generator;
+    uint32_t items;
+    bench_stats stats;
+} bench_result;
+
+// Runs every generator at every size, and prints the latency of
+// lay_run_context() for each. Returns the results in an array allocated with
+// malloc.
+static bench_result *benchmark_suite(lay_context *ctx, uint32_t *out_num_results)
+{
+    static const uint32_t sizes[] = { 100, 1000, 10000, 100000, 1000000 };
+    const uint32_t num_generators = sizeof(bench_generators) / sizeof(bench_generators[0]);
+    const uint32_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    bench_result *results = (bench_result*)malloc(num_generators * num_sizes * sizeof(bench_result));
+    // Enough runs to get about 2 million items through each case, within
+    // limits
+    const uint32_t max_runs = 2000;
+    uint64_t *times = (uint64_t*)malloc(max_runs * sizeof(uint64_t));
+    uint32_t num_results = 0;
+    for (uint32_t g = 0; g < num_generators; ++g) {
+        for (uint32_t s = 0; s < num_sizes; ++s) {
+            const uint32_t num_items = sizes[s];
+            uint32_t num_runs = 2000000 / num_items;
+            num_runs = num_runs < 10 ? 10 : num_runs > max_runs ? max_runs : num_runs;
+            lay_reset_context(ctx);
+            bench_generators[g].build(ctx, num_items, 0x2545f491u);
+            // Warm up
+            lay_run_context(ctx);
+            for (uint32_t run_n = 0; run_n < num_runs; ++run_n) {
+                uint64_t t1 = stm_now();
+                lay_run_context(ctx);
+                times[run_n] = stm_since(t1);
+            }
+            bench_result *result = &results[num_results++];
+            result->generator = bench_generators[g].name;
+            result->items = num_items;
+            result->stats = bench_compute_stats(times, num_runs);
+            printf("%-12s %8u items: p50 %10.2f  p90 %10.2f  p99 %10.2f  max %10.2f usecs, %6.1f M items/s\n",
+                result->generator, num_items, result->stats.p50, result->stats.p90,
+                result->stats.p99, result->stats.max,
+                num_items / result->stats.mean);
+        }
+    }
+    free(times);
+    *out_num_results = num_results;
+    return results;
+}
+
+// The separate phases of building and laying out a tree
+typedef struct bench_phases {
+    const char *generator;
+    uint32_t items;
+    // Creating the items and inserting them, after lay_reset_context()
+    bench_stats build;
+    // The first lay_run_context() after building
+    bench_stats cold;
+    // Repeated lay_run_context() on the unchanged tree
+    bench_stats steady;
+    // lay_run_context() after changing only the size of the root, like when a
+    // window is being resized
+    bench_stats resize;
+} bench_phases;
+
+// Times each phase separately for every generator, so that a regression in
+// building the tree can be told apart from one in the layout passes. Returns
+// the results in an array allocated with malloc.
+static bench_phases *benchmark_phases(lay_context *ctx, uint32_t *out_num_results)
+{
+    static const uint32_t sizes[] = { 1000, 100000 };
+    const uint32_t num_generators = sizeof(bench_generators) / sizeof(bench_generators[0]);
+    const uint32_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    bench_phases *results = (bench_phases*)malloc(num_generators * num_sizes * sizeof(bench_phases));
+    // Each iteration rebuilds the tree, and then does this many steady and
+    // resize runs
+    const uint32_t frames = 10;
+    const uint32_t max_iterations = 100;
+    uint64_t *build_times = (uint64_t*)malloc(max_iterations * sizeof(uint64_t));
+    uint64_t *cold_times = (uint64_t*)malloc(max_iterations * sizeof(uint64_t));
+    uint64_t *steady_times = (uint64_t*)malloc(max_iterations * frames * sizeof(uint64_t));
+    uint64_t *resize_times = (uint64_t*)malloc(max_iterations * frames * sizeof(uint64_t));
+    uint32_t num_results = 0;
+    for (uint32_t g = 0; g < num_generators; ++g) {
+        for (uint32_t s = 0; s < num_sizes; ++s) {
+            const uint32_t num_items = sizes[s];
+            uint32_t num_iterations = 200000 / num_items;
+            num_iterations = num_iterations < 5 ? 5
+                : num_iterations > max_iterations ? max_iterations : num_iterations;
+            for (uint32_t iter = 0; iter < num_iterations; ++iter) {
+                lay_reset_context(ctx);
+                uint64_t t1 = stm_now();
+                bench_generators[g].build(ctx, num_items, 0x2545f491u);
+                build_times[iter] = stm_since(t1);
+
+                t1 = stm_now();
+                lay_run_context(ctx);
+                cold_times[iter] = stm_since(t1);
+
+                for (uint32_t f = 0; f < frames; ++f) {
+                    t1 = stm_now();
+                    lay_run_context(ctx);
+                    steady_times[iter * frames + f] = stm_since(t1);
+                }
+
+                // Shrink the root by up to a quarter and grow it back
+                const lay_vec2 root_size = lay_get_size(ctx, 0);
+                for (uint32_t f = 0; f < frames; ++f) {
+                    const uint32_t step = f < frames / 2 ? f + 1 : frames - f - 1;
+                    lay_set_size_xy(ctx, 0,
+                        (lay_scalar)(root_size[0] - root_size[0] / 4 * step / (frames / 2)),
+                        (lay_scalar)(root_size[1] - root_size[1] / 4 * step / (frames / 2)));
+                    t1 = stm_now();
+                    lay_run_context(ctx);
+                    resize_times[iter * frames + f] = stm_since(t1);
+                }
+            }
+            bench_phases *result = &results[num_results++];
+            result->generator = bench_generators[g].name;
+            result->items = num_items;
+            result->build = bench_compute_stats(build_times, num_iterations);
+            result->cold = bench_compute_stats(cold_times, num_iterations);
+            result->steady = bench_compute_stats(steady_times, num_iterations * frames);
+            result->resize = bench_compute_stats(resize_times, num_iterations * frames);
+            printf("%-12s %8u items: build %10.2f  cold %10.2f  steady %10.2f  resize %10.2f usecs\n",
+                result->generator, num_items, result->build.p50, result->cold.p50,
+                result->steady.p50, result->resize.p50);
+        }
+    }
+    free(build_times);
+    free(cold_times);
+    free(steady_times);
+    free(resize_times);
+    *out_num_results = num_results;
+    return results;
+}
+
+static void bench_write_json_stats(FILE *out, const char *name, const bench_stats *stats)
+{
+    fprintf(out,
+        "\"%s\": {\"runs\": %u, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+        "\"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+        name, stats->runs, stats->mean, stats->p50, stats->p90, stats->p99, stats->max);
+}
+
+static void bench_write_json(
+        FILE *out, const lay_context *ctx,
+        const bench_result *results, uint32_t num_results,
+        const bench_phases *phases, uint32_t num_phases)
+{
+    fprintf(out, "{\n");
+#if defined(LAY_SOA)
+    fprintf(out, "  \"storage\": \"soa\",\n");
+#elif defined(LAY_PAGED)
+    fprintf(out, "  \"storage\": \"paged\",\n");
+#else
+    fprintf(out, "  \"storage\": \"aos\",\n");
+#endif
+#if LAY_FLOAT == 1
+    fprintf(out, "  \"coords\": \"float\",\n");
+#else
+    fprintf(out, "  \"coords\": \"int16\",\n");
+#endif
+    fprintf(out, "  \"isa\": \"%s\",\n", lay_isa_name(lay_get_isa(ctx)));
+    fprintf(out, "  \"results\": [\n");
+    for (uint32_t i = 0; i < num_results; ++i) {
+        const bench_result *r = &results[i];
+        fprintf(out,
+            "    {\"generator\": \"%s\", \"items\": %u, \"runs\": %u, "
+            "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+            "\"p99_us\": %.3f, \"max_us\": %.3f, \"items_per_sec\": %.0f}%s\n",
+            r->generator, r->items, r->stats.runs, r->stats.mean, r->stats.p50,
+            r->stats.p90, r->stats.p99, r->stats.max,
+            r->items / r->stats.mean * 1000000.0, i + 1 < num_results ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+    fprintf(out, "  \"phases\": [\n");
+    for (uint32_t i = 0; i < num_phases; ++i) {
+        const bench_phases *p = &phases[i];
+        fprintf(out, "    {\"generator\": \"%s\", \"items\": %u, ", p->generator, p->items);
+        bench_write_json_stats(out, "build", &p->build);
+        fprintf(out, ", ");
+        bench_write_json_stats(out, "cold", &p->cold);
+        fprintf(out, ", ");
+        bench_write_json_stats(out, "steady", &p->steady);
+        fprintf(out, ", ");
+        bench_write_json_stats(out, "resize", &p->resize);
+        fprintf(out, "}%s\n", i + 1 < num_phases ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// Runs the suite, and writes the results to json_path if it's not NULL
+static int run_suite(lay_context *ctx, const char *json_path)
+{
+    printf("Suite, lay_run_context latency:\n");
+    uint32_t num_results;
+    bench_result *results = benchmark_suite(ctx, &num_results);
+    printf("Suite, phases (p50):\n");
+    uint32_t num_phases;
+    bench_phases *phases = benchmark_phases(ctx, &num_phases);
+    int status = 0;
+    if (json_path != NULL) {
+        FILE *out = fopen(json_path, "w");
+        if (out != NULL) {
+            bench_write_json(out, ctx, results, num_results, phases, num_phases);
+            fclose(out);
+        } else {
+            fprintf(stderr, "Couldn't open %s for writing\n", json_path);
+            status = 1;
+        }
+    }
+    free(results);
+    free(phases);
+    return status;
+}
+
+#ifdef LAY_TRACE
+static double bench_now_us(void)
+{ return stm_us(stm_now()); }
+
+// Records a few runs of each generator's largest tree with lay_trace_writer,
+// including a resize relaid out with lay_run_dirty, and saves the trace.
+static int run_trace(lay_context *ctx, const char *trace_path)
+{
+    const uint32_t num_generators = sizeof(bench_generators) / sizeof(bench_generators[0]);
+    const uint32_t num_items = 100000;
+    lay_trace_writer writer;
+    lay_trace_writer_init(&writer, bench_now_us);
+    for (uint32_t g = 0; g < num_generators; ++g) {
+        lay_reset_context(ctx);
+        bench_generators[g].build(ctx, num_items, 0x2545f491u);
+        // Every item in the deep chain is the root of a big subtree, so only
+        // its passes are traced
+        const bool chain = bench_generators[g].build == gen_deep_chain;
+        lay_set_trace(ctx, lay_trace_writer_proc, &writer, chain ? 0 : num_items / 20);
+        for (int run_n = 0; run_n < 3; ++run_n)
+            lay_run_context(ctx);
+        const lay_vec2 root_size = lay_get_size(ctx, 0);
+        lay_set_size_xy(ctx, 0, (lay_scalar)(root_size[0] / 2), root_size[1]);
+        lay_run_dirty(ctx);
+        lay_set_trace(ctx, NULL, NULL, 0);
+    }
+    int status = 0;
+    if (lay_trace_writer_save(&writer, trace_path)) {
+        printf("Wrote %lu trace events to %s\n", (unsigned long)writer.count, trace_path);
+    } else {
+        fprintf(stderr, "Couldn't write %s\n", trace_path);
+        status = 1;
+    }
+    lay_trace_writer_destroy(&writer);
+    return status;
+}
+#endif
+
+// A frame arena for lay_set_allocator(): a bump allocator over one big block,
+// which is emptied all at once instead of freeing each block. The last block
+// that was handed out can grow in place.
+typedef struct bench_arena {
+    unsigned char *base;
+    size_t capacity;
+    size_t used;
+    size_t last;
+} bench_arena;
+
+static void *bench_arena_alloc(void *user_data, void *block, size_t old_size, size_t new_size)
+{
+    bench_arena *arena = (bench_arena*)user_data;
+    if (new_size == 0)
+        return NULL;
+    if (block != NULL && block == arena->base + arena->last) {
+        if (arena->last + new_size > arena->capacity)
+            return NULL;
+        arena->used = arena->last + new_size;
+        return block;
+    }
+    const size_t offset = (arena->used + 15) & ~(size_t)15;
+    if (offset + new_size > arena->capacity)
+        return NULL;
+    arena->last = offset;
+    arena->used = offset + new_size;
+    if (block != NULL)
+        memcpy(arena->base + offset, block, old_size < new_size ? old_size : new_size);
+    return arena->base + offset;
+}
+
+// Builds and runs the grid in a new context each time, so that the time
+// includes creating the context and growing it to fit the items. If arena is
+// not NULL, the context allocates from it, and it's emptied before each run.
+// If rects is not NULL, the results are written into it.
+static uint64_t benchmark_build_runs(
+        uint32_t num_rows, uint32_t num_cols, lay_id reserve, bench_arena *arena,
+        lay_vec4 *rects, uint32_t num_runs)
+{
+    uint64_t t1 = stm_now();
+    for (uint32_t run_n = 0; run_n < num_runs; ++run_n) {
+        lay_context ctx;
+        lay_init_context(&ctx);
+        if (arena != NULL) {
+            arena->used = 0;
+            arena->last = 0;
+            lay_set_allocator(&ctx, bench_arena_alloc, arena);
+        }
+        if (reserve > 0)
+            lay_reserve_items_capacity(&ctx, reserve);
+#ifndef LAY_PAGED
+        if (rects != NULL)
+            lay_set_rects_buffer(&ctx, rects, reserve);
+#else
+        (void)rects;
+#endif
+        build_grid(&ctx, num_rows, num_cols, NULL);
+        lay_run_context(&ctx);
+        lay_destroy_context(&ctx);
+    }
+    return stm_since(t1) / num_runs;
+}
+
+#ifndef _WIN32
+// A minimal thread pool for lay_run_context_parallel(). The calling thread and
+// the workers all take task indices from a shared counter until there are none
+// left, so a thread that finishes its tasks early just takes more of them.
+#define BENCH_MAX_THREADS 64
+
+typedef struct bench_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    pthread_t threads[BENCH_MAX_THREADS];
+    uint32_t num_threads;
+    uint32_t generation;
+    // Number of workers that haven't finished the current job
+    uint32_t busy;
+    bool quit;
+    lay_task_proc task;
+    void *task_data;
+    lay_id count;
+    lay_id next;
+} bench_pool;
+
+static void bench_pool_work(bench_pool *pool)
+{
+    for (;;) {
+        lay_id i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->count)
+            break;
+        pool->task(pool->task_data, i);
+    }
+}
+
+static void *bench_pool_worker(void *arg)
+{
+    bench_pool *pool = (bench_pool*)arg;
+    uint32_t seen = 0;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        bench_pool_work(pool);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void bench_parallel_for(void *user_data, lay_task_proc task, void *task_data, lay_id count)
+{
+    bench_pool *pool = (bench_pool*)user_data;
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->task_data = task_data;
+    pool->count = count;
+    pool->next = 0;
+    pool->busy = pool->num_threads;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    bench_pool_work(pool);
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void bench_pool_init(bench_pool *pool, uint32_t num_threads)
+{
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->num_threads = num_threads < BENCH_MAX_THREADS ? num_threads : BENCH_MAX_THREADS;
+    pool->generation = 0;
+    pool->busy = 0;
+    pool->quit = false;
+    for (uint32_t i = 0; i < pool->num_threads; ++i)
+        pthread_create(&pool->threads[i], NULL, bench_pool_worker, pool);
+}
+
+static void bench_pool_destroy(bench_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (uint32_t i = 0; i < pool->num_threads; ++i)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+static inline uint64_t benchmark_parallel_runs(lay_context *ctx, bench_pool *pool, uint32_t num_runs)
+{
+    uint64_t t1 = stm_now();
+    for (uint32_t run_n = 0; run_n < num_runs; ++run_n)
+        lay_run_context_parallel(ctx, 2048, bench_parallel_for, pool);
+    return stm_since(t1) / num_runs;
+}
+
+// A renderer thread, which copies the rects of the latest frame into a vertex
+// buffer until the writer is done. Each frame's root is 7000 plus the frame
+// number modulo 1000 wide, and has the same number in its user bits, so a frame
+// that changed while it was being read would be noticed.
+typedef struct bench_frames_reader {
+    lay_frames *frames;
+    bool done;
+    uint32_t frames_read;
+    uint32_t torn;
+} bench_frames_reader;
+
+static void *bench_frames_reader_proc(void *arg)
+{
+    bench_frames_reader *reader = (bench_frames_reader*)arg;
+    float *vertices = NULL;
+    lay_id vertices_capacity = 0;
+    while (!__atomic_load_n(&reader->done, __ATOMIC_ACQUIRE)) {
+        const lay_context *frame = lay_acquire_frame(reader->frames);
+        if (frame == NULL)
+            continue;
+        const lay_id count = frame->count;
+        if (count > vertices_capacity) {
+            vertices = (float*)realloc(vertices, count * 4 * sizeof(float));
+            vertices_capacity = count;
+        }
+        const uint32_t number = (LAY_FLAGS(frame, 0) & LAY_USERMASK) >> 16;
+        lay_get_rects(frame, 0, count, LAY_RECT_F32_XYWH, 0, 0, vertices);
+        if (vertices[2] != (float)(7000 + number) || lay_get_rect(frame, 0)[2] != (lay_scalar)(7000 + number))
+            ++reader->torn;
+        lay_release_frame(reader->frames, frame);
+        ++reader->frames_read;
+    }
+    free(vertices);
+    return NULL;
+}
+#endif
+
 // Call in main to run a test by name
 //
 // Resets string buffer and lay context before running test
@@ -242,8 +1091,30 @@ static inline void benchmark_nested(lay_context *ctx)
 
 int main(int argc, char** argv)
 {
-    (void)argc;
-    (void)argv;
+    // --suite runs only the generator suite, and --json <path> writes the
+    // results of the suite to a file. --trace <path> only writes a trace of
+    // some runs, and needs LAY_TRACE.
+    bool suite_only = false;
+    const char *json_path = NULL;
+    const char *trace_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--suite") == 0) {
+            suite_only = true;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--suite] [--json <path>] [--trace <path>]\n", argv[0]);
+            return 1;
+        }
+    }
+#ifndef LAY_TRACE
+    if (trace_path != NULL) {
+        fprintf(stderr, "Tracing needs a build with LAY_TRACE defined\n");
+        return 1;
+    }
+#endif
 #ifdef _WIN32
     SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOGPFAULTERRORBOX);
     SetUnhandledExceptionFilter(LayTestUnhandledExceptionFilter);
@@ -254,6 +1125,32 @@ int main(int argc, char** argv)
     lay_init_context(&ctx);
 
     printf("Running benchmarks\n");
+    printf("Instruction set: %s\n", lay_isa_name(lay_get_isa(&ctx)));
+#if defined(LAY_SOA)
+    printf("Storage: struct of arrays\n");
+#elif defined(LAY_PAGED)
+    printf("Storage: pages of %d items\n", LAY_PAGE_SIZE);
+#else
+    printf("Storage: array of structs\n");
+#endif
+#if LAY_FLOAT == 1
+    printf("Coordinates: float\n");
+#else
+    printf("Coordinates: int16\n");
+#endif
+
+#ifdef LAY_TRACE
+    if (trace_path != NULL) {
+        const int status = run_trace(&ctx, trace_path);
+        lay_destroy_context(&ctx);
+        return status;
+    }
+#endif
+    if (suite_only) {
+        const int status = run_suite(&ctx, json_path);
+        lay_destroy_context(&ctx);
+        return status;
+    }
 
     //LBENCH_RUN(benchmark_nested);
     uint64_t total_perfc = 0;
@@ -272,10 +1169,441 @@ int main(int argc, char** argv)
     }
 
     double avg = stm_us(total_perfc) / (double)num_runs;
-    printf("Average time: %f usecs", avg);
+    bench_stats nested_stats = bench_compute_stats(run_times, num_runs);
+    printf("Average time: %f usecs (p50 %.2f, p90 %.2f, p99 %.2f, max %.2f)\n",
+        avg, nested_stats.p50, nested_stats.p90, nested_stats.p99, nested_stats.max);
 
     free(run_times);
 
+    // Deep enough that the layout calculations would run out of stack space if
+    // they were recursive. The context is reused, so after the first run
+    // there's no heap allocation.
+    const uint32_t deep_nest_depth = 100000;
+    const uint32_t deep_nest_runs = 100;
+    uint64_t deep_nest_perfc = 0;
+    for (uint32_t run_n = 0; run_n < deep_nest_runs; ++run_n) {
+        lay_reset_context(&ctx);
+        deep_nest_perfc += benchmark_deep_nest(&ctx, deep_nest_depth);
+    }
+    printf("Deep nest (%u levels) average time: %f usecs\n",
+        deep_nest_depth, stm_us(deep_nest_perfc) / (double)deep_nest_runs);
+
+    lay_reset_context(&ctx);
+    const uint32_t grid_rows = 1000;
+    const uint32_t grid_cols = 100;
+    const uint32_t grid_runs = 200;
+    build_grid(&ctx, grid_rows, grid_cols, NULL);
+    const uint32_t grid_items = lay_items_count(&ctx);
+    printf("Grid (%u items) average time: %f usecs\n",
+        grid_items, stm_us(benchmark_runs(&ctx, grid_runs)));
+
+    lay_reset_context(&ctx);
+    build_wide_rows(&ctx, 200, 500);
+    printf("Wide rows (%u items) average time: %f usecs\n",
+        lay_items_count(&ctx), stm_us(benchmark_runs(&ctx, grid_runs)));
+
+    // Both of them again, with each instruction set level the CPU supports
+    const lay_isa default_isa = lay_get_isa(&ctx);
+    for (int isa = 0; isa < LAY_ISA_COUNT; ++isa) {
+        if (lay_set_isa(&ctx, (lay_isa)isa) != (lay_isa)isa)
+            break;
+        lay_reset_context(&ctx);
+        build_grid(&ctx, grid_rows, grid_cols, NULL);
+        uint64_t grid_isa_perfc = benchmark_runs(&ctx, grid_runs);
+        lay_reset_context(&ctx);
+        build_wide_rows(&ctx, 200, 500);
+        printf("Grid / wide rows with %s average time: %f / %f usecs\n",
+            lay_isa_name((lay_isa)isa), stm_us(grid_isa_perfc),
+            stm_us(benchmark_runs(&ctx, grid_runs)));
+    }
+    lay_set_isa(&ctx, default_isa);
+
+    // The same grid, but with the items created in a random order, before and
+    // after putting them back in tree order with lay_compact_context().
+    lay_id *grid_ids = (lay_id*)malloc(grid_items * sizeof(lay_id));
+    shuffled_ids(grid_ids, grid_items, 0x9e3779b9u);
+    lay_reset_context(&ctx);
+    build_grid(&ctx, grid_rows, grid_cols, grid_ids);
+    printf("Shuffled grid average time: %f usecs\n",
+        stm_us(benchmark_runs(&ctx, grid_runs)));
+    uint64_t t1 = stm_now();
+    lay_compact_context(&ctx, LAY_COMPACT_DEPTH_FIRST, NULL);
+    uint64_t compact_perfc = stm_since(t1);
+    printf("Shuffled grid after depth-first compaction (%f usecs) average time: %f usecs\n",
+        stm_us(compact_perfc), stm_us(benchmark_runs(&ctx, grid_runs)));
+    lay_reset_context(&ctx);
+    build_grid(&ctx, grid_rows, grid_cols, grid_ids);
+    lay_compact_context(&ctx, LAY_COMPACT_BREADTH_FIRST, NULL);
+    printf("Shuffled grid after breadth-first compaction average time: %f usecs\n",
+        stm_us(benchmark_runs(&ctx, grid_runs)));
+    free(grid_ids);
+
+    // Building the grid and running it, with and without growing the context
+    // while the items are created
+    bench_arena arena;
+    arena.capacity = 64 * 1024 * 1024;
+    arena.base = (unsigned char*)malloc(arena.capacity);
+    printf("Grid build and run (%u items) average time:\n", grid_items);
+    printf("    new context, growing: %f usecs\n",
+        stm_us(benchmark_build_runs(grid_rows, grid_cols, 0, NULL, NULL, grid_runs)));
+    printf("    new context, reserved: %f usecs\n",
+        stm_us(benchmark_build_runs(grid_rows, grid_cols, grid_items, NULL, NULL, grid_runs)));
+#ifndef LAY_PAGED
+    lay_vec4 *grid_rects = (lay_vec4*)malloc(grid_items * sizeof(lay_vec4));
+    printf("    new context, reserved, rects buffer given: %f usecs\n",
+        stm_us(benchmark_build_runs(grid_rows, grid_cols, grid_items, NULL, grid_rects, grid_runs)));
+    free(grid_rects);
+#endif
+    printf("    new context in an arena, growing: %f usecs\n",
+        stm_us(benchmark_build_runs(grid_rows, grid_cols, 0, &arena, NULL, grid_runs)));
+    uint64_t t_build = stm_now();
+    for (uint32_t run_n = 0; run_n < grid_runs; ++run_n) {
+        lay_reset_context(&ctx);
+        build_grid(&ctx, grid_rows, grid_cols, NULL);
+        lay_run_context(&ctx);
+    }
+    printf("    reused context: %f usecs\n", stm_us(stm_since(t_build) / grid_runs));
+    free(arena.base);
+
+    // Getting the results out for a renderer, one item at a time and in bulk
+    lay_reset_context(&ctx);
+    build_grid(&ctx, grid_rows, grid_cols, NULL);
+    lay_run_context(&ctx);
+    float *vertices = (float*)malloc(grid_items * 4 * sizeof(float));
+    uint64_t t_export = stm_now();
+    for (uint32_t run_n = 0; run_n < grid_runs; ++run_n) {
+        for (lay_id i = 0; i < grid_items; ++i) {
+            lay_vec4 r = lay_get_rect(&ctx, i);
+            vertices[4 * i + 0] = (float)r[0] + 10.0f;
+            vertices[4 * i + 1] = (float)r[1] + 20.0f;
+            vertices[4 * i + 2] = (float)r[2];
+            vertices[4 * i + 3] = (float)r[3];
+        }
+    }
+    printf("Grid rects to float xywh with lay_get_rect average time: %f usecs\n",
+        stm_us(stm_since(t_export) / grid_runs));
+    static const char *const format_names[] = {
+        "int16 xywh", "float xywh", "float x0y0x1y1"
+    };
+    for (int format = 0; format < 3; ++format) {
+        t_export = stm_now();
+        for (uint32_t run_n = 0; run_n < grid_runs; ++run_n)
+            lay_get_rects(&ctx, 0, grid_items, (lay_rect_format)format, 10, 20, vertices);
+        printf("Grid rects to %s with lay_get_rects average time: %f usecs\n",
+            format_names[format], stm_us(stm_since(t_export) / grid_runs));
+    }
+    free(vertices);
+
+#ifndef _WIN32
+    // A bigger grid, run on all of the CPUs. The calling thread is one of
+    // them, so the pool gets one less worker.
+    lay_reset_context(&ctx);
+    build_grid(&ctx, 2000, 100, NULL);
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bench_pool pool;
+    bench_pool_init(&pool, num_cpus > 1 ? (uint32_t)(num_cpus - 1) : 0);
+    printf("Grid (%u items) average time: %f usecs\n",
+        lay_items_count(&ctx), stm_us(benchmark_runs(&ctx, grid_runs)));
+    printf("Grid (%u items) parallel on %u threads average time: %f usecs\n",
+        lay_items_count(&ctx), pool.num_threads + 1,
+        stm_us(benchmark_parallel_runs(&ctx, &pool, grid_runs)));
+#endif
+
+    // Many small independent contexts, run one at a time and as a batch
+    const uint32_t num_rows = 5000;
+    const uint32_t rows_runs = 200;
+    lay_context *rows = (lay_context*)malloc(num_rows * sizeof(lay_context));
+    lay_context **row_ptrs = (lay_context**)malloc(num_rows * sizeof(lay_context*));
+    for (uint32_t i = 0; i < num_rows; ++i) {
+        lay_init_context(&rows[i]);
+        build_list_row(&rows[i], i);
+        row_ptrs[i] = &rows[i];
+    }
+    uint64_t t_rows = stm_now();
+    for (uint32_t run_n = 0; run_n < rows_runs; ++run_n) {
+        for (uint32_t i = 0; i < num_rows; ++i)
+            lay_run_context(row_ptrs[i]);
+    }
+    printf("%u contexts with lay_run_context average time: %f usecs\n",
+        num_rows, stm_us(stm_since(t_rows) / rows_runs));
+    t_rows = stm_now();
+    for (uint32_t run_n = 0; run_n < rows_runs; ++run_n)
+        lay_run_contexts(row_ptrs, num_rows, 2048, NULL, NULL);
+    printf("%u contexts with lay_run_contexts average time: %f usecs\n",
+        num_rows, stm_us(stm_since(t_rows) / rows_runs));
+#ifndef _WIN32
+    t_rows = stm_now();
+    for (uint32_t run_n = 0; run_n < rows_runs; ++run_n)
+        lay_run_contexts(row_ptrs, num_rows, 2048, bench_parallel_for, &pool);
+    printf("%u contexts with lay_run_contexts on %u threads average time: %f usecs\n",
+        num_rows, pool.num_threads + 1, stm_us(stm_since(t_rows) / rows_runs));
+    bench_pool_destroy(&pool);
+#endif
+    for (uint32_t i = 0; i < num_rows; ++i)
+        lay_destroy_context(&rows[i]);
+    free(row_ptrs);
+    free(rows);
+
+    // Hit testing the grid at random points, by scanning every rect and with
+    // lay_find_item
+    lay_reset_context(&ctx);
+    build_grid(&ctx, grid_rows, grid_cols, NULL);
+    lay_run_context(&ctx);
+    const uint32_t num_points = 1000;
+    lay_scalar *points = (lay_scalar*)malloc(2 * num_points * sizeof(lay_scalar));
+    uint32_t point_state = 1;
+    for (uint32_t i = 0; i < num_points; ++i) {
+        points[2 * i] = (lay_scalar)(bench_rand(&point_state) % 8000);
+        points[2 * i + 1] = (lay_scalar)(bench_rand(&point_state) % (grid_rows * 10));
+    }
+    lay_id scan_sum = 0, find_sum = 0;
+    uint64_t t_scan = stm_now();
+    for (uint32_t i = 0; i < num_points; ++i) {
+        const lay_scalar x = points[2 * i], y = points[2 * i + 1];
+        lay_id found = LAY_INVALID_ID;
+        for (lay_id id = 0; id < grid_items; ++id) {
+            const lay_vec4 r = lay_get_rect(&ctx, id);
+            if (x >= r[0] && y >= r[1] && x < r[0] + r[2] && y < r[1] + r[3])
+                found = id;
+        }
+        scan_sum += found;
+    }
+    t_scan = stm_since(t_scan) / num_points;
+    uint64_t t_find = stm_now();
+    for (uint32_t i = 0; i < num_points; ++i)
+        find_sum += lay_find_item(&ctx, 0, points[2 * i], points[2 * i + 1], LAY_ANY, LAY_ANY);
+    t_find = stm_since(t_find) / num_points;
+    printf("Grid hit test average time: %f usecs, with lay_find_item: %f usecs%s\n",
+        stm_us(t_scan), stm_us(t_find), scan_sum == find_sum ? "" : " (MISMATCH)");
+    free(points);
+
+    // A long list, with and without the subtree cache
+    const uint32_t list_rows = 20000;
+    lay_reset_context(&ctx);
+    build_list(&ctx, list_rows);
+    const uint32_t list_items = lay_items_count(&ctx);
+    const uint64_t list_perfc = benchmark_runs(&ctx, grid_runs);
+    lay_set_memo(&ctx, 64);
+    const uint64_t list_memo_perfc = benchmark_runs(&ctx, grid_runs);
+    const lay_memo_stats memo_stats = lay_get_memo_stats(&ctx);
+    lay_set_memo(&ctx, 0);
+    printf("List (%u items) average time: %f usecs, with subtree cache: %f usecs (%.1f%% hits)\n",
+        list_items, stm_us(list_perfc), stm_us(list_memo_perfc),
+        100.0 * (double)(memo_stats.size_hits + memo_stats.arrange_hits)
+            / (double)(memo_stats.size_lookups + memo_stats.arrange_lookups));
+
+    // A grid where one cell is resized every frame, with the changed rects
+    // tracked for partial redraws
+    lay_reset_context(&ctx);
+    build_grid(&ctx, grid_rows, grid_cols, NULL);
+    uint64_t track_perfc[2];
+    lay_id tracked_changes = 0;
+    lay_id tracked_damage = 0;
+    for (int tracked = 0; tracked < 2; ++tracked) {
+        lay_set_track_changes(&ctx, tracked);
+        lay_run_context(&ctx);
+        const uint64_t t_track = stm_now();
+        for (uint32_t run_n = 0; run_n < grid_runs; ++run_n) {
+            lay_set_size_xy(&ctx, 3, run_n % 2 ? 20 : 30, 8);
+            lay_run_context(&ctx);
+        }
+        track_perfc[tracked] = stm_since(t_track) / grid_runs;
+    }
+    lay_vec4 damage[LAY_DAMAGE_RECTS];
+    lay_get_changes(&ctx, &tracked_changes);
+    tracked_damage = lay_get_damage(&ctx, damage);
+    lay_set_track_changes(&ctx, 0);
+    printf("Grid with one cell resized per frame average time: %f usecs, tracking changes: %f usecs (%u changed, %u damage rects)\n",
+        stm_us(track_perfc[0]), stm_us(track_perfc[1]),
+        (unsigned)tracked_changes, (unsigned)tracked_damage);
+
+    // Getting the grid at startup: building and running it, loading a snapshot
+    // of it with the rects, or using the snapshot in place
+    lay_reset_context(&ctx);
+    build_grid(&ctx, grid_rows, grid_cols, NULL);
+    lay_run_context(&ctx);
+    const size_t snapshot_size = lay_save_context(&ctx, 1, NULL, 0);
+    void *snapshot = malloc(snapshot_size);
+    lay_save_context(&ctx, 1, snapshot, snapshot_size);
+    const uint32_t startup_runs = 100;
+    uint64_t t_startup = stm_now();
+    for (uint32_t run_n = 0; run_n < startup_runs; ++run_n) {
+        lay_context built;
+        lay_init_context(&built);
+        build_grid(&built, grid_rows, grid_cols, NULL);
+        lay_run_context(&built);
+        lay_destroy_context(&built);
+    }
+    const uint64_t startup_build_perfc = stm_since(t_startup) / startup_runs;
+    t_startup = stm_now();
+    for (uint32_t run_n = 0; run_n < startup_runs; ++run_n) {
+        lay_context loaded;
+        lay_init_context(&loaded);
+        lay_load_context(&loaded, snapshot, snapshot_size);
+        lay_destroy_context(&loaded);
+    }
+    const uint64_t startup_load_perfc = stm_since(t_startup) / startup_runs;
+    printf("Grid (%u items, %u KB snapshot) startup average time: build and run %f usecs, lay_load_context %f usecs",
+        grid_items, (unsigned)(snapshot_size / 1024),
+        stm_us(startup_build_perfc), stm_us(startup_load_perfc));
+#ifndef LAY_PAGED
+    t_startup = stm_now();
+    for (uint32_t run_n = 0; run_n < startup_runs; ++run_n) {
+        lay_context mapped;
+        lay_init_context(&mapped);
+        lay_map_context(&mapped, snapshot, snapshot_size);
+        lay_destroy_context(&mapped);
+    }
+    printf(", lay_map_context %f usecs", stm_us(stm_since(t_startup) / startup_runs));
+#ifndef _WIN32
+    // Mapped from a file each time, and touching every rect, since the pages
+    // are only read in when they're used
+    char snapshot_path[] = "/tmp/lay_bench_snapshot_XXXXXX";
+    const int snapshot_fd = mkstemp(snapshot_path);
+    if (snapshot_fd >= 0) {
+        const bool written = write(snapshot_fd, snapshot, snapshot_size) == (ssize_t)snapshot_size;
+        close(snapshot_fd);
+        lay_scalar sum = 0;
+        t_startup = stm_now();
+        for (uint32_t run_n = 0; written && run_n < startup_runs; ++run_n) {
+            const int fd = open(snapshot_path, O_RDONLY);
+            void *file = mmap(NULL, snapshot_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            lay_context mapped;
+            lay_init_context(&mapped);
+            lay_map_context(&mapped, file, snapshot_size);
+            for (lay_id i = 0; i < grid_items; ++i)
+                sum += lay_get_rect(&mapped, i)[2];
+            lay_destroy_context(&mapped);
+            munmap(file, snapshot_size);
+            close(fd);
+        }
+        if (written)
+            printf(", from a mapped file reading every rect %f usecs%s",
+                stm_us(stm_since(t_startup) / startup_runs), sum == 0 ? " " : "");
+        unlink(snapshot_path);
+    }
+#endif
+#endif
+    printf("\n");
+    free(snapshot);
+
+    // Building a list of identical rows one item at a time, and by copying a
+    // template row
+    const uint32_t copy_rows = 10000;
+    lay_context row_template;
+    lay_init_context(&row_template);
+    build_list_row(&row_template, 0);
+    uint64_t t_items = stm_now();
+    for (uint32_t run_n = 0; run_n < grid_runs; ++run_n) {
+        lay_reset_context(&ctx);
+        lay_id root = lay_item(&ctx);
+        lay_id prev = build_list_row(&ctx, 0);
+        lay_insert(&ctx, root, prev);
+        for (uint32_t i = 1; i < copy_rows; ++i) {
+            lay_id row = build_list_row(&ctx, 0);
+            lay_append(&ctx, prev, row);
+            prev = row;
+        }
+    }
+    t_items = stm_since(t_items) / grid_runs;
+    uint64_t t_copies = stm_now();
+    for (uint32_t run_n = 0; run_n < grid_runs; ++run_n) {
+        lay_reset_context(&ctx);
+        lay_id root = lay_item(&ctx);
+        lay_instantiate(&ctx, &row_template, 0, root, copy_rows);
+    }
+    t_copies = stm_since(t_copies) / grid_runs;
+    printf("List build (%u items) average time: %f usecs, with lay_instantiate: %f usecs\n",
+        lay_items_count(&ctx), stm_us(t_items), stm_us(t_copies));
+
+    // A single row with a million children, inserted one at a time and as
+    // ranges. The ranges are small enough that the new items are still in the
+    // cache when they're inserted.
+    const uint32_t wide_children = 1000000;
+    const uint32_t wide_runs = 10;
+    uint64_t t_insert = stm_now();
+    for (uint32_t run_n = 0; run_n < wide_runs; ++run_n) {
+        lay_reset_context(&ctx);
+        lay_id root = lay_item(&ctx);
+        lay_set_contain(&ctx, root, LAY_ROW);
+        for (uint32_t i = 0; i < wide_children; ++i) {
+            lay_id child = lay_item(&ctx);
+            lay_set_size_xy(&ctx, child, 10, 10);
+            lay_insert(&ctx, root, child);
+        }
+    }
+    t_insert = stm_since(t_insert) / wide_runs;
+    uint64_t t_range = stm_now();
+    for (uint32_t run_n = 0; run_n < wide_runs; ++run_n) {
+        lay_reset_context(&ctx);
+        lay_id root = lay_item(&ctx);
+        lay_set_contain(&ctx, root, LAY_ROW);
+        for (uint32_t block = 0; block < wide_children; block += 1000) {
+            lay_id first = lay_items(&ctx, 1000);
+            for (lay_id i = first; i < first + 1000; ++i)
+                lay_set_size_xy(&ctx, i, 10, 10);
+            lay_insert_range(&ctx, root, first, 1000);
+        }
+    }
+    t_range = stm_since(t_range) / wide_runs;
+    printf("Row with %u children build average time: %f usecs, with lay_insert_range in blocks of 1000: %f usecs, run: %f usecs\n",
+        wide_children, stm_us(t_insert), stm_us(t_range), stm_us(benchmark_runs(&ctx, wide_runs)));
+
+    // Scrolling through a virtual list of ten million rows, making only the
+    // visible rows each frame
+    const uint32_t virtual_frames = 10000;
+    lay_reset_context(&row_template);
+    build_list_row(&row_template, 0);
+    uint64_t t_virtual = stm_now();
+    for (uint32_t frame = 0; frame < virtual_frames; ++frame) {
+        const lay_virtual_rows rows = lay_virtual_rows_uniform(
+            10000000, 24, frame * 997.0, 1000);
+        lay_reset_context(&ctx);
+        lay_id viewport = lay_item(&ctx);
+        lay_set_size_xy(&ctx, viewport, 320, 1000);
+        lay_id list = lay_virtual_list(&ctx, viewport, 1, &rows);
+        lay_instantiate(&ctx, &row_template, 0, list, rows.count);
+        lay_run_context(&ctx);
+    }
+    printf("Virtual list of 10000000 rows (%u items in view) average time per frame: %f usecs\n",
+        lay_items_count(&ctx), stm_us(stm_since(t_virtual) / virtual_frames));
+    lay_destroy_context(&row_template);
+
+#ifndef _WIN32
+    // Building frames while another thread reads the previous one
+    const uint32_t num_frames = 2000;
+    lay_frames frames;
+    lay_init_frames(&frames, 3);
+    bench_frames_reader reader;
+    reader.frames = &frames;
+    reader.done = false;
+    reader.frames_read = 0;
+    reader.torn = 0;
+    pthread_t reader_thread;
+    pthread_create(&reader_thread, NULL, bench_frames_reader_proc, &reader);
+    uint32_t writer_waits = 0;
+    uint64_t t_frames = stm_now();
+    for (uint32_t frame_n = 0; frame_n < num_frames; ++frame_n) {
+        lay_context *frame;
+        while ((frame = lay_begin_frame(&frames)) == NULL)
+            ++writer_waits;
+        build_grid(frame, 100, 100, NULL);
+        lay_set_size_xy(frame, 0, (lay_scalar)(7000 + frame_n % 1000), 1000);
+        LAY_FLAGS(frame, 0) |= (frame_n % 1000) << 16;
+        lay_run_context(frame);
+        lay_publish_frame(&frames);
+    }
+    t_frames = stm_since(t_frames) / num_frames;
+    __atomic_store_n(&reader.done, true, __ATOMIC_RELEASE);
+    pthread_join(reader_thread, NULL);
+    printf("Frames (%u items) built while another thread reads them average time: %f usecs "
+        "(%u frames read, %u torn, %u writer waits)\n",
+        lay_items_count(&frames.contexts[0]), stm_us(t_frames),
+        reader.frames_read, reader.torn, writer_waits);
+    lay_destroy_frames(&frames);
+#endif
+
+    const int status = run_suite(&ctx, json_path);
     lay_destroy_context(&ctx);
-    return 0;
+    return status;
 }
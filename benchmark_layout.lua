@@ -0,0 +1,130 @@
+-- Compares building a big layout from Lua one call at a time with building it
+-- from a nested table with ctx:build(), and reading the rects back with
+-- ctx:rect() with reading them through LuaJIT FFI. Run it with LuaJIT from a
+-- directory where the layout module can be found:
+--
+--   luajit benchmark_layout.lua
+
+require("layout")
+
+local num_rows = 1000
+local num_cols = 20
+local num_runs = 20
+
+-- One call per item and property
+local function build_with_calls(ctx)
+    local root = ctx:item()
+    ctx:set_size(root, 8000, num_rows * 10)
+    ctx:set_contain(root, Layout.COLUMN)
+    for i = 1, num_rows do
+        local row = ctx:item()
+        ctx:set_behave(row, Layout.HFILL)
+        ctx:set_contain(row, Layout.ROW)
+        ctx:insert(root, row)
+        for j = 1, num_cols do
+            local cell = ctx:item()
+            if j % 3 == 1 then
+                ctx:set_behave(cell, Layout.FILL)
+            else
+                ctx:set_size(cell, 20, 8)
+                ctx:set_margins(cell, 1, 1, 1, 1)
+                ctx:set_behave(cell, Layout.TOP)
+            end
+            ctx:insert(row, cell)
+        end
+    end
+    return root
+end
+
+-- The same layout as a table for ctx:build()
+local function grid_description()
+    local root = {contain = Layout.COLUMN, size = {8000, num_rows * 10}}
+    for i = 1, num_rows do
+        local row = {contain = Layout.ROW, behave = Layout.HFILL}
+        for j = 1, num_cols do
+            if j % 3 == 1 then
+                row[j] = {behave = Layout.FILL}
+            else
+                row[j] = {size = {20, 8}, margins = {1, 1, 1, 1}, behave = Layout.TOP}
+            end
+        end
+        root[i] = row
+    end
+    return root
+end
+
+local function time_runs(f)
+    local start = os.clock()
+    for run = 1, num_runs do
+        f()
+    end
+    return (os.clock() - start) / num_runs * 1000000
+end
+
+local ctx = Layout.new()
+local description = grid_description()
+
+local calls_us = time_runs(function()
+    ctx:reset()
+    build_with_calls(ctx)
+end)
+local build_us = time_runs(function()
+    ctx:reset()
+    ctx:build(description)
+end)
+local table_and_build_us = time_runs(function()
+    ctx:reset()
+    ctx:build(grid_description())
+end)
+
+-- Both ways give the same layout
+ctx:reset()
+build_with_calls(ctx)
+ctx:run()
+local expected = {ctx:rect(num_cols + 2)}
+ctx:reset()
+ctx:build(description)
+ctx:run()
+local actual = {ctx:rect(num_cols + 2)}
+for i = 1, 4 do
+    assert(expected[i] == actual[i], "ctx:build() gave a different layout")
+end
+
+local num_items = 1 + num_rows * (num_cols + 1)
+print(string.format("Grid (%d items) build average time:", num_items))
+print(string.format("    one call per item and property: %f usecs", calls_us))
+print(string.format("    ctx:build(): %f usecs (%.1fx faster)", build_us, calls_us / build_us))
+print(string.format("    making the table and ctx:build(): %f usecs", table_and_build_us))
+
+-- Reading all of the rects back, one call per item or through the pointer from
+-- ctx:rects()
+local function sum_with_calls()
+    local sum = 0
+    for i = 0, num_items - 1 do
+        local x, y, w, h = ctx:rect(i)
+        sum = sum + x + y + w + h
+    end
+    return sum
+end
+
+local calls_sum
+local read_calls_us = time_runs(function() calls_sum = sum_with_calls() end)
+print("Grid rects read average time:")
+print(string.format("    ctx:rect(): %f usecs", read_calls_us))
+
+local has_ffi, ffi = pcall(require, "ffi")
+if has_ffi then
+    local ffi_sum
+    local read_ffi_us = time_runs(function()
+        local ptr, count, scalar = ctx:rects()
+        local rects = ffi.cast(scalar .. " *", ptr)
+        local sum = 0
+        for i = 0, 4 * count - 1 do
+            sum = sum + rects[i]
+        end
+        ffi_sum = sum
+    end)
+    assert(ffi_sum == calls_sum, "ctx:rects() gave different rects")
+    print(string.format("    ctx:rects() with FFI: %f usecs (%.1fx faster)",
+        read_ffi_us, read_calls_us / read_ffi_us))
+end
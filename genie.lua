@@ -13,7 +13,7 @@ newaction {
     description = "Emit GCC assembly output for a file",
     -- Hard-coded for windows+gmake, probably has shell quote bugs
     execute = function ()
-        os.execute("gcc -ggdb1 -Ofast -S -fno-stack-check -fno-dwarf2-cfi-asm -fno-asynchronous-unwind-tables -masm=intel -march=nehalem -fverbose-asm -DNDEBUG " .. _ARGS[1])
+        os.execute("gcc -ggdb1 -Ofast -S -fno-stack-check -fno-dwarf2-cfi-asm -fno-asynchronous-unwind-tables -masm=intel -fverbose-asm -DNDEBUG " .. _ARGS[1])
     end
 }
 
@@ -27,6 +27,17 @@ newoption {
     }
 }
 
+newoption {
+    trigger = "storage",
+    value = "itemstorage",
+    description = "Store the items as an array of structs, a struct of arrays, or in pages",
+    allowed = {
+        { "aos", "Array of lay_item_t structs (default)" },
+        { "soa", "One array per item property (LAY_SOA)" },
+        { "paged", "Fixed-size pages of items that never move (LAY_PAGED)" },
+    }
+}
+
 local targetDir = path.join("./build", _ACTION, "bin")
 
 function incl_luajit()
@@ -79,6 +90,12 @@ function lay_project(project_name, as_build_type, src_file)
         configuration { "float" }
             defines { "LAY_FLOAT=1" }
 
+        configuration { "soa" }
+            defines { "LAY_SOA" }
+
+        configuration { "paged" }
+            defines { "LAY_PAGED" }
+
         configuration { "vs*", "windows" }
             defines { "_CRT_SECURE_NO_WARNINGS" }
             buildoptions {
@@ -87,13 +104,9 @@ function lay_project(project_name, as_build_type, src_file)
             }
 
         configuration { "gmake", "windows" }
-            -- Nehalem chips were released in 2008, and include SSE4.
-            --
-            -- Note that gcc -Q --help=target -march=nehalem (or whatever other
-            -- arch) will not correctly display the enabled/disabled flags for
-            -- stuff like SSE, etc. This is a known problem with gcc (it's on
-            -- their bug tracker).  -march=native, however, will show the
-            -- enabled/disabled flags correctly.
+            -- No -march: layout.h compiles its hot code for several
+            -- instruction set levels and picks one at runtime (see lay_isa),
+            -- so the binaries also run on CPUs older than the build machine.
             buildoptions {
                 "-std=c99",
                 "-Wno-unused-parameter",
@@ -102,7 +115,6 @@ function lay_project(project_name, as_build_type, src_file)
                 "-fstrict-overflow",
                 "-fstrict-aliasing",
                 "-Wstrict-aliasing=3",
-                "-march=nehalem"
             }
 
         configuration "Debug or Develop"
@@ -16,6 +16,7 @@
 // All other files in your project should not define LAY_IMPLEMENTATION.
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef LAY_EXPORT
 #define LAY_EXPORT extern
@@ -63,10 +64,11 @@ typedef int16_t lay_vec4 __attribute__ ((__vector_size__ (8), aligned(2)));
 typedef int16_t lay_vec2 __attribute__ ((__vector_size__ (4), aligned(2)));
 #endif // LAY_FLOAT
 
-// Note that we're not actually going to make any explicit use of any
-// platform's SIMD instructions -- we're just using the vector extension for
+// Note that we're not making any explicit use of any platform's SIMD
+// instructions with these types -- we're just using the vector extension for
 // more convenient syntax. Therefore, we can specify more relaxed alignment
-// requirements. See the end of this file for some notes about this.
+// requirements. (The few kernels that do use SIMD instructions gather their
+// data into separate arrays first. See LAY_NO_SIMD.)
 
 // MSVC doesn't have the vetor_size attribute, but we want convenient indexing
 // operators for our layout logic code. Therefore, we force C++ compilation in
@@ -88,19 +90,140 @@ struct lay_vec2 {
 };
 #endif // __GNUC__/__clang__ or _MSC_VER
 
+#ifndef LAY_SOA
 typedef struct lay_item_t {
     uint32_t flags;
     lay_id first_child;
+    // Kept so that lay_insert() doesn't have to walk the children
+    lay_id last_child;
     lay_id next_sibling;
+    lay_id parent;
     lay_vec4 margins;
     lay_vec2 size;
 } lay_item_t;
+#endif
+
+#ifdef LAY_PAGED
+#ifdef LAY_SOA
+#error "LAY_PAGED can't be used together with LAY_SOA"
+#endif
+// The number of items in each page. Must be a power of two.
+#ifndef LAY_PAGE_SIZE
+#define LAY_PAGE_SIZE 1024
+#endif
+typedef struct lay_page {
+    lay_item_t items[LAY_PAGE_SIZE];
+    lay_vec4 rects[LAY_PAGE_SIZE];
+} lay_page;
+#endif
+
+// Allocation procedure, set with lay_set_allocator(). When new_size is not 0,
+// it should behave like realloc: block is either NULL or a block previously
+// returned by the procedure, and the contents should be preserved. When
+// new_size is 0, block should be freed, and the return value is ignored.
+// old_size is the size the block was allocated with (0 when block is NULL), so
+// that allocators which can't resize blocks in place, such as arenas, can copy
+// the contents themselves.
+typedef void *(*lay_alloc_proc)(void *user_data, void *block, size_t old_size, size_t new_size);
+
+#ifdef LAY_STATS
+// Counters for the work done by a context, only kept when LAY_STATS is
+// defined. They add up across runs until lay_reset_stats() is called. For the
+// per-dimension counters, [0] is horizontal and [1] is vertical.
+typedef struct lay_stats {
+    // Items whose size was calculated, and items whose children were arranged
+    uint64_t calc_size_items[2];
+    uint64_t arrange_items[2];
+    // Lines laid out by wrapping rows and columns
+    uint64_t wrapped_lines[2];
+    // Children of rows and columns that were shrunk to fit, and children that
+    // were stretched to fill the extra space
+    uint64_t squeezed_items[2];
+    uint64_t filler_items[2];
+    // Times lay_item() had to grow the item storage
+    uint64_t item_reallocs;
+    // The deepest item below the root of a run, where the root's children are
+    // at depth 1
+    uint32_t max_depth;
+} lay_stats;
+#endif
+
+#ifdef LAY_TRACE
+typedef enum lay_trace_phase {
+    LAY_TRACE_BEGIN = 0,
+    LAY_TRACE_END = 1
+} lay_trace_phase;
+
+// Called at the beginning and end of each traced span, when LAY_TRACE is
+// defined. See lay_set_trace(). name is a string literal, item is the root of
+// the run or subtree, and dim is 0 or 1 for spans in the horizontal or vertical
+// passes, or -1 for a whole run.
+typedef void (*lay_trace_proc)(
+        void *user_data, lay_trace_phase phase, const char *name, lay_id item, int dim);
+#endif
 
 typedef struct lay_context {
+#ifdef LAY_SOA
+    // Each item property in its own array, indexed by item id. The margins and
+    // sizes are also split by dimension, so that a horizontal or vertical pass
+    // only has to read the half it uses.
+    uint32_t *flags;
+    lay_id *first_child;
+    lay_id *last_child;
+    lay_id *next_sibling;
+    lay_id *parent;
+    // [0]: left and right margins, [1]: top and bottom margins
+    lay_vec2 *margins[2];
+    // [0]: widths, [1]: heights
+    lay_scalar *sizes[2];
+#elif defined(LAY_PAGED)
+    // Fixed-size pages of items and their rects. Pages never move once they are
+    // allocated -- only this table of pointers to them is reallocated.
+    lay_page **pages;
+    lay_id pages_capacity;
+#else
     lay_item_t *items;
+#endif
+#ifndef LAY_PAGED
+    // The calculated rects. They are allocated when the layout is run, or given
+    // by lay_set_rects_buffer(). rects_count is the number of items whose rects
+    // have been initialized since the context was reset.
     lay_vec4 *rects;
+    lay_id rects_capacity;
+    lay_id rects_count;
+    // Set when rects is from lay_set_rects_buffer(), so it isn't ours to free
+    uint32_t rects_external;
+    // Set when the items are in a snapshot given to lay_map_context()
+    uint32_t items_external;
+#endif
     lay_id capacity;
     lay_id count;
+    // Per-item results kept between calls to lay_run_dirty(). Allocated on
+    // first use.
+    lay_vec4 *cache;
+    lay_id cache_capacity;
+    // Scratch space for lay_run_context_parallel(). Allocated on first use.
+    lay_id *tasks;
+    lay_id tasks_capacity;
+    // The lay_isa used for the layout calculations
+    uint32_t isa;
+    // Set with lay_set_allocator(). If alloc is NULL, LAY_REALLOC and LAY_FREE
+    // are used.
+    lay_alloc_proc alloc;
+    void *alloc_data;
+#ifdef LAY_STATS
+    lay_stats stats;
+#endif
+#ifdef LAY_TRACE
+    // Set with lay_set_trace()
+    lay_trace_proc trace;
+    void *trace_data;
+    lay_id trace_min_items;
+#endif
+    // Set up by lay_set_memo()
+    struct lay_memo *memo;
+    // Set up by lay_set_track_changes()
+    struct lay_changes *changes;
 } lay_context;
 
 // Container flags to pass to lay_set_container()
@@ -195,8 +318,7 @@ enum {
     // should be all bits as 1 instead of INT_MAX
     LAY_USERMASK = 0x7fff0000,
 
-    // a special mask passed to lay_find_item() (currently does not exist, was
-    // not ported from oui)
+    // a special mask passed to lay_find_item() and lay_find_items()
     LAY_ANY = 0x7fffffff
 };
 
@@ -217,6 +339,9 @@ enum {
     LAY_ITEM_VFIXED      = 0x1000,
     // bit 11-12
     LAY_ITEM_FIXED_MASK  = LAY_ITEM_HFIXED | LAY_ITEM_VFIXED,
+    // item, or one of its descendants, has changed since the last
+    // lay_run_dirty() (bit 13)
+    LAY_ITEM_DIRTY       = 0x2000,
 
     // which flag bits will be compared
     LAY_ITEM_COMPARE_MASK = LAY_ITEM_BOX_MODEL_MASK
@@ -224,6 +349,40 @@ enum {
         | LAY_USERMASK
 };
 
+// Item orders for lay_compact_context()
+typedef enum lay_compact_order {
+    // Each item is followed by all of its descendants, and then by its next
+    // sibling
+    LAY_COMPACT_DEPTH_FIRST = 0,
+    // The children of an item are next to each other, followed by the
+    // grandchildren, etc.
+    LAY_COMPACT_BREADTH_FIRST = 1
+} lay_compact_order;
+
+// Instruction set levels that the layout calculations are built for. See
+// lay_set_isa().
+typedef enum lay_isa {
+    // Whatever the compiler targets for the rest of your program
+    LAY_ISA_GENERIC = 0,
+    // x86 AVX2, BMI1 and BMI2 (Haswell and later)
+    LAY_ISA_AVX2 = 1,
+    // x86 AVX-512 F, BW, DQ and VL (Skylake-SP and later)
+    LAY_ISA_AVX512 = 2,
+    LAY_ISA_COUNT
+} lay_isa;
+
+// Output formats for lay_get_rects() and lay_get_rects_by_ids()
+typedef enum lay_rect_format {
+    // int16_t x, y, width, height (8 bytes per rect). With LAY_FLOAT, the
+    // values are rounded toward zero and clamped to the int16_t range.
+    LAY_RECT_I16_XYWH = 0,
+    // float x, y, width, height (16 bytes per rect)
+    LAY_RECT_F32_XYWH = 1,
+    // float x0, y0, x1, y1: the top left and bottom right corners (16 bytes
+    // per rect)
+    LAY_RECT_F32_X0Y0X1Y1 = 2
+} lay_rect_format;
+
 LAY_STATIC_INLINE lay_vec4 lay_vec4_xyzw(lay_scalar x, lay_scalar y, lay_scalar z, lay_scalar w)
 {
 #if (defined(__GNUC__) || defined(__clang__)) && !defined(__cplusplus)
@@ -242,13 +401,51 @@ LAY_STATIC_INLINE lay_vec4 lay_vec4_xyzw(lay_scalar x, lay_scalar y, lay_scalar
 // if you would like to use it again after calling lay_destroy_context() on it.
 LAY_EXPORT void lay_init_context(lay_context *ctx);
 
+// Makes a context get all of its heap memory from `alloc` (see lay_alloc_proc)
+// instead of LAY_REALLOC and LAY_FREE, for example to put it in an arena that
+// is cleared every frame. This must be called after lay_init_context() and
+// before anything is allocated for the context. user_data is passed to every
+// call of `alloc`. Passing NULL for `alloc` goes back to LAY_REALLOC and
+// LAY_FREE.
+//
+// lay_destroy_context() frees everything through `alloc`. If the memory is
+// going to be released some other way, you can skip destroying the context,
+// and call lay_init_context() on it again before reusing it.
+LAY_EXPORT void lay_set_allocator(lay_context *ctx, lay_alloc_proc alloc, void *user_data);
+
 // Reserve enough heap memory to contain `count` items without needing to
 // reallocate. The initial lay_init_context() call does not allocate any heap
 // memory, so if you init a context and then call this once with a large enough
 // number for the number of items you'll create, there will not be any further
 // reallocations.
+//
+// With LAY_PAGED, the items are stored in pages of LAY_PAGE_SIZE items, and
+// growing the context only allocates new pages. The existing items are never
+// copied, and pointers to them stay valid until the context is destroyed.
+//
+// The calculated rectangles are kept in a separate buffer, which isn't touched
+// by creating items. It's allocated (or grown to the item capacity) when the
+// layout is run, unless one was given with lay_set_rects_buffer().
 LAY_EXPORT void lay_reserve_items_capacity(lay_context *ctx, lay_id count);
 
+#ifndef LAY_PAGED
+// Gives the context a buffer to write the calculated rectangles into, instead
+// of the one it would allocate for itself. rects[id] is the rectangle of item
+// `id`, the same as lay_get_rect() returns. The buffer is never grown or freed
+// by the context, and must have room for all of the items in the context
+// whenever the layout is run. The previous results are not copied into it.
+//
+// The same buffer can be given to several contexts which are run one after
+// the other, for example to write the results straight into a staging buffer
+// that gets uploaded somewhere else. This doesn't work with lay_run_dirty(),
+// which needs the results of the previous run to still be in the buffer.
+//
+// Pass NULL and 0 to go back to a buffer allocated by the context.
+//
+// Not available with LAY_PAGED, which keeps the rectangles in the item pages.
+LAY_EXPORT void lay_set_rects_buffer(lay_context *ctx, lay_vec4 *rects, lay_id capacity);
+#endif
+
 // Frees any heap allocated memory used by a context. Don't call this on a
 // context that did not have lay_init_context() call on it. To reuse a context
 // after destroying it, you will need to call lay_init_context() on it again.
@@ -261,6 +458,180 @@ LAY_EXPORT void lay_destroy_context(lay_context *ctx);
 // you are recalculating your layouts in a loop.
 LAY_EXPORT void lay_reset_context(lay_context *ctx);
 
+#ifdef LAY_STATS
+// Returns the counters collected since the context was initialized or since
+// lay_reset_stats() was last called. lay_run_context_parallel() runs on one
+// thread in this mode, so that the counts are exact.
+LAY_EXPORT lay_stats lay_get_stats(const lay_context *ctx);
+LAY_EXPORT void lay_reset_stats(lay_context *ctx);
+#endif
+
+#ifdef LAY_TRACE
+// Sets a procedure to be called at the beginning and end of lay_run_item() (and
+// so lay_run_context()) and lay_run_dirty(), each of their horizontal and
+// vertical size and arrange passes, and, if min_subtree_items is not 0, each
+// subtree with more than min_subtree_items items within the passes of
+// lay_run_item(). The spans are always properly nested. Pass NULL to stop
+// tracing. While tracing, lay_run_context_parallel() runs on one thread.
+LAY_EXPORT void lay_set_trace(
+        lay_context *ctx, lay_trace_proc trace, void *user_data, lay_id min_subtree_items);
+
+typedef struct lay_trace_event {
+    const char *name;
+    // Microseconds, from lay_trace_writer's now_us
+    double time;
+    lay_id item;
+    int16_t dim;
+    uint16_t phase;
+} lay_trace_event;
+
+// Records the spans passed to lay_trace_writer_proc(), and saves them as Chrome
+// trace-event JSON, which can be viewed in Perfetto or chrome://tracing.
+typedef struct lay_trace_writer {
+    // Returns the current time in microseconds, from any starting point
+    double (*now_us)(void);
+    lay_trace_event *events;
+    size_t count;
+    size_t capacity;
+} lay_trace_writer;
+
+LAY_EXPORT void lay_trace_writer_init(lay_trace_writer *writer, double (*now_us)(void));
+LAY_EXPORT void lay_trace_writer_destroy(lay_trace_writer *writer);
+// A lay_trace_proc. Pass the lay_trace_writer as its user_data. The writer
+// shouldn't be shared by contexts which are run at the same time on different
+// threads.
+LAY_EXPORT void lay_trace_writer_proc(
+        void *writer, lay_trace_phase phase, const char *name, lay_id item, int dim);
+// Writes the recorded events to a file. Returns 0 if it couldn't be written.
+LAY_EXPORT int lay_trace_writer_save(const lay_trace_writer *writer, const char *path);
+#endif
+
+// Counters for the subtree cache, see lay_set_memo()
+typedef struct lay_memo_stats {
+    // Lookups of the calculated size of a subtree in each pass, and how many
+    // of them were found
+    uint64_t size_lookups;
+    uint64_t size_hits;
+    // Lookups of the arrangement of a subtree for its extent in each pass,
+    // and how many of them were found
+    uint64_t arrange_lookups;
+    uint64_t arrange_hits;
+    // Items below the roots of the found subtrees, which didn't have to be
+    // calculated or arranged
+    uint64_t items_reused;
+    // Entries in the cache
+    uint32_t entries;
+} lay_memo_stats;
+
+// Enables a cache of subtree layouts for lay_run_item() and lay_run_context(),
+// for layouts with many subtrees that are the same, like list rows, table cells
+// or toolbar buttons. Before each run, every subtree is hashed from its
+// flags, sizes, margins and structure. The biggest subtrees with at most
+// max_subtree_items items then look up their calculated size, and the
+// arrangement of their descendants for the extent given by their parent, and
+// copy them instead of calculating them again. Pass 0 to disable the cache and
+// free it. The counters are kept until then.
+//
+// Cached subtrees are always arranged as if they were at position 0, and then
+// moved into place. Children are placed relative to their parent, so in int16
+// builds the rects are exactly the same as without the cache. With LAY_FLOAT,
+// fractional fill or spacing can make a rect differ in its last bits, since
+// the positions are added up in a different order. Subtrees with wrapping
+// containers are not cached. The cache isn't used while tracing, and
+// lay_run_context_parallel() runs on one thread while it's enabled.
+LAY_EXPORT void lay_set_memo(lay_context *ctx, lay_id max_subtree_items);
+LAY_EXPORT lay_memo_stats lay_get_memo_stats(const lay_context *ctx);
+
+// The most rects that lay_get_damage() merges the damage into
+#ifndef LAY_DAMAGE_RECTS
+#define LAY_DAMAGE_RECTS 8
+#endif
+
+// Enables keeping track of which items' rects are changed by each run, for
+// partial redraws. The rects are compared with the ones from the previous run
+// while the last pass arranges the items, so there's no separate pass over
+// them. lay_run_context_parallel() compares them after the run instead. Pass
+// 0 to disable it and free the copy of the previous rects.
+//
+// Items are matched up by id, so if the layout is built again from scratch
+// each frame, it should create its items in the same order each time. Items
+// with ids that didn't exist in the previous run count as changed.
+LAY_EXPORT void lay_set_track_changes(lay_context *ctx, int enabled);
+
+// Returns the ids of the items whose rects were changed by the last run, in
+// the order they were arranged, and writes their number to count. Valid until
+// the next run.
+LAY_EXPORT const lay_id *lay_get_changes(const lay_context *ctx, lay_id *count);
+
+// Writes up to LAY_DAMAGE_RECTS rectangles (x, y, width, height) which cover
+// the old and new rects of the changed items, and the old rects of items that
+// were removed since the previous run, to rects. Returns how many were
+// written. Overlapping rectangles are merged, and when there are too many, each
+// new one is merged into the one that grows the least.
+LAY_EXPORT lay_id lay_get_damage(const lay_context *ctx, lay_vec4 *rects);
+
+// Renumbers the items in a context so that they are stored in the given order
+// (see lay_compact_order), and rewrites the links between them. If your items
+// were not created in the same order as they are inserted, this makes the
+// layout calculations walk through memory sequentially instead of jumping
+// around in the buffer.
+//
+// The ids of items will change, except for the root item (id 0). If `remap` is
+// not NULL, it must point to an array of at least lay_items_count() elements,
+// and remap[old_id] will be set to the new id of each item, so that you can
+// translate any ids you have saved. Items that are not inserted in any other
+// item are each treated as the root of their own tree, and keep their relative
+// order.
+//
+// The calculated rectangles and the state used by lay_run_dirty() are moved
+// along with the items. This allocates a temporary buffer with the context's
+// allocator, and frees it before returning.
+LAY_EXPORT void lay_compact_context(lay_context *ctx, lay_compact_order order, lay_id *remap);
+
+// Writes a snapshot of all of the items in a context into data, which must be
+// aligned to 16 bytes, and returns its size in bytes. If data is NULL or size
+// is too small, nothing is written, so you can call this once to find out how
+// big a buffer you need. If with_rects is not 0, the calculated rects are
+// included, so the layout must have been run since the last item was created.
+//
+// A snapshot is a header followed by the item storage exactly as the context
+// keeps it in memory, so it's only readable by a build of layout.h with the
+// same LAY_FLOAT, LAY_SOA and byte order. (LAY_PAGED builds use the same
+// format as the default storage.) The header has a version number, and a tag
+// for the byte order it was written with. All of the items are marked as
+// changed, so that the first lay_run_dirty() after loading does a full run.
+LAY_EXPORT size_t lay_save_context(const lay_context *ctx, int with_rects, void *data, size_t size);
+
+// Replaces the items of a context with copies of the ones in a snapshot from
+// lay_save_context(), along with their rects if it has them. Returns 0 if data
+// isn't a snapshot that this build can read, leaving the context unchanged. A
+// context from lay_map_context() stops using its snapshot, which isn't written
+// to, and gets storage of its own for the copies.
+LAY_EXPORT int lay_load_context(lay_context *ctx, const void *data, size_t size);
+
+#ifndef LAY_PAGED
+// Makes ctx use the items and rects in a snapshot where they are, without
+// copying them, for example straight from a memory-mapped file. ctx must have
+// been initialized with lay_init_context(). The items and rects it had are
+// freed, but its allocator and settings are kept, including lay_set_memo() and
+// lay_set_track_changes(). data must stay valid until the context is
+// destroyed, and be aligned to 16 bytes (mmap gives page-aligned memory.)
+// Returns 0 if data isn't a snapshot that this build can read, leaving the
+// context unchanged.
+//
+// If the snapshot has rects, they can be queried right away, and the context
+// never needs to be written to. Running the layout writes the rects, and may
+// update the flags of the items, so the memory has to be writable for that
+// (for example, a private copy-on-write mapping.) If the snapshot has no rects,
+// they are allocated by the context when it's run, as usual. The items can be
+// changed in place, but not added to: the context can never grow beyond the
+// number of items in the snapshot. Destroy it with lay_destroy_context() as
+// usual, which frees anything the context allocated itself.
+//
+// Not available with LAY_PAGED, which can't keep its pages in a single block.
+LAY_EXPORT int lay_map_context(lay_context *ctx, const void *data, size_t size);
+#endif
+
 // Performs the layout calculations, starting at the root item (id 0). After
 // calling this, you can use lay_get_rect() to query for an item's calculated
 // rectangle. If you use procedures such as lay_append() or lay_insert() after
@@ -275,6 +646,125 @@ LAY_EXPORT void lay_reset_context(lay_context *ctx);
 // on items in a layout without any contents changing.
 LAY_EXPORT void lay_run_context(lay_context *ctx);
 
+// Incremental version of lay_run_context(). Only the items which have been
+// changed since the previous call to lay_run_dirty(), and the items whose
+// position or size was affected by those changes, are recalculated. Subtrees
+// that were not changed and whose rectangle given by their parent is the same
+// as last time are skipped entirely.
+//
+// Changes are tracked by the lay_set_*, lay_insert, lay_append, lay_push and
+// lay_clear_item_break procedures, which mark the item and all of its
+// ancestors as dirty. Setting a value that is equal to the current value does
+// not mark anything. If you modify items directly through lay_get_item() or
+// the LAY_FLAGS etc. accessors, the change will not be seen by lay_run_dirty().
+//
+// The first call to lay_run_dirty() (and any call after lay_reset_context())
+// does the same amount of work as lay_run_context(), and allocates a buffer
+// to keep the intermediate results needed for the following calls. The results
+// are the same as with lay_run_context(), with the caveat about wrapping
+// described at lay_clear_item_break().
+LAY_EXPORT void lay_run_dirty(lay_context *ctx);
+
+// Used by lay_run_context_parallel(). A lay_parallel_for_proc must call
+// task(task_data, i) once for every i from 0 to count - 1, in any order and on
+// any threads, and return only after all of the calls have finished.
+typedef void (*lay_task_proc)(void *task_data, lay_id index);
+typedef void (*lay_parallel_for_proc)(
+    void *user_data, lay_task_proc task, void *task_data, lay_id count);
+
+// Same as lay_run_context(), but the subtrees of the layout are calculated as
+// independent tasks, which are run by your parallel_for procedure (for example,
+// on your engine's job system.) The results are exactly the same as with
+// lay_run_context().
+//
+// Subtrees with at most min_task_items items are not split further, and
+// neighboring small subtrees are grouped together until they have at least
+// that many items. The items above them are calculated on the calling thread.
+// Something in the range of 1000 to 10000 is a reasonable choice. If the whole
+// context has fewer items than that, this is the same as lay_run_context().
+//
+// Each call walks the whole tree once to count the items in each subtree, and
+// allocates a buffer on first use, which is kept for the following calls.
+LAY_EXPORT void lay_run_context_parallel(
+    lay_context *ctx, lay_id min_task_items,
+    lay_parallel_for_proc parallel_for, void *user_data);
+
+// Runs lay_run_context() on each of the n contexts in ctxs. The contexts must
+// all be different. They are split into tasks of consecutive contexts with
+// about min_task_items items in total, which are run by parallel_for (see
+// lay_run_context_parallel()). If parallel_for is NULL, they are all run on the
+// calling thread.
+LAY_EXPORT void lay_run_contexts(
+    lay_context **ctxs, size_t n, lay_id min_task_items,
+    lay_parallel_for_proc parallel_for, void *user_data);
+
+// Frames
+// ------
+//
+// A set of two or three contexts for building the next frame on one thread
+// while other threads read the rects of the last one. One thread, the writer,
+// calls lay_begin_frame() to get a context that no reader is using, builds and
+// runs the layout in it, and calls lay_publish_frame(). Any number of readers
+// call lay_acquire_frame() to get the last published context, read from it
+// (with lay_get_rect(), lay_get_rects(), lay_find_item() and so on), and then
+// call lay_release_frame(). Readers never wait, and never see a context while
+// it's being changed. The contexts keep their buffers, so after the first few
+// frames nothing is reallocated.
+//
+// With two contexts, the writer can't begin a frame while a reader still holds
+// the one before the last. With three, it can as long as each reader releases
+// a frame before it acquires the next one.
+#define LAY_MAX_FRAMES 3
+
+typedef struct lay_frames {
+    // Can be set up after lay_init_frames(), for example with
+    // lay_set_allocator() or lay_reserve_items_capacity().
+    lay_context contexts[LAY_MAX_FRAMES];
+    // Only changed with atomic operations
+    uint32_t readers[LAY_MAX_FRAMES];
+    // The last published context, or LAY_MAX_FRAMES before the first one
+    uint32_t latest;
+    uint32_t building;
+    uint32_t num_contexts;
+} lay_frames;
+
+LAY_EXPORT void lay_init_frames(lay_frames *frames, uint32_t num_contexts);
+LAY_EXPORT void lay_destroy_frames(lay_frames *frames);
+
+// Resets and returns a context that isn't the last published one and isn't
+// held by any reader, for the writer to build the next frame in. Returns NULL
+// if there isn't one, in which case the writer can try again later. Only one
+// frame can be built at a time.
+LAY_EXPORT lay_context *lay_begin_frame(lay_frames *frames);
+
+// Makes the frame from lay_begin_frame() the one that readers get. Its layout
+// should have been run.
+LAY_EXPORT void lay_publish_frame(lay_frames *frames);
+
+// Returns the last published frame, or NULL if none has been published yet.
+// It stays valid until it is given to lay_release_frame(). Can be called from
+// any thread.
+LAY_EXPORT const lay_context *lay_acquire_frame(lay_frames *frames);
+LAY_EXPORT void lay_release_frame(lay_frames *frames, const lay_context *ctx);
+
+// With GCC or Clang on x86, the layout calculations are compiled several times
+// for different instruction set levels, and lay_init_context() picks the
+// highest one that the CPU supports. The CPU is only checked once per process.
+// The results are the same with every level. (FMA is never used, so that float
+// rounding doesn't change.)
+//
+// If the LAY_ISA environment variable is set to "generic", "avx2" or "avx512"
+// when the first context is initialized, that level is used instead.
+// Define LAY_NO_DISPATCH to build only the generic level.
+//
+// lay_set_isa() changes the level used by a context, for example to compare
+// them in a benchmark. Levels that aren't available are lowered to the highest
+// one that is, and the level that will actually be used is returned.
+LAY_EXPORT lay_isa lay_set_isa(lay_context *ctx, lay_isa isa);
+LAY_EXPORT lay_isa lay_get_isa(const lay_context *ctx);
+// Returns the name of an instruction set level, as used by LAY_ISA.
+LAY_EXPORT const char *lay_isa_name(lay_isa isa);
+
 // Like lay_run_context(), this procedure will run layout calculations --
 // however, it lets you specify which item you want to start from.
 // lay_run_context() always starts with item 0, the first item, as the root.
@@ -316,24 +806,103 @@ LAY_EXPORT lay_id lay_items_capacity(lay_context *ctx);
 // id (handle) used to identify the item.
 LAY_EXPORT lay_id lay_item(lay_context *ctx);
 
+// Creates count new items with consecutive ids, growing the context at most
+// once. Returns the id of the first one, or LAY_INVALID_ID if count is 0.
+LAY_EXPORT lay_id lay_items(lay_context *ctx, lay_id count);
+
 // Inserts an item into another item, forming a parent - child relationship. An
 // item can contain any number of child items. Items inserted into a parent are
-// put at the end of the ordering, after any existing siblings.
+// put at the end of the ordering, after any existing siblings. Each item keeps
+// track of its last child, so this takes the same time no matter how many
+// children the parent already has.
 LAY_EXPORT void lay_insert(lay_context *ctx, lay_id parent, lay_id child);
 
+// Inserts the items first .. first + count - 1 into parent, in order, after any
+// existing children. None of them may be inserted already. Use it with
+// lay_items() to create a long list of children in one pass.
+LAY_EXPORT void lay_insert_range(lay_context *ctx, lay_id parent, lay_id first, lay_id count);
+
 // lay_append inserts an item as a sibling after another item. This allows
 // inserting an item into the middle of an existing list of items within a
-// parent. It's also more efficient than repeatedly using lay_insert(ctx,
-// parent, new_child) in a loop to create a list of items in a parent, because
-// it does not need to traverse the parent's children each time. So if you're
-// creating a long list of children inside of a parent, you might prefer to use
-// this after using lay_insert to insert the first child.
+// parent.
 LAY_EXPORT void lay_append(lay_context *ctx, lay_id earlier, lay_id later);
 
 // Like lay_insert, but puts the new item as the first child in a parent instead
 // of as the last.
 LAY_EXPORT void lay_push(lay_context *ctx, lay_id parent, lay_id child);
 
+// Creates count copies of the subtree at template_root in template_ctx, and
+// inserts them at the end of parent's children, or leaves them uninserted if
+// parent is LAY_INVALID_ID. The items are block-copied and their links are
+// offset, which is much faster than building each copy with lay_item(),
+// lay_set_* and lay_insert(). template_ctx can be ctx itself.
+//
+// The template's items must have consecutive ids starting at template_root, as
+// they do when it is built by creating each item before its children, or
+// after lay_compact_context() with LAY_COMPACT_DEPTH_FIRST. Everything about
+// the items, including the LAY_USERMASK bits, is copied.
+//
+// Returns the id of the first copy's root, or LAY_INVALID_ID if count is 0.
+// With n items in the template, item template_root + j of copy k gets the id
+// first + k * n + j.
+LAY_EXPORT lay_id lay_instantiate(
+        lay_context *ctx, const lay_context *template_ctx, lay_id template_root,
+        lay_id parent, lay_id count);
+
+// Virtual lists
+// -------------
+//
+// A list with too many rows to create an item for each of them can be laid
+// out by creating items only for the rows that can be seen. The visible rows
+// are found without looking at the others, and go in a container which is
+// moved so that they line up with the scroll position.
+//
+// For each frame, call lay_virtual_rows_uniform() or lay_virtual_rows_varying()
+// to find the visible rows, then lay_virtual_list() to make their container,
+// and insert an item for each of rows.count rows into it, starting with row
+// rows.first (for example with lay_instantiate()). The size of each item along
+// the list's direction, including its margins, must match the row extent used
+// to find them.
+
+// The rows of a virtual list that intersect the viewport.
+typedef struct lay_virtual_rows {
+    // The index of the first visible row, and the number of visible rows
+    lay_id first;
+    lay_id count;
+    // Where the first visible row starts, relative to the start of the
+    // viewport. It's 0 or negative when the row is partly scrolled out.
+    lay_scalar offset;
+    // The extent of all of the rows, for sizing a scroll bar
+    double total;
+} lay_virtual_rows;
+
+// Returns the start of row index in a list with rows of varying extent, where
+// row 0 starts at 0 and row count ends at the extent of the whole list. Must
+// not decrease as index increases.
+typedef double (*lay_row_offset_proc)(void *user_data, lay_id index);
+
+// Finds the rows of a list of num_rows rows, each row_extent long, that
+// intersect a viewport of the given extent, scrolled to scroll. scroll is
+// clamped to the range of the list. This takes the same time for any number
+// of rows.
+LAY_EXPORT lay_virtual_rows lay_virtual_rows_uniform(
+        lay_id num_rows, double row_extent, double scroll, double viewport);
+
+// Like lay_virtual_rows_uniform(), but the rows are placed by offset_proc. It
+// is called O(log num_rows) times, so it should look the offsets up, for
+// example in an array of running totals.
+LAY_EXPORT lay_virtual_rows lay_virtual_rows_varying(
+        lay_id num_rows, lay_row_offset_proc offset_proc, void *user_data,
+        double scroll, double viewport);
+
+// Creates the container for the visible rows of a virtual list, and inserts
+// it into viewport. It's a row (dim 0) or a column (dim 1) which fills the
+// viewport across, and starts at rows->offset. The viewport should be a
+// LAY_LAYOUT container, and is usually clipped by the renderer. Returns the
+// container.
+LAY_EXPORT lay_id lay_virtual_list(
+        lay_context *ctx, lay_id viewport, int dim, const lay_virtual_rows *rows);
+
 // Gets the size that was set with lay_set_size or lay_set_size_xy. The _xy
 // version writes the output values to the specified addresses instead of
 // returning the values in a lay_vec2.
@@ -370,29 +939,88 @@ LAY_EXPORT void lay_set_margins(lay_context *ctx, lay_id item, lay_vec4 ltrb);
 // (left, top, right, bottom).
 LAY_EXPORT void lay_set_margins_ltrb(lay_context *ctx, lay_id item, lay_scalar l, lay_scalar t, lay_scalar r, lay_scalar b);
 
+// Asserts that the id refers to an item in the context, and returns it.
+LAY_STATIC_INLINE lay_id lay_check_id(const lay_context *ctx, lay_id id)
+{
+    LAY_ASSERT(id != LAY_INVALID_ID && id < ctx->count);
+    (void)ctx;
+    return id;
+}
+
+#ifndef LAY_SOA
 // Get the pointer to an item in the buffer by its id. Don't keep this around --
 // it will become invalid as soon as any reallocation occurs. Just store the id
-// instead (it's smaller, anyway, and the lookup cost will be nothing.)
+// instead (it's smaller, anyway, and the lookup cost will be nothing.) With
+// LAY_PAGED, there are no reallocations, so the pointer stays valid until the
+// context is destroyed.
+//
+// Not available with LAY_SOA, because there is no item struct. Use the
+// accessors below instead.
 LAY_STATIC_INLINE lay_item_t *lay_get_item(const lay_context *ctx, lay_id id)
 {
-    LAY_ASSERT(id != LAY_INVALID_ID && id < ctx->count);
-    return ctx->items + id;
+#ifdef LAY_PAGED
+    lay_check_id(ctx, id);
+    return &ctx->pages[id / LAY_PAGE_SIZE]->items[id % LAY_PAGE_SIZE];
+#else
+    return ctx->items + lay_check_id(ctx, id);
+#endif
 }
+#endif
+
+// Accessors for the properties of an item, which work the same way with or
+// without LAY_SOA. They can be used on the left side of an assignment.
+//
+// If you change anything that has a lay_set_* procedure through these, the
+// change will not be seen by lay_run_dirty(). They are mostly useful for
+// reading and writing the LAY_USERMASK bits, and for reading LAY_BREAK after
+// performing the layout calculations.
+//
+// LAY_MARGIN components are 0: left, 1: top, 2: right, 3: bottom. LAY_SIZE
+// components are 0: width, 1: height.
+#ifdef LAY_SOA
+#define LAY_FLAGS(ctx, id) ((ctx)->flags[lay_check_id(ctx, id)])
+#define LAY_FIRST_CHILD(ctx, id) ((ctx)->first_child[lay_check_id(ctx, id)])
+#define LAY_LAST_CHILD(ctx, id) ((ctx)->last_child[lay_check_id(ctx, id)])
+#define LAY_NEXT_SIBLING(ctx, id) ((ctx)->next_sibling[lay_check_id(ctx, id)])
+#define LAY_PARENT(ctx, id) ((ctx)->parent[lay_check_id(ctx, id)])
+#define LAY_MARGIN(ctx, id, i) ((ctx)->margins[(i) & 1][lay_check_id(ctx, id)][(i) >> 1])
+#define LAY_SIZE(ctx, id, dim) ((ctx)->sizes[dim][lay_check_id(ctx, id)])
+#else
+#define LAY_FLAGS(ctx, id) (lay_get_item(ctx, id)->flags)
+#define LAY_FIRST_CHILD(ctx, id) (lay_get_item(ctx, id)->first_child)
+#define LAY_LAST_CHILD(ctx, id) (lay_get_item(ctx, id)->last_child)
+#define LAY_NEXT_SIBLING(ctx, id) (lay_get_item(ctx, id)->next_sibling)
+#define LAY_PARENT(ctx, id) (lay_get_item(ctx, id)->parent)
+#define LAY_MARGIN(ctx, id, i) (lay_get_item(ctx, id)->margins[i])
+#define LAY_SIZE(ctx, id, dim) (lay_get_item(ctx, id)->size[dim])
+#endif
+
+// The calculated rectangle of an item, as returned by lay_get_rect().
+#ifdef LAY_PAGED
+#define LAY_RECT(ctx, id) ((ctx)->pages[lay_check_id(ctx, id) / LAY_PAGE_SIZE]->rects[(id) % LAY_PAGE_SIZE])
+#else
+#define LAY_RECT(ctx, id) ((ctx)->rects[lay_check_id(ctx, id)])
+#endif
 
 // Get the id of first child of an item, if any. Returns LAY_INVALID_ID if there
 // is no child.
 LAY_STATIC_INLINE lay_id lay_first_child(const lay_context *ctx, lay_id id)
 {
-    const lay_item_t *pitem = lay_get_item(ctx, id);
-    return pitem->first_child;
+    return LAY_FIRST_CHILD(ctx, id);
+}
+
+// Get the id of the last child of an item, if any. Returns LAY_INVALID_ID if
+// there is no child.
+LAY_STATIC_INLINE lay_id lay_last_child(const lay_context *ctx, lay_id id)
+{
+    return LAY_LAST_CHILD(ctx, id);
 }
 
 // Get the id of the next sibling of an item, if any. Returns LAY_INVALID_ID if
 // there is no next sibling.
 LAY_STATIC_INLINE lay_id lay_next_sibling(const lay_context *ctx, lay_id id)
 {
-    const lay_item_t *pitem = lay_get_item(ctx, id);
-    return pitem->next_sibling;
+    return LAY_NEXT_SIBLING(ctx, id);
 }
 
 // Returns the calculated rectangle of an item. This is only valid after calling
@@ -402,8 +1030,10 @@ LAY_STATIC_INLINE lay_id lay_next_sibling(const lay_context *ctx, lay_id id)
 // 2: width, 3: height
 LAY_STATIC_INLINE lay_vec4 lay_get_rect(const lay_context *ctx, lay_id id)
 {
-    LAY_ASSERT(id != LAY_INVALID_ID && id < ctx->count);
-    return ctx->rects[id];
+#ifndef LAY_PAGED
+    LAY_ASSERT(id < ctx->rects_count);
+#endif
+    return LAY_RECT(ctx, id);
 }
 
 // The same as lay_get_rect, but writes the x,y positions and width,height
@@ -412,14 +1042,58 @@ LAY_STATIC_INLINE void lay_get_rect_xywh(
         const lay_context *ctx, lay_id id,
         lay_scalar *x, lay_scalar *y, lay_scalar *width, lay_scalar *height)
 {
-    LAY_ASSERT(id != LAY_INVALID_ID && id < ctx->count);
-    lay_vec4 rect = ctx->rects[id];
+#ifndef LAY_PAGED
+    LAY_ASSERT(id < ctx->rects_count);
+#endif
+    lay_vec4 rect = LAY_RECT(ctx, id);
     *x = rect[0];
     *y = rect[1];
     *width = rect[2];
     *height = rect[3];
 }
 
+// Copies the calculated rectangles of `count` items, starting at id `first`,
+// into `out` in one of the lay_rect_formats, for example to fill a vertex
+// buffer. (dx, dy) is added to the position of each rectangle. `out` doesn't
+// need to be aligned. If you use lay_compact_context() first, the items of a
+// subtree have consecutive ids.
+//
+// Like lay_get_rect(), this is only valid after the layout has been run.
+LAY_EXPORT void lay_get_rects(
+        const lay_context *ctx, lay_id first, lay_id count,
+        lay_rect_format format, lay_scalar dx, lay_scalar dy, void *out);
+
+// The same as lay_get_rects(), but for the items in the `ids` array.
+LAY_EXPORT void lay_get_rects_by_ids(
+        const lay_context *ctx, const lay_id *ids, lay_id count,
+        lay_rect_format format, lay_scalar dx, lay_scalar dy, void *out);
+
+// Finds the item under the point (x, y) in the subtree at root, for hit
+// testing. Like lay_get_rect(), this is only valid after the layout has been
+// run. Returns the last item in drawing order (the deepest, and the last among
+// overlapping siblings) whose rect contains the point, or LAY_INVALID_ID.
+//
+// Only the children of items that contain the point are looked at, so this
+// visits a few items on each level of the tree instead of all of them. Items
+// which stick out of their parent's rect are only found where they overlap it,
+// as if they were clipped.
+//
+// flags and mask filter the items, as in oui: with mask LAY_ANY, items that
+// have any of the bits in flags match (or every item, when flags is also
+// LAY_ANY); otherwise, items match when (item flags & flags) == mask. For
+// example, pass one of the LAY_USERMASK bits as both flags and mask to find
+// the items that have it.
+LAY_EXPORT lay_id lay_find_item(
+        const lay_context *ctx, lay_id root, lay_scalar x, lay_scalar y,
+        uint32_t flags, uint32_t mask);
+
+// Like lay_find_item(), but finds all of the items whose rects overlap area (x,
+// y, width, height), in drawing order. Writes up to capacity ids into out, and
+// returns the number of items found, which can be more than capacity.
+LAY_EXPORT lay_id lay_find_items(
+        const lay_context *ctx, lay_id root, lay_vec4 area,
+        uint32_t flags, uint32_t mask, lay_id *out, lay_id capacity);
+
 #undef LAY_EXPORT
 #undef LAY_STATIC_INLINE
 
@@ -467,6 +1141,16 @@ LAY_STATIC_INLINE void lay_get_rect_xywh(
 #define LAY_MEMSET(_dst, _val, _size) memset(_dst, _val, _size)
 #endif
 
+// Same for LAY_MEMCPY and LAY_MEMMOVE.
+#ifndef LAY_MEMCPY
+#include <string.h>
+#define LAY_MEMCPY(_dst, _src, _size) memcpy(_dst, _src, _size)
+#endif
+#ifndef LAY_MEMMOVE
+#include <string.h>
+#define LAY_MEMMOVE(_dst, _src, _size) memmove(_dst, _src, _size)
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 #define LAY_FORCE_INLINE __attribute__((always_inline)) inline
 #ifdef __cplusplus
@@ -486,6 +1170,41 @@ LAY_STATIC_INLINE void lay_get_rect_xywh(
 #endif // __cplusplus
 #endif
 
+// Unless LAY_NO_SIMD is defined, the overlay kernels use SSE2 when the compiler
+// targets a CPU that has it (which all x86-64 CPUs do).
+#if !defined(LAY_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LAY_SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Runtime dispatch between the instruction set levels in lay_isa. Functions are
+// compiled for a level with LAY_TARGET_*, and can inline the LAY_FORCE_INLINE
+// kernels, which are compiled with the default target.
+#if !defined(LAY_NO_DISPATCH) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define LAY_DISPATCH_X86 1
+#define LAY_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2,popcnt")))
+#define LAY_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,bmi,bmi2,popcnt")))
+#endif
+
+// Statements which are only compiled when LAY_STATS is defined
+#ifdef LAY_STATS
+#define LAY_STAT(_stmt) _stmt
+#else
+#define LAY_STAT(_stmt)
+#endif
+#define LAY_STAT_ADD(_ctx, _counter, _n) LAY_STAT((_ctx)->stats._counter += (_n))
+
+#ifdef LAY_TRACE
+#include <stdio.h>
+#endif
+
+// LAY_GETENV is used to read the LAY_ISA environment variable. Define it as
+// #define LAY_GETENV(_name) NULL to ignore the environment.
+#ifndef LAY_GETENV
+#include <stdlib.h>
+#define LAY_GETENV(_name) getenv(_name)
+#endif
+
 // Useful math utilities
 static LAY_FORCE_INLINE lay_scalar lay_scalar_max(lay_scalar a, lay_scalar b)
 { return a > b ? a : b; }
@@ -495,40 +1214,315 @@ static LAY_FORCE_INLINE float lay_float_max(float a, float b)
 { return a > b ? a : b; }
 static LAY_FORCE_INLINE float lay_float_min(float a, float b)
 { return a < b ? a : b; }
+// Rounds down to a lay_scalar. Positions relative to the parent are rounded
+// down instead of towards 0, so that adding the parent's position to them
+// gives the same result as truncating the absolute position.
+static LAY_FORCE_INLINE lay_scalar lay_scalar_floor(float a)
+{
+#ifdef LAY_FLOAT
+    return a;
+#else
+    const lay_scalar i = (lay_scalar)a;
+    return (float)i > a ? (lay_scalar)(i - 1) : i;
+#endif
+}
+
+static lay_isa lay_default_isa(void);
 
 void lay_init_context(lay_context *ctx)
 {
     ctx->capacity = 0;
     ctx->count = 0;
+#ifdef LAY_SOA
+    ctx->flags = NULL;
+    ctx->first_child = NULL;
+    ctx->last_child = NULL;
+    ctx->next_sibling = NULL;
+    ctx->parent = NULL;
+    ctx->margins[0] = NULL;
+    ctx->margins[1] = NULL;
+    ctx->sizes[0] = NULL;
+    ctx->sizes[1] = NULL;
+#elif defined(LAY_PAGED)
+    ctx->pages = NULL;
+    ctx->pages_capacity = 0;
+#else
     ctx->items = NULL;
+#endif
+#ifndef LAY_PAGED
     ctx->rects = NULL;
+    ctx->rects_capacity = 0;
+    ctx->rects_count = 0;
+    ctx->rects_external = 0;
+    ctx->items_external = 0;
+#endif
+    ctx->cache = NULL;
+    ctx->cache_capacity = 0;
+    ctx->tasks = NULL;
+    ctx->tasks_capacity = 0;
+    ctx->isa = lay_default_isa();
+    ctx->alloc = NULL;
+    ctx->alloc_data = NULL;
+#ifdef LAY_STATS
+    LAY_MEMSET(&ctx->stats, 0, sizeof(lay_stats));
+#endif
+#ifdef LAY_TRACE
+    ctx->trace = NULL;
+    ctx->trace_data = NULL;
+    ctx->trace_min_items = 0;
+#endif
+    ctx->memo = NULL;
+    ctx->changes = NULL;
 }
 
-void lay_reserve_items_capacity(lay_context *ctx, lay_id count)
+void lay_set_allocator(lay_context *ctx, lay_alloc_proc alloc, void *user_data)
+{
+    LAY_ASSERT(ctx != NULL);
+    // Blocks can't be handed over from one allocator to another
+    LAY_ASSERT(ctx->capacity == 0 && ctx->cache == NULL && ctx->tasks == NULL
+        && ctx->memo == NULL && ctx->changes == NULL);
+    ctx->alloc = alloc;
+    ctx->alloc_data = user_data;
+}
+
+// All heap memory used by a context goes through these two.
+static void *lay_realloc(lay_context *ctx, void *block, size_t old_size, size_t new_size)
+{
+    if (ctx->alloc != NULL)
+        return ctx->alloc(ctx->alloc_data, block, old_size, new_size);
+    return LAY_REALLOC(block, new_size);
+}
+
+static void lay_free(lay_context *ctx, void *block, size_t size)
+{
+    if (ctx->alloc != NULL)
+        ctx->alloc(ctx->alloc_data, block, size, 0);
+    else
+        LAY_FREE(block);
+}
+
+#ifndef LAY_PAGED
+static void lay_free_rects(lay_context *ctx)
+{
+    if (ctx->rects != NULL && !ctx->rects_external)
+        lay_free(ctx, ctx->rects, ctx->rects_capacity * sizeof(lay_vec4));
+    ctx->rects = NULL;
+    ctx->rects_capacity = 0;
+    ctx->rects_count = 0;
+    ctx->rects_external = 0;
+}
+
+void lay_set_rects_buffer(lay_context *ctx, lay_vec4 *rects, lay_id capacity)
+{
+    LAY_ASSERT(ctx != NULL);
+    LAY_ASSERT(rects != NULL || capacity == 0);
+    lay_free_rects(ctx);
+    ctx->rects = rects;
+    ctx->rects_capacity = capacity;
+    ctx->rects_external = rects != NULL;
+    // The previous results aren't in the new buffer, so lay_run_dirty() will
+    // have to calculate everything again.
+    for (lay_id i = 0; i < ctx->count; ++i)
+        LAY_FLAGS(ctx, i) |= LAY_ITEM_DIRTY;
+}
+#endif
+
+// Makes sure there's a rect for every item before the layout is run. The
+// rects of the items created since the last run are zeroed, so that items
+// which can't be reached from the root still get an empty rect. (With
+// LAY_PAGED, lay_item() does this instead.)
+static void lay_prepare_rects(lay_context *ctx)
 {
-    if (count >= ctx->capacity) {
-        ctx->capacity = count;
-        const size_t item_size = sizeof(lay_item_t) + sizeof(lay_vec4);
-        ctx->items = (lay_item_t*)LAY_REALLOC(ctx->items, ctx->capacity * item_size);
-        const lay_item_t *past_last = ctx->items + ctx->capacity;
-        ctx->rects = (lay_vec4*)past_last;
+#ifndef LAY_PAGED
+    const lay_id count = ctx->count;
+    if (ctx->rects_capacity < count) {
+        // A buffer from lay_set_rects_buffer() is never grown
+        LAY_ASSERT(!ctx->rects_external);
+        ctx->rects = (lay_vec4*)lay_realloc(ctx, ctx->rects,
+            ctx->rects_capacity * sizeof(lay_vec4), ctx->capacity * sizeof(lay_vec4));
+        ctx->rects_capacity = ctx->capacity;
     }
+    if (ctx->rects_count < count) {
+        LAY_MEMSET(ctx->rects + ctx->rects_count, 0, (count - ctx->rects_count) * sizeof(lay_vec4));
+        ctx->rects_count = count;
+    }
+#else
+    (void)ctx;
+#endif
 }
 
-void lay_destroy_context(lay_context *ctx)
+#ifdef LAY_SOA
+// Each array is reallocated on its own. realloc keeps the old contents, so the
+// items survive the growth.
+static void lay_grow_items(lay_context *ctx, lay_id capacity)
+{
+    // The items of a mapped snapshot can't be moved
+    LAY_ASSERT(!ctx->items_external);
+    const lay_id old_capacity = ctx->capacity;
+    ctx->capacity = capacity;
+#define LAY_GROW_ARRAY(_array, _type) \
+    _array = (_type*)lay_realloc(ctx, _array, old_capacity * sizeof(_type), capacity * sizeof(_type))
+    LAY_GROW_ARRAY(ctx->flags, uint32_t);
+    LAY_GROW_ARRAY(ctx->first_child, lay_id);
+    LAY_GROW_ARRAY(ctx->last_child, lay_id);
+    LAY_GROW_ARRAY(ctx->next_sibling, lay_id);
+    LAY_GROW_ARRAY(ctx->parent, lay_id);
+    LAY_GROW_ARRAY(ctx->margins[0], lay_vec2);
+    LAY_GROW_ARRAY(ctx->margins[1], lay_vec2);
+    LAY_GROW_ARRAY(ctx->sizes[0], lay_scalar);
+    LAY_GROW_ARRAY(ctx->sizes[1], lay_scalar);
+#undef LAY_GROW_ARRAY
+}
+#elif defined(LAY_PAGED)
+// Only new pages are allocated. The existing pages are left where they are, so
+// growing never copies any items or rects.
+static void lay_grow_items(lay_context *ctx, lay_id capacity)
+{
+    const lay_id num_pages = (capacity + LAY_PAGE_SIZE - 1) / LAY_PAGE_SIZE;
+    if (num_pages > ctx->pages_capacity) {
+        lay_id pages_capacity = ctx->pages_capacity < 1 ? 8 : ctx->pages_capacity;
+        while (pages_capacity < num_pages)
+            pages_capacity *= 2;
+        ctx->pages = (lay_page**)lay_realloc(ctx, ctx->pages,
+            ctx->pages_capacity * sizeof(lay_page*), pages_capacity * sizeof(lay_page*));
+        ctx->pages_capacity = pages_capacity;
+    }
+    for (lay_id i = ctx->capacity / LAY_PAGE_SIZE; i < num_pages; ++i)
+        ctx->pages[i] = (lay_page*)lay_realloc(ctx, NULL, 0, sizeof(lay_page));
+    ctx->capacity = num_pages * LAY_PAGE_SIZE;
+}
+#else
+static void lay_grow_items(lay_context *ctx, lay_id capacity)
+{
+    // The items of a mapped snapshot can't be moved
+    LAY_ASSERT(!ctx->items_external);
+    ctx->items = (lay_item_t*)lay_realloc(ctx, ctx->items,
+        ctx->capacity * sizeof(lay_item_t), capacity * sizeof(lay_item_t));
+    ctx->capacity = capacity;
+}
+#endif
+
+void lay_reserve_items_capacity(lay_context *ctx, lay_id count)
+{
+    if (count >= ctx->capacity)
+        lay_grow_items(ctx, count);
+}
+
+// Frees the items, rects and caches of a context, leaving its settings as they
+// are
+static void lay_free_storage(lay_context *ctx)
 {
+#ifdef LAY_SOA
+    if (ctx->flags != NULL) {
+        const lay_id capacity = ctx->capacity;
+        if (!ctx->items_external) {
+            lay_free(ctx, ctx->flags, capacity * sizeof(uint32_t));
+            lay_free(ctx, ctx->first_child, capacity * sizeof(lay_id));
+            lay_free(ctx, ctx->last_child, capacity * sizeof(lay_id));
+            lay_free(ctx, ctx->next_sibling, capacity * sizeof(lay_id));
+            lay_free(ctx, ctx->parent, capacity * sizeof(lay_id));
+            lay_free(ctx, ctx->margins[0], capacity * sizeof(lay_vec2));
+            lay_free(ctx, ctx->margins[1], capacity * sizeof(lay_vec2));
+            lay_free(ctx, ctx->sizes[0], capacity * sizeof(lay_scalar));
+            lay_free(ctx, ctx->sizes[1], capacity * sizeof(lay_scalar));
+        }
+        ctx->flags = NULL;
+        ctx->first_child = NULL;
+        ctx->last_child = NULL;
+        ctx->next_sibling = NULL;
+        ctx->parent = NULL;
+        ctx->margins[0] = NULL;
+        ctx->margins[1] = NULL;
+        ctx->sizes[0] = NULL;
+        ctx->sizes[1] = NULL;
+    }
+#elif defined(LAY_PAGED)
+    if (ctx->pages != NULL) {
+        for (lay_id i = 0; i < ctx->capacity / LAY_PAGE_SIZE; ++i)
+            lay_free(ctx, ctx->pages[i], sizeof(lay_page));
+        lay_free(ctx, ctx->pages, ctx->pages_capacity * sizeof(lay_page*));
+        ctx->pages = NULL;
+        ctx->pages_capacity = 0;
+    }
+#else
     if (ctx->items != NULL) {
-        LAY_FREE(ctx->items);
+        if (!ctx->items_external)
+            lay_free(ctx, ctx->items, ctx->capacity * sizeof(lay_item_t));
         ctx->items = NULL;
-        ctx->rects = NULL;
     }
+#endif
+#ifndef LAY_PAGED
+    ctx->items_external = 0;
+    lay_free_rects(ctx);
+#endif
+    if (ctx->cache != NULL) {
+        lay_free(ctx, ctx->cache, ctx->cache_capacity * sizeof(lay_vec4));
+        ctx->cache = NULL;
+        ctx->cache_capacity = 0;
+    }
+    if (ctx->tasks != NULL) {
+        lay_free(ctx, ctx->tasks, 4 * ctx->tasks_capacity * sizeof(lay_id));
+        ctx->tasks = NULL;
+        ctx->tasks_capacity = 0;
+    }
+}
+
+void lay_destroy_context(lay_context *ctx)
+{
+    lay_free_storage(ctx);
+    lay_set_memo(ctx, 0);
+    lay_set_track_changes(ctx, 0);
 }
 
 void lay_reset_context(lay_context *ctx)
-{ ctx->count = 0; }
+{
+    ctx->count = 0;
+#ifndef LAY_PAGED
+    ctx->rects_count = 0;
+#endif
+}
+
+#ifdef LAY_STATS
+lay_stats lay_get_stats(const lay_context *ctx)
+{
+    LAY_ASSERT(ctx != NULL);
+    return ctx->stats;
+}
+
+void lay_reset_stats(lay_context *ctx)
+{
+    LAY_ASSERT(ctx != NULL);
+    LAY_MEMSET(&ctx->stats, 0, sizeof(lay_stats));
+}
+#endif
 
 static void lay_calc_size(lay_context *ctx, lay_id item, int dim);
 static void lay_arrange(lay_context *ctx, lay_id item, int dim);
+static void lay_calc_size_dirty(lay_context *ctx, lay_id item, int dim);
+static void lay_arrange_dirty(lay_context *ctx, lay_id item, int dim);
+#ifdef LAY_TRACE
+static void lay_run_traced(lay_context *ctx, lay_id item, bool dirty);
+#endif
+static void lay_run_memo(lay_context *ctx, lay_id item);
+static bool lay_begin_changes(lay_context *ctx);
+static void lay_end_changes(lay_context *ctx);
+static void lay_scan_changes(lay_context *ctx, lay_id item);
+static void lay_arrange_tracked(lay_context *ctx, lay_id item, int dim);
+static void lay_arrange_dirty_tracked(lay_context *ctx, lay_id item, int dim);
+
+// Marks an item and all of its ancestors as needing to be recalculated by
+// lay_run_dirty(). An item's ancestors are always dirty when the item is, so we
+// can stop as soon as we find one that's already marked.
+static LAY_FORCE_INLINE
+void lay_mark_dirty(lay_context *ctx, lay_id item)
+{
+    while (item != LAY_INVALID_ID) {
+        uint32_t *flags = &LAY_FLAGS(ctx, item);
+        if (*flags & LAY_ITEM_DIRTY) break;
+        *flags |= LAY_ITEM_DIRTY;
+        item = LAY_PARENT(ctx, item);
+    }
+}
 
 void lay_run_context(lay_context *ctx)
 {
@@ -539,14 +1533,87 @@ void lay_run_context(lay_context *ctx)
     }
 }
 
+// Makes room in the cache for all of the items that can be created without
+// reallocating. The entries of new items are left uninitialized, which is fine
+// since new items are dirty.
+static void lay_reserve_cache(lay_context *ctx)
+{
+    if (ctx->cache_capacity < ctx->capacity) {
+        ctx->cache = (lay_vec4*)lay_realloc(ctx, ctx->cache,
+            ctx->cache_capacity * sizeof(lay_vec4), ctx->capacity * sizeof(lay_vec4));
+        ctx->cache_capacity = ctx->capacity;
+    }
+}
+
+void lay_run_dirty(lay_context *ctx)
+{
+    LAY_ASSERT(ctx != NULL);
+
+    if (ctx->count == 0)
+        return;
+    lay_reserve_cache(ctx);
+    lay_prepare_rects(ctx);
+    // Clean subtrees are skipped, so if there are new items that could be in
+    // them, the rects are compared after the run instead.
+    bool scan_changes = false;
+    if (ctx->changes != NULL)
+        scan_changes = !lay_begin_changes(ctx);
+    // Nothing has changed since the last run
+    if (!(LAY_FLAGS(ctx, 0) & LAY_ITEM_DIRTY)) {
+        if (ctx->changes != NULL)
+            lay_end_changes(ctx);
+        return;
+    }
+#ifdef LAY_TRACE
+    if (ctx->trace != NULL) {
+        lay_run_traced(ctx, 0, true);
+        lay_scan_changes(ctx, 0);
+        return;
+    }
+#endif
+
+    lay_calc_size_dirty(ctx, 0, 0);
+    lay_arrange_dirty(ctx, 0, 0);
+    lay_calc_size_dirty(ctx, 0, 1);
+    if (scan_changes) {
+        lay_arrange_dirty(ctx, 0, 1);
+        lay_scan_changes(ctx, 0);
+    } else if (ctx->changes != NULL) {
+        lay_arrange_dirty_tracked(ctx, 0, 1);
+        lay_end_changes(ctx);
+    } else {
+        lay_arrange_dirty(ctx, 0, 1);
+    }
+}
+
 void lay_run_item(lay_context *ctx, lay_id item)
 {
     LAY_ASSERT(ctx != NULL);
+    lay_prepare_rects(ctx);
+    if (ctx->changes != NULL)
+        lay_begin_changes(ctx);
+#ifdef LAY_TRACE
+    if (ctx->trace != NULL) {
+        lay_run_traced(ctx, item, false);
+        lay_scan_changes(ctx, item);
+        return;
+    }
+#endif
+    if (ctx->memo != NULL) {
+        lay_run_memo(ctx, item);
+        lay_scan_changes(ctx, item);
+        return;
+    }
 
     lay_calc_size(ctx, item, 0);
     lay_arrange(ctx, item, 0);
     lay_calc_size(ctx, item, 1);
-    lay_arrange(ctx, item, 1);
+    if (ctx->changes != NULL) {
+        lay_arrange_tracked(ctx, item, 1);
+        lay_end_changes(ctx);
+    } else {
+        lay_arrange(ctx, item, 1);
+    }
 }
 
 // Alternatively, we could use a flag bit to indicate whether an item's children
@@ -556,8 +1623,11 @@ void lay_run_item(lay_context *ctx, lay_id item)
 void lay_clear_item_break(lay_context *ctx, lay_id item)
 {
     LAY_ASSERT(ctx != NULL);
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    pitem->flags = pitem->flags & ~(uint32_t)LAY_BREAK;
+    uint32_t *flags = &LAY_FLAGS(ctx, item);
+    if (*flags & LAY_BREAK) {
+        *flags = *flags & ~(uint32_t)LAY_BREAK;
+        lay_mark_dirty(ctx, item);
+    }
 }
 
 lay_id lay_items_count(lay_context *ctx)
@@ -572,142 +1642,182 @@ lay_id lay_items_capacity(lay_context *ctx)
     return ctx->capacity;
 }
 
-lay_id lay_item(lay_context *ctx)
+// Grows the item storage so that it can hold end items, in the same steps as
+// lay_item() takes one item at a time.
+static void lay_grow_items_for(lay_context *ctx, lay_id end)
 {
-    lay_id idx = ctx->count++;
-
-    if (idx >= ctx->capacity) {
-        ctx->capacity = ctx->capacity < 1 ? 32 : (ctx->capacity * 4);
-        const size_t item_size = sizeof(lay_item_t) + sizeof(lay_vec4);
-        ctx->items = (lay_item_t*)LAY_REALLOC(ctx->items, ctx->capacity * item_size);
-        const lay_item_t *past_last = ctx->items + ctx->capacity;
-        ctx->rects = (lay_vec4*)past_last;
-    }
+    LAY_STAT_ADD(ctx, item_reallocs, 1);
+#ifdef LAY_PAGED
+    lay_grow_items(ctx, end);
+#else
+    const lay_id capacity = ctx->capacity < 1 ? 32 : (ctx->capacity * 4);
+    lay_grow_items(ctx, capacity < end ? end : capacity);
+#endif
+}
 
+static LAY_FORCE_INLINE
+void lay_init_item(lay_context *ctx, lay_id idx)
+{
+#ifdef LAY_SOA
+    ctx->margins[0][idx][0] = 0;
+    ctx->margins[0][idx][1] = 0;
+    ctx->margins[1][idx][0] = 0;
+    ctx->margins[1][idx][1] = 0;
+    ctx->sizes[0][idx] = 0;
+    ctx->sizes[1][idx] = 0;
+#else
     lay_item_t *item = lay_get_item(ctx, idx);
     // We can either do this here, or when creating/resetting buffer
     LAY_MEMSET(item, 0, sizeof(lay_item_t));
-    item->first_child = LAY_INVALID_ID;
-    item->next_sibling = LAY_INVALID_ID;
-    // hmm
-    LAY_MEMSET(&ctx->rects[idx], 0, sizeof(lay_vec4));
-    return idx;
+#endif
+    // New items have never been calculated
+    LAY_FLAGS(ctx, idx) = LAY_ITEM_DIRTY;
+    LAY_FIRST_CHILD(ctx, idx) = LAY_INVALID_ID;
+    LAY_LAST_CHILD(ctx, idx) = LAY_INVALID_ID;
+    LAY_NEXT_SIBLING(ctx, idx) = LAY_INVALID_ID;
+    LAY_PARENT(ctx, idx) = LAY_INVALID_ID;
+#ifdef LAY_PAGED
+    LAY_MEMSET(&LAY_RECT(ctx, idx), 0, sizeof(lay_vec4));
+#endif
 }
 
-static LAY_FORCE_INLINE
-void lay_append_by_ptr(
-        lay_item_t *LAY_RESTRICT pearlier,
-        lay_id later, lay_item_t *LAY_RESTRICT plater)
+lay_id lay_item(lay_context *ctx)
 {
-    plater->next_sibling = pearlier->next_sibling;
-    plater->flags |= LAY_ITEM_INSERTED;
-    pearlier->next_sibling = later;
+    lay_id idx = ctx->count++;
+    if (idx >= ctx->capacity)
+        lay_grow_items_for(ctx, idx + 1);
+    lay_init_item(ctx, idx);
+    return idx;
 }
 
-lay_id lay_last_child(const lay_context *ctx, lay_id parent)
+lay_id lay_items(lay_context *ctx, lay_id count)
 {
-    lay_item_t *pparent = lay_get_item(ctx, parent);
-    lay_id child = pparent->first_child;
-    if (child == LAY_INVALID_ID) return LAY_INVALID_ID;
-    lay_item_t *pchild = lay_get_item(ctx, child);
-    lay_id result = child;
-    for (;;) {
-        lay_id next = pchild->next_sibling;
-        if (next == LAY_INVALID_ID) break;
-        result = next;
-        pchild = lay_get_item(ctx, next);
-    }
-    return result;
+    LAY_ASSERT(ctx != NULL);
+    if (count == 0)
+        return LAY_INVALID_ID;
+    const lay_id first = ctx->count;
+    LAY_ASSERT(count <= LAY_INVALID_ID - first);
+    const lay_id end = first + count;
+    if (end > ctx->capacity)
+        lay_grow_items_for(ctx, end);
+    ctx->count = end;
+    for (lay_id idx = first; idx < end; ++idx)
+        lay_init_item(ctx, idx);
+    return first;
+}
+
+static LAY_FORCE_INLINE
+void lay_append_by_id(lay_context *ctx, lay_id earlier, lay_id later)
+{
+    const lay_id parent = LAY_PARENT(ctx, earlier);
+    LAY_NEXT_SIBLING(ctx, later) = LAY_NEXT_SIBLING(ctx, earlier);
+    LAY_PARENT(ctx, later) = parent;
+    LAY_FLAGS(ctx, later) |= LAY_ITEM_INSERTED;
+    LAY_NEXT_SIBLING(ctx, earlier) = later;
+    if (parent != LAY_INVALID_ID && LAY_LAST_CHILD(ctx, parent) == earlier)
+        LAY_LAST_CHILD(ctx, parent) = later;
 }
 
 void lay_append(lay_context *ctx, lay_id earlier, lay_id later)
 {
     LAY_ASSERT(later != 0); // Must not be root item
     LAY_ASSERT(earlier != later); // Must not be same item id
-    lay_item_t *LAY_RESTRICT pearlier = lay_get_item(ctx, earlier);
-    lay_item_t *LAY_RESTRICT plater = lay_get_item(ctx, later);
-    lay_append_by_ptr(pearlier, later, plater);
+    lay_append_by_id(ctx, earlier, later);
+    LAY_FLAGS(ctx, later) |= LAY_ITEM_DIRTY;
+    lay_mark_dirty(ctx, LAY_PARENT(ctx, later));
 }
 
 void lay_insert(lay_context *ctx, lay_id parent, lay_id child)
 {
     LAY_ASSERT(child != 0); // Must not be root item
     LAY_ASSERT(parent != child); // Must not be same item id
-    lay_item_t *LAY_RESTRICT pparent = lay_get_item(ctx, parent);
-    lay_item_t *LAY_RESTRICT pchild = lay_get_item(ctx, child);
-    LAY_ASSERT(!(pchild->flags & LAY_ITEM_INSERTED));
+    LAY_ASSERT(!(LAY_FLAGS(ctx, child) & LAY_ITEM_INSERTED));
     // Parent has no existing children, make inserted item the first child.
-    if (pparent->first_child == LAY_INVALID_ID) {
-        pparent->first_child = child;
-        pchild->flags |= LAY_ITEM_INSERTED;
-    // Parent has existing items, iterate to find the last child and append the
-    // inserted item after it.
+    if (LAY_FIRST_CHILD(ctx, parent) == LAY_INVALID_ID) {
+        LAY_FIRST_CHILD(ctx, parent) = child;
+        LAY_LAST_CHILD(ctx, parent) = child;
+        LAY_PARENT(ctx, child) = parent;
+        LAY_FLAGS(ctx, child) |= LAY_ITEM_INSERTED;
+    // Parent has existing items, append the inserted item after the last one.
     } else {
-        lay_id next = pparent->first_child;
-        lay_item_t *LAY_RESTRICT pnext = lay_get_item(ctx, next);
-        for (;;) {
-            next = pnext->next_sibling;
-            if (next == LAY_INVALID_ID) break;
-            pnext = lay_get_item(ctx, next);
-        }
-        lay_append_by_ptr(pnext, child, pchild);
+        lay_append_by_id(ctx, LAY_LAST_CHILD(ctx, parent), child);
     }
+    LAY_FLAGS(ctx, child) |= LAY_ITEM_DIRTY;
+    lay_mark_dirty(ctx, parent);
 }
 
 void lay_push(lay_context *ctx, lay_id parent, lay_id new_child)
 {
     LAY_ASSERT(new_child != 0); // Must not be root item
     LAY_ASSERT(parent != new_child); // Must not be same item id
-    lay_item_t *LAY_RESTRICT pparent = lay_get_item(ctx, parent);
-    lay_id old_child = pparent->first_child;
-    lay_item_t *LAY_RESTRICT pchild = lay_get_item(ctx, new_child);
-    LAY_ASSERT(!(pchild->flags & LAY_ITEM_INSERTED));
-    pparent->first_child = new_child;
-    pchild->flags |= LAY_ITEM_INSERTED;
-    pchild->next_sibling = old_child;
+    LAY_ASSERT(!(LAY_FLAGS(ctx, new_child) & LAY_ITEM_INSERTED));
+    const lay_id old_child = LAY_FIRST_CHILD(ctx, parent);
+    LAY_FIRST_CHILD(ctx, parent) = new_child;
+    if (old_child == LAY_INVALID_ID)
+        LAY_LAST_CHILD(ctx, parent) = new_child;
+    LAY_FLAGS(ctx, new_child) |= LAY_ITEM_INSERTED | LAY_ITEM_DIRTY;
+    LAY_NEXT_SIBLING(ctx, new_child) = old_child;
+    LAY_PARENT(ctx, new_child) = parent;
+    lay_mark_dirty(ctx, parent);
+}
+
+void lay_insert_range(lay_context *ctx, lay_id parent, lay_id first, lay_id count)
+{
+    LAY_ASSERT(ctx != NULL);
+    if (count == 0)
+        return;
+    const lay_id last = first + count - 1;
+    LAY_ASSERT(first != 0 && last >= first); // Must not be root item
+    LAY_ASSERT(parent < first || parent > last); // Must not be in the range
+    for (lay_id child = first; child < last; ++child) {
+        LAY_ASSERT(!(LAY_FLAGS(ctx, child) & LAY_ITEM_INSERTED));
+        LAY_FLAGS(ctx, child) |= LAY_ITEM_INSERTED | LAY_ITEM_DIRTY;
+        LAY_NEXT_SIBLING(ctx, child) = child + 1;
+        LAY_PARENT(ctx, child) = parent;
+    }
+    LAY_ASSERT(!(LAY_FLAGS(ctx, last) & LAY_ITEM_INSERTED));
+    LAY_FLAGS(ctx, last) |= LAY_ITEM_INSERTED | LAY_ITEM_DIRTY;
+    LAY_NEXT_SIBLING(ctx, last) = LAY_INVALID_ID;
+    LAY_PARENT(ctx, last) = parent;
+    if (LAY_FIRST_CHILD(ctx, parent) == LAY_INVALID_ID)
+        LAY_FIRST_CHILD(ctx, parent) = first;
+    else
+        LAY_NEXT_SIBLING(ctx, LAY_LAST_CHILD(ctx, parent)) = first;
+    LAY_LAST_CHILD(ctx, parent) = last;
+    lay_mark_dirty(ctx, parent);
 }
 
 lay_vec2 lay_get_size(lay_context *ctx, lay_id item)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    return pitem->size;
+    lay_vec2 size;
+    size[0] = LAY_SIZE(ctx, item, 0);
+    size[1] = LAY_SIZE(ctx, item, 1);
+    return size;
 }
 
 void lay_get_size_xy(
         lay_context *ctx, lay_id item,
         lay_scalar *x, lay_scalar *y)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    lay_vec2 size = pitem->size;
-    *x = size[0];
-    *y = size[1];
+    *x = LAY_SIZE(ctx, item, 0);
+    *y = LAY_SIZE(ctx, item, 1);
 }
 
 void lay_set_size(lay_context *ctx, lay_id item, lay_vec2 size)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    pitem->size = size;
-    uint32_t flags = pitem->flags;
-    if (size[0] == 0)
-        flags &= ~(uint32_t)LAY_ITEM_HFIXED;
-    else
-        flags |= LAY_ITEM_HFIXED;
-    if (size[1] == 0)
-        flags &= ~(uint32_t)LAY_ITEM_VFIXED;
-    else
-        flags |= LAY_ITEM_VFIXED;
-    pitem->flags = flags;
+    lay_set_size_xy(ctx, item, size[0], size[1]);
 }
 
 void lay_set_size_xy(
         lay_context *ctx, lay_id item,
         lay_scalar width, lay_scalar height)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    pitem->size[0] = width;
-    pitem->size[1] = height;
+    if (LAY_SIZE(ctx, item, 0) == width && LAY_SIZE(ctx, item, 1) == height)
+        return;
+    LAY_SIZE(ctx, item, 0) = width;
+    LAY_SIZE(ctx, item, 1) = height;
     // Kinda redundant, whatever
-    uint32_t flags = pitem->flags;
+    uint32_t flags = LAY_FLAGS(ctx, item);
     if (width == 0)
         flags &= ~(uint32_t)LAY_ITEM_HFIXED;
     else
@@ -716,56 +1826,77 @@ void lay_set_size_xy(
         flags &= ~(uint32_t)LAY_ITEM_VFIXED;
     else
         flags |= LAY_ITEM_VFIXED;
-    pitem->flags = flags;
+    LAY_FLAGS(ctx, item) = flags;
+    lay_mark_dirty(ctx, item);
 }
 
 void lay_set_behave(lay_context *ctx, lay_id item, uint32_t flags)
 {
     LAY_ASSERT((flags & LAY_ITEM_LAYOUT_MASK) == flags);
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    pitem->flags = (pitem->flags & ~(uint32_t)LAY_ITEM_LAYOUT_MASK) | flags;
+    const uint32_t old_flags = LAY_FLAGS(ctx, item);
+    const uint32_t new_flags = (old_flags & ~(uint32_t)LAY_ITEM_LAYOUT_MASK) | flags;
+    if (new_flags != old_flags) {
+        LAY_FLAGS(ctx, item) = new_flags;
+        lay_mark_dirty(ctx, item);
+    }
 }
 
 void lay_set_contain(lay_context *ctx, lay_id item, uint32_t flags)
 {
     LAY_ASSERT((flags & LAY_ITEM_BOX_MASK) == flags);
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    pitem->flags = (pitem->flags & ~(uint32_t)LAY_ITEM_BOX_MASK) | flags;
+    const uint32_t old_flags = LAY_FLAGS(ctx, item);
+    const uint32_t new_flags = (old_flags & ~(uint32_t)LAY_ITEM_BOX_MASK) | flags;
+    if (new_flags != old_flags) {
+        LAY_FLAGS(ctx, item) = new_flags;
+        lay_mark_dirty(ctx, item);
+        // The children of a wrapping column are only placed horizontally in
+        // the vertical pass, after their own children. Their rects from the
+        // last run don't say where those were placed from once the item starts
+        // or stops wrapping, so they have to be arranged again.
+        const uint32_t column_wrap = LAY_COLUMN | LAY_WRAP;
+        if (((old_flags & LAY_ITEM_BOX_MODEL_MASK) == column_wrap)
+            != ((new_flags & LAY_ITEM_BOX_MODEL_MASK) == column_wrap)) {
+            lay_id child = LAY_FIRST_CHILD(ctx, item);
+            while (child != LAY_INVALID_ID) {
+                LAY_FLAGS(ctx, child) |= LAY_ITEM_DIRTY;
+                child = LAY_NEXT_SIBLING(ctx, child);
+            }
+        }
+    }
 }
 void lay_set_margins(lay_context *ctx, lay_id item, lay_vec4 ltrb)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    pitem->margins = ltrb;
+    lay_set_margins_ltrb(ctx, item, ltrb[0], ltrb[1], ltrb[2], ltrb[3]);
 }
 void lay_set_margins_ltrb(
         lay_context *ctx, lay_id item,
         lay_scalar l, lay_scalar t, lay_scalar r, lay_scalar b)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    // Alternative, uses stack and addressed writes
-    //pitem->margins = lay_vec4_xyzw(l, t, r, b);
-    // Alternative, uses rax and left-shift
-    //pitem->margins = (lay_vec4){l, t, r, b};
-    // Fewest instructions, but uses more addressed writes?
-    pitem->margins[0] = l;
-    pitem->margins[1] = t;
-    pitem->margins[2] = r;
-    pitem->margins[3] = b;
+    if (LAY_MARGIN(ctx, item, 0) == l && LAY_MARGIN(ctx, item, 1) == t &&
+        LAY_MARGIN(ctx, item, 2) == r && LAY_MARGIN(ctx, item, 3) == b)
+        return;
+    LAY_MARGIN(ctx, item, 0) = l;
+    LAY_MARGIN(ctx, item, 1) = t;
+    LAY_MARGIN(ctx, item, 2) = r;
+    LAY_MARGIN(ctx, item, 3) = b;
+    lay_mark_dirty(ctx, item);
 }
 
 lay_vec4 lay_get_margins(lay_context *ctx, lay_id item)
-{ return lay_get_item(ctx, item)->margins; }
+{
+    return lay_vec4_xyzw(
+        LAY_MARGIN(ctx, item, 0), LAY_MARGIN(ctx, item, 1),
+        LAY_MARGIN(ctx, item, 2), LAY_MARGIN(ctx, item, 3));
+}
 
 void lay_get_margins_ltrb(
         lay_context *ctx, lay_id item,
         lay_scalar *l, lay_scalar *t, lay_scalar *r, lay_scalar *b)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    lay_vec4 margins = pitem->margins;
-    *l = margins[0];
-    *t = margins[1];
-    *r = margins[2];
-    *b = margins[3];
+    *l = LAY_MARGIN(ctx, item, 0);
+    *t = LAY_MARGIN(ctx, item, 1);
+    *r = LAY_MARGIN(ctx, item, 2);
+    *b = LAY_MARGIN(ctx, item, 3);
 }
 
 // TODO restrict item ptrs correctly
@@ -774,16 +1905,14 @@ lay_scalar lay_calc_overlayed_size(
         lay_context *ctx, lay_id item, int dim)
 {
     const int wdim = dim + 2;
-    lay_item_t *LAY_RESTRICT pitem = lay_get_item(ctx, item);
     lay_scalar need_size = 0;
-    lay_id child = pitem->first_child;
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
     while (child != LAY_INVALID_ID) {
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        lay_vec4 rect = ctx->rects[child];
+        lay_vec4 rect = LAY_RECT(ctx, child);
         // width = start margin + calculated width + end margin
-        lay_scalar child_size = rect[dim] + rect[2 + dim] + pchild->margins[wdim];
+        lay_scalar child_size = rect[dim] + rect[2 + dim] + LAY_MARGIN(ctx, child, wdim);
         need_size = lay_scalar_max(need_size, child_size);
-        child = pchild->next_sibling;
+        child = LAY_NEXT_SIBLING(ctx, child);
     }
     return need_size;
 }
@@ -793,14 +1922,12 @@ lay_scalar lay_calc_stacked_size(
         lay_context *ctx, lay_id item, int dim)
 {
     const int wdim = dim + 2;
-    lay_item_t *LAY_RESTRICT pitem = lay_get_item(ctx, item);
     lay_scalar need_size = 0;
-    lay_id child = pitem->first_child;
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
     while (child != LAY_INVALID_ID) {
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        lay_vec4 rect = ctx->rects[child];
-        need_size += rect[dim] + rect[2 + dim] + pchild->margins[wdim];
-        child = pchild->next_sibling;
+        lay_vec4 rect = LAY_RECT(ctx, child);
+        need_size += rect[dim] + rect[2 + dim] + LAY_MARGIN(ctx, child, wdim);
+        child = LAY_NEXT_SIBLING(ctx, child);
     }
     return need_size;
 }
@@ -810,20 +1937,18 @@ lay_scalar lay_calc_wrapped_overlayed_size(
         lay_context *ctx, lay_id item, int dim)
 {
     const int wdim = dim + 2;
-    lay_item_t *LAY_RESTRICT pitem = lay_get_item(ctx, item);
     lay_scalar need_size = 0;
     lay_scalar need_size2 = 0;
-    lay_id child = pitem->first_child;
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
     while (child != LAY_INVALID_ID) {
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        lay_vec4 rect = ctx->rects[child];
-        if (pchild->flags & LAY_BREAK) {
+        lay_vec4 rect = LAY_RECT(ctx, child);
+        if (LAY_FLAGS(ctx, child) & LAY_BREAK) {
             need_size2 += need_size;
             need_size = 0;
         }
-        lay_scalar child_size = rect[dim] + rect[2 + dim] + pchild->margins[wdim];
+        lay_scalar child_size = rect[dim] + rect[2 + dim] + LAY_MARGIN(ctx, child, wdim);
         need_size = lay_scalar_max(need_size, child_size);
-        child = pchild->next_sibling;
+        child = LAY_NEXT_SIBLING(ctx, child);
     }
     return need_size2 + need_size;
 }
@@ -834,50 +1959,42 @@ lay_scalar lay_calc_wrapped_stacked_size(
         lay_context *ctx, lay_id item, int dim)
 {
     const int wdim = dim + 2;
-    lay_item_t *LAY_RESTRICT pitem = lay_get_item(ctx, item);
     lay_scalar need_size = 0;
     lay_scalar need_size2 = 0;
-    lay_id child = pitem->first_child;
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
     while (child != LAY_INVALID_ID) {
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        lay_vec4 rect = ctx->rects[child];
-        if (pchild->flags & LAY_BREAK) {
+        lay_vec4 rect = LAY_RECT(ctx, child);
+        if (LAY_FLAGS(ctx, child) & LAY_BREAK) {
             need_size2 = lay_scalar_max(need_size2, need_size);
             need_size = 0;
         }
-        need_size += rect[dim] + rect[2 + dim] + pchild->margins[wdim];
-        child = pchild->next_sibling;
+        need_size += rect[dim] + rect[2 + dim] + LAY_MARGIN(ctx, child, wdim);
+        child = LAY_NEXT_SIBLING(ctx, child);
     }
     return lay_scalar_max(need_size2, need_size);
 }
 
-static void lay_calc_size(lay_context *ctx, lay_id item, int dim)
+// Calculates the size of a single item, assuming its children have already had
+// their sizes calculated.
+static LAY_FORCE_INLINE
+void lay_calc_item_size(lay_context *ctx, lay_id item, int dim)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
-
-    lay_id child = pitem->first_child;
-    while (child != LAY_INVALID_ID) {
-        // NOTE: this is recursive and will run out of stack space if items are
-        // nested too deeply.
-        lay_calc_size(ctx, child, dim);
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        child = pchild->next_sibling;
-    }
+    LAY_STAT_ADD(ctx, calc_size_items[dim], 1);
 
     // Set the mutable rect output data to the starting input data
-    ctx->rects[item][dim] = pitem->margins[dim];
+    LAY_RECT(ctx, item)[dim] = LAY_MARGIN(ctx, item, dim);
 
     // If we have an explicit input size, just set our output size (which other
     // calc_size and arrange procedures will use) to it.
-    if (pitem->size[dim] != 0) {
-        ctx->rects[item][2 + dim] = pitem->size[dim];
+    if (LAY_SIZE(ctx, item, dim) != 0) {
+        LAY_RECT(ctx, item)[2 + dim] = LAY_SIZE(ctx, item, dim);
         return;
     }
 
     // Calculate our size based on children items. Note that we've already
     // called lay_calc_size on our children at this point.
     lay_scalar cal_size;
-    switch (pitem->flags & LAY_ITEM_BOX_MODEL_MASK) {
+    switch (LAY_FLAGS(ctx, item) & LAY_ITEM_BOX_MODEL_MASK) {
     case LAY_COLUMN|LAY_WRAP:
         // flex model
         if (dim) // direction
@@ -895,7 +2012,7 @@ static void lay_calc_size(lay_context *ctx, lay_id item, int dim)
     case LAY_COLUMN:
     case LAY_ROW:
         // flex model
-        if ((pitem->flags & 1) == (uint32_t)dim) // direction
+        if ((LAY_FLAGS(ctx, item) & 1) == (uint32_t)dim) // direction
             cal_size = lay_calc_stacked_size(ctx, item, dim);
         else
             cal_size = lay_calc_overlayed_size(ctx, item, dim);
@@ -908,7 +2025,106 @@ static void lay_calc_size(lay_context *ctx, lay_id item, int dim)
 
     // Set our output data size. Will be used by parent calc_size procedures.,
     // and by arrange procedures.
-    ctx->rects[item][2 + dim] = cal_size;
+    LAY_RECT(ctx, item)[2 + dim] = cal_size;
+}
+
+// The traversals below walk the tree with the first_child, next_sibling and
+// parent links instead of recursing, so they don't need a stack or any extra
+// memory, no matter how deeply the items are nested.
+
+// Returns the next sibling of an item, or of the closest of its ancestors that
+// has one, without going above root. Returns LAY_INVALID_ID when there are no
+// more items to visit in a pre-order walk.
+static LAY_FORCE_INLINE
+lay_id lay_next_preorder_up(const lay_context *ctx, lay_id root, lay_id item)
+{
+    while (item != root) {
+        const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+        if (next != LAY_INVALID_ID)
+            return next;
+        item = LAY_PARENT(ctx, item);
+    }
+    return LAY_INVALID_ID;
+}
+
+static LAY_FORCE_INLINE
+void lay_calc_size_impl(lay_context *ctx, lay_id item, int dim)
+{
+    const lay_id root = item;
+    LAY_STAT(uint32_t depth = 0);
+    for (;;) {
+        // Children are calculated before their parents, so go down to the
+        // first leaf.
+        lay_id child;
+        while ((child = LAY_FIRST_CHILD(ctx, item)) != LAY_INVALID_ID) {
+            item = child;
+            LAY_STAT(++depth);
+        }
+        LAY_STAT(if (depth > ctx->stats.max_depth) ctx->stats.max_depth = depth);
+        // Then calculate back up, until we find a sibling which still needs
+        // its own subtree calculated.
+        for (;;) {
+            lay_calc_item_size(ctx, item, dim);
+            if (item == root)
+                return;
+            const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+            if (next != LAY_INVALID_ID) {
+                item = next;
+                break;
+            }
+            item = LAY_PARENT(ctx, item);
+            LAY_STAT(--depth);
+        }
+    }
+}
+
+// Goes through the siblings starting at child, and returns the first one that
+// is dirty. The clean ones along the way get their calculated size from the
+// cache instead, and the rectangle they had at the end of the previous run is
+// saved in the other half of their cache entry, so lay_arrange_dirty can check
+// if they've moved.
+static LAY_FORCE_INLINE
+lay_id lay_calc_clean_siblings(lay_context *ctx, lay_id child, int dim)
+{
+    while (child != LAY_INVALID_ID) {
+        if (LAY_FLAGS(ctx, child) & LAY_ITEM_DIRTY)
+            break;
+        lay_vec4 *cached = &ctx->cache[child];
+        lay_vec4 *rect = &LAY_RECT(ctx, child);
+        (*cached)[2] = (*rect)[dim];
+        (*cached)[3] = (*rect)[2 + dim];
+        (*rect)[dim] = LAY_MARGIN(ctx, child, dim);
+        (*rect)[2 + dim] = (*cached)[dim];
+        child = LAY_NEXT_SIBLING(ctx, child);
+    }
+    return child;
+}
+
+// Like lay_calc_size, but only descends into dirty items.
+static LAY_FORCE_INLINE
+void lay_calc_size_dirty_impl(lay_context *ctx, lay_id item, int dim)
+{
+    const lay_id root = item;
+    for (;;) {
+        lay_id child = lay_calc_clean_siblings(
+            ctx, LAY_FIRST_CHILD(ctx, item), dim);
+        if (child != LAY_INVALID_ID) {
+            item = child;
+            continue;
+        }
+        for (;;) {
+            lay_calc_item_size(ctx, item, dim);
+            ctx->cache[item][dim] = LAY_RECT(ctx, item)[2 + dim];
+            if (item == root)
+                return;
+            child = lay_calc_clean_siblings(ctx, LAY_NEXT_SIBLING(ctx, item), dim);
+            if (child != LAY_INVALID_ID) {
+                item = child;
+                break;
+            }
+            item = LAY_PARENT(ctx, item);
+        }
+    }
 }
 
 static LAY_FORCE_INLINE
@@ -916,15 +2132,19 @@ void lay_arrange_stacked(
             lay_context *ctx, lay_id item, int dim, bool wrap)
 {
     const int wdim = dim + 2;
-    lay_item_t *pitem = lay_get_item(ctx, item);
 
-    const uint32_t item_flags = pitem->flags;
-    lay_vec4 rect = ctx->rects[item];
+    const uint32_t item_flags = LAY_FLAGS(ctx, item);
+    lay_vec4 rect = LAY_RECT(ctx, item);
     lay_scalar space = rect[2 + dim];
 
-    float max_x2 = (float)(rect[dim] + space);
+    // The children are placed relative to the item, and its position is only
+    // added after rounding, so that the result doesn't depend on where the
+    // item is. Cached subtrees are arranged at position 0 and then moved, see
+    // lay_set_memo().
+    const lay_scalar offset = rect[dim];
+    const float max_x2 = (float)space;
 
-    lay_id start_child = pitem->first_child;
+    lay_id start_child = LAY_FIRST_CHILD(ctx, item);
     while (start_child != LAY_INVALID_ID) {
         lay_scalar used = 0;
         uint32_t count = 0; // count of fillers
@@ -936,20 +2156,19 @@ void lay_arrange_stacked(
         lay_id child = start_child;
         lay_id end_child = LAY_INVALID_ID;
         while (child != LAY_INVALID_ID) {
-            lay_item_t *pchild = lay_get_item(ctx, child);
-            const uint32_t child_flags = pchild->flags;
+            const uint32_t child_flags = LAY_FLAGS(ctx, child);
             const uint32_t flags = (child_flags & LAY_ITEM_LAYOUT_MASK) >> dim;
             const uint32_t fflags = (child_flags & LAY_ITEM_FIXED_MASK) >> dim;
-            const lay_vec4 child_margins = pchild->margins;
-            lay_vec4 child_rect = ctx->rects[child];
+            const lay_scalar child_margin = LAY_MARGIN(ctx, child, wdim);
+            lay_vec4 child_rect = LAY_RECT(ctx, child);
             lay_scalar extend = used;
             if ((flags & LAY_HFILL) == LAY_HFILL) {
                 ++count;
-                extend += child_rect[dim] + child_margins[wdim];
+                extend += child_rect[dim] + child_margin;
             } else {
                 if ((fflags & LAY_ITEM_HFIXED) != LAY_ITEM_HFIXED)
                     ++squeezed_count;
-                extend += child_rect[dim] + child_rect[2 + dim] + child_margins[wdim];
+                extend += child_rect[dim] + child_rect[2 + dim] + child_margin;
             }
             // wrap on end of line or manual flag
             if (wrap && (
@@ -958,15 +2177,16 @@ void lay_arrange_stacked(
                 end_child = child;
                 hardbreak = (child_flags & LAY_BREAK) == LAY_BREAK;
                 // add marker for subsequent queries
-                pchild->flags = child_flags | LAY_BREAK;
+                LAY_FLAGS(ctx, child) = child_flags | LAY_BREAK;
                 break;
             } else {
                 used = extend;
-                child = pchild->next_sibling;
+                child = LAY_NEXT_SIBLING(ctx, child);
             }
             ++total;
         }
 
+        LAY_STAT(if (wrap) ++ctx->stats.wrapped_lines[dim]);
         lay_scalar extra_space = space - used;
         float filler = 0.0f;
         float spacer = 0.0f;
@@ -974,9 +2194,10 @@ void lay_arrange_stacked(
         float eater = 0.0f;
 
         if (extra_space > 0) {
-            if (count > 0)
+            if (count > 0) {
                 filler = (float)extra_space / (float)count;
-            else if (total > 0) {
+                LAY_STAT_ADD(ctx, filler_items[dim], count);
+            } else if (total > 0) {
                 switch (item_flags & LAY_JUSTIFY) {
                 case LAY_JUSTIFY:
                     // justify when not wrapping or not in last line,
@@ -1007,21 +2228,23 @@ void lay_arrange_stacked(
         // This is the original oui code
         else if (!wrap && (extra_space < 0))
 #endif
+        {
             eater = (float)extra_space / (float)squeezed_count;
+            LAY_STAT(if (extra_space < 0) ctx->stats.squeezed_items[dim] += squeezed_count);
+        }
 
         // distribute width among items
-        float x = (float)rect[dim];
+        float x = 0.0f;
         float x1;
         // second pass: distribute and rescale
         child = start_child;
         while (child != end_child) {
             lay_scalar ix0, ix1;
-            lay_item_t *pchild = lay_get_item(ctx, child);
-            const uint32_t child_flags = pchild->flags;
+            const uint32_t child_flags = LAY_FLAGS(ctx, child);
             const uint32_t flags = (child_flags & LAY_ITEM_LAYOUT_MASK) >> dim;
             const uint32_t fflags = (child_flags & LAY_ITEM_FIXED_MASK) >> dim;
-            const lay_vec4 child_margins = pchild->margins;
-            lay_vec4 child_rect = ctx->rects[child];
+            const lay_scalar child_margin = LAY_MARGIN(ctx, child, wdim);
+            lay_vec4 child_rect = LAY_RECT(ctx, child);
 
             x += (float)child_rect[dim] + extra_margin;
             if ((flags & LAY_HFILL) == LAY_HFILL) // grow
@@ -1031,16 +2254,16 @@ void lay_arrange_stacked(
             else // squeeze
                 x1 = x + lay_float_max(0.0f, (float)child_rect[2 + dim] + eater);
 
-            ix0 = (lay_scalar)x;
+            ix0 = lay_scalar_floor(x);
             if (wrap)
-                ix1 = (lay_scalar)lay_float_min(max_x2 - (float)child_margins[wdim], x1);
+                ix1 = lay_scalar_floor(lay_float_min(max_x2 - (float)child_margin, x1));
             else
-                ix1 = (lay_scalar)x1;
-            child_rect[dim] = ix0; // pos
+                ix1 = lay_scalar_floor(x1);
+            child_rect[dim] = (lay_scalar)(offset + ix0); // pos
             child_rect[dim + 2] = ix1 - ix0; // size
-            ctx->rects[child] = child_rect;
-            x = x1 + (float)child_margins[wdim];
-            child = pchild->next_sibling;
+            LAY_RECT(ctx, child) = child_rect;
+            x = x1 + (float)child_margin;
+            child = LAY_NEXT_SIBLING(ctx, child);
             extra_margin = spacer;
         }
 
@@ -1048,40 +2271,231 @@ void lay_arrange_stacked(
     }
 }
 
+// The space left for an item after its position and end margin, which is never
+// negative. In int16 builds, it's calculated in int and clamped so that large
+// margins or positions can't wrap it around.
+static LAY_FORCE_INLINE
+lay_scalar lay_fill_size(lay_scalar space, lay_scalar pos, lay_scalar margin_end)
+{
+#ifdef LAY_FLOAT
+    return lay_scalar_max(0, space - pos - margin_end);
+#else
+    const int size = space - pos - margin_end;
+    return (lay_scalar)(size > 0 ? (size < INT16_MAX ? size : INT16_MAX) : 0);
+#endif
+}
+
+// Explicit SSE2 versions of the overlay kernels below. The children are
+// gathered in batches of LAY_SIMD_LANES into arrays with one element per child,
+// all of the alignment cases are calculated at once for the whole batch, and
+// the results are scattered back into the rects. The math is done in the same
+// order and with the same int16 truncation and rounding as the scalar code, so
+// the results are identical.
+#ifdef LAY_SIMD_SSE2
+
+#define LAY_SIMD_LANES 8
+
+typedef struct lay_overlay_lanes {
+    lay_scalar pos[LAY_SIMD_LANES];
+    lay_scalar size[LAY_SIMD_LANES];
+    lay_scalar margin_start[LAY_SIMD_LANES];
+    lay_scalar margin_end[LAY_SIMD_LANES];
+    // The item's LAY_HFILL bits for the dimension
+    lay_scalar align[LAY_SIMD_LANES];
+} lay_overlay_lanes;
+
+#ifdef LAY_FLOAT
+static LAY_FORCE_INLINE
+__m128 lay_select_ps(__m128 mask, __m128 a, __m128 b)
+{ return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+static LAY_FORCE_INLINE
+void lay_overlay_kernel_sse2(
+        lay_overlay_lanes *lanes, lay_scalar offset, lay_scalar space,
+        bool squeezed)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 off = _mm_set1_ps(offset);
+    const __m128 sp = _mm_set1_ps(space);
+    for (int i = 0; i < LAY_SIMD_LANES; i += 4) {
+        __m128 x = _mm_loadu_ps(lanes->pos + i);
+        __m128 w = _mm_loadu_ps(lanes->size + i);
+        const __m128 ms = _mm_loadu_ps(lanes->margin_start + i);
+        const __m128 me = _mm_loadu_ps(lanes->margin_end + i);
+        const __m128 align = _mm_loadu_ps(lanes->align + i);
+        const __m128 is_center = _mm_cmpeq_ps(align, _mm_set1_ps((float)LAY_HCENTER));
+        const __m128 is_right = _mm_cmpeq_ps(align, _mm_set1_ps((float)LAY_RIGHT));
+        const __m128 is_fill = _mm_cmpeq_ps(align, _mm_set1_ps((float)LAY_HFILL));
+        const __m128 fill_size = _mm_max_ps(zero, _mm_sub_ps(_mm_sub_ps(sp, x), me));
+        __m128 x_right;
+        if (squeezed) {
+            w = lay_select_ps(is_fill, fill_size, _mm_min_ps(w, fill_size));
+            x_right = _mm_sub_ps(_mm_sub_ps(sp, w), me);
+        } else {
+            x_right = _mm_add_ps(x, _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(sp, w), ms), me));
+        }
+        const __m128 x_center = _mm_add_ps(x, _mm_sub_ps(_mm_div_ps(_mm_sub_ps(sp, w), two), me));
+        x = lay_select_ps(is_center, x_center, lay_select_ps(is_right, x_right, x));
+        if (!squeezed)
+            w = lay_select_ps(is_fill, fill_size, w);
+        _mm_storeu_ps(lanes->pos + i, _mm_add_ps(x, off));
+        _mm_storeu_ps(lanes->size + i, w);
+    }
+}
+#else
+static LAY_FORCE_INLINE
+__m128i lay_select_si128(__m128i mask, __m128i a, __m128i b)
+{ return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+// Sign extend the low or high 4 lanes of int16 to int32
+static LAY_FORCE_INLINE
+__m128i lay_widen_lo_epi16(__m128i a)
+{ return _mm_srai_epi32(_mm_unpacklo_epi16(a, a), 16); }
+
+static LAY_FORCE_INLINE
+__m128i lay_widen_hi_epi16(__m128i a)
+{ return _mm_srai_epi32(_mm_unpackhi_epi16(a, a), 16); }
+
+// SSE2 has no max for int32
+static LAY_FORCE_INLINE
+__m128i lay_max_epi32(__m128i a, __m128i b)
+{ return lay_select_si128(_mm_cmpgt_epi32(a, b), a, b); }
+
+// (a - b) / 2, where the subtraction and division are done in int like in C,
+// instead of wrapping around in int16.
+static LAY_FORCE_INLINE
+__m128i lay_half_difference_epi16(__m128i a, __m128i b)
+{
+    __m128i d_lo = _mm_sub_epi32(lay_widen_lo_epi16(a), lay_widen_lo_epi16(b));
+    __m128i d_hi = _mm_sub_epi32(lay_widen_hi_epi16(a), lay_widen_hi_epi16(b));
+    // Round towards zero by adding 1 to negative numbers before shifting
+    d_lo = _mm_srai_epi32(_mm_add_epi32(d_lo, _mm_srli_epi32(d_lo, 31)), 1);
+    d_hi = _mm_srai_epi32(_mm_add_epi32(d_hi, _mm_srli_epi32(d_hi, 31)), 1);
+    // The halves always fit in int16, so the saturation doesn't do anything
+    return _mm_packs_epi32(d_lo, d_hi);
+}
+
+static LAY_FORCE_INLINE
+void lay_overlay_kernel_sse2(
+        lay_overlay_lanes *lanes, lay_scalar offset, lay_scalar space,
+        bool squeezed)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i off = _mm_set1_epi16(offset);
+    const __m128i sp = _mm_set1_epi16(space);
+    const __m128i sp32 = _mm_set1_epi32(space);
+    __m128i x = _mm_loadu_si128((const __m128i*)lanes->pos);
+    __m128i w = _mm_loadu_si128((const __m128i*)lanes->size);
+    const __m128i ms = _mm_loadu_si128((const __m128i*)lanes->margin_start);
+    const __m128i me = _mm_loadu_si128((const __m128i*)lanes->margin_end);
+    const __m128i align = _mm_loadu_si128((const __m128i*)lanes->align);
+    const __m128i is_center = _mm_cmpeq_epi16(align, _mm_set1_epi16(LAY_HCENTER));
+    const __m128i is_right = _mm_cmpeq_epi16(align, _mm_set1_epi16(LAY_RIGHT));
+    const __m128i is_fill = _mm_cmpeq_epi16(align, _mm_set1_epi16(LAY_HFILL));
+    // Like lay_fill_size(), the fill size is calculated in int32 and then
+    // clamped, which the saturation when packing does at the top.
+    const __m128i fill_lo = lay_max_epi32(zero, _mm_sub_epi32(
+        _mm_sub_epi32(sp32, lay_widen_lo_epi16(x)), lay_widen_lo_epi16(me)));
+    const __m128i fill_hi = lay_max_epi32(zero, _mm_sub_epi32(
+        _mm_sub_epi32(sp32, lay_widen_hi_epi16(x)), lay_widen_hi_epi16(me)));
+    const __m128i fill_size = _mm_packs_epi32(fill_lo, fill_hi);
+    __m128i x_right;
+    if (squeezed) {
+        w = lay_select_si128(is_fill, fill_size, _mm_min_epi16(w, fill_size));
+        x_right = _mm_sub_epi16(_mm_sub_epi16(sp, w), me);
+    } else {
+        x_right = _mm_add_epi16(x, _mm_sub_epi16(_mm_sub_epi16(_mm_sub_epi16(sp, w), ms), me));
+    }
+    const __m128i x_center = _mm_add_epi16(x, _mm_sub_epi16(lay_half_difference_epi16(sp, w), me));
+    x = lay_select_si128(is_center, x_center, lay_select_si128(is_right, x_right, x));
+    if (!squeezed)
+        w = lay_select_si128(is_fill, fill_size, w);
+    _mm_storeu_si128((__m128i*)lanes->pos, _mm_add_epi16(x, off));
+    _mm_storeu_si128((__m128i*)lanes->size, w);
+}
+#endif // LAY_FLOAT
+
+// Does the same as lay_arrange_overlay() (or
+// lay_arrange_overlay_squeezed_range() if squeezed is true) for the children
+// from child up to, but not including, end_child.
+static LAY_FORCE_INLINE
+void lay_arrange_overlay_simd(
+        lay_context *ctx, int dim, lay_id child, lay_id end_child,
+        lay_scalar offset, lay_scalar space, bool squeezed)
+{
+    const int wdim = dim + 2;
+    lay_overlay_lanes lanes;
+    lay_id ids[LAY_SIMD_LANES];
+    while (child != end_child) {
+        int n = 0;
+        do {
+            const lay_vec4 rect = LAY_RECT(ctx, child);
+            ids[n] = child;
+            lanes.pos[n] = rect[dim];
+            lanes.size[n] = rect[2 + dim];
+            lanes.margin_start[n] = LAY_MARGIN(ctx, child, dim);
+            lanes.margin_end[n] = LAY_MARGIN(ctx, child, wdim);
+            lanes.align[n] = (lay_scalar)(((LAY_FLAGS(ctx, child) & LAY_ITEM_LAYOUT_MASK) >> dim) & LAY_HFILL);
+            ++n;
+            child = LAY_NEXT_SIBLING(ctx, child);
+        } while (n < LAY_SIMD_LANES && child != end_child);
+        // Unused lanes are calculated too, but their results are thrown away
+        for (int i = n; i < LAY_SIMD_LANES; ++i) {
+            lanes.pos[i] = 0;
+            lanes.size[i] = 0;
+            lanes.margin_start[i] = 0;
+            lanes.margin_end[i] = 0;
+            lanes.align[i] = 0;
+        }
+        lay_overlay_kernel_sse2(&lanes, offset, space, squeezed);
+        for (int i = 0; i < n; ++i) {
+            LAY_RECT(ctx, ids[i])[dim] = lanes.pos[i];
+            LAY_RECT(ctx, ids[i])[2 + dim] = lanes.size[i];
+        }
+    }
+}
+#endif // LAY_SIMD_SSE2
+
 static LAY_FORCE_INLINE
 void lay_arrange_overlay(lay_context *ctx, lay_id item, int dim)
 {
     const int wdim = dim + 2;
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    const lay_vec4 rect = ctx->rects[item];
+    const lay_vec4 rect = LAY_RECT(ctx, item);
     const lay_scalar offset = rect[dim];
     const lay_scalar space = rect[2 + dim];
-    
-    lay_id child = pitem->first_child;
+#ifdef LAY_SIMD_SSE2
+    (void)wdim;
+    lay_arrange_overlay_simd(
+        ctx, dim, LAY_FIRST_CHILD(ctx, item), LAY_INVALID_ID,
+        offset, space, false);
+#else
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
     while (child != LAY_INVALID_ID) {
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        const uint32_t b_flags = (pchild->flags & LAY_ITEM_LAYOUT_MASK) >> dim;
-        const lay_vec4 child_margins = pchild->margins;
-        lay_vec4 child_rect = ctx->rects[child];
+        const uint32_t b_flags = (LAY_FLAGS(ctx, child) & LAY_ITEM_LAYOUT_MASK) >> dim;
+        const lay_scalar margin_start = LAY_MARGIN(ctx, child, dim);
+        const lay_scalar margin_end = LAY_MARGIN(ctx, child, wdim);
+        lay_vec4 child_rect = LAY_RECT(ctx, child);
 
         switch (b_flags & LAY_HFILL) {
         case LAY_HCENTER:
-            child_rect[dim] += (space - child_rect[2 + dim]) / 2 - child_margins[wdim];
+            child_rect[dim] += (space - child_rect[2 + dim]) / 2 - margin_end;
             break;
         case LAY_RIGHT:
-            child_rect[dim] += space - child_rect[2 + dim] - child_margins[dim] - child_margins[wdim];
+            child_rect[dim] += space - child_rect[2 + dim] - margin_start - margin_end;
             break;
         case LAY_HFILL:
-            child_rect[2 + dim] = lay_scalar_max(0, space - child_rect[dim] - child_margins[wdim]);
+            child_rect[2 + dim] = lay_fill_size(space, child_rect[dim], margin_end);
             break;
         default:
             break;
         }
 
         child_rect[dim] += offset;
-        ctx->rects[child] = child_rect;
-        child = pchild->next_sibling;
+        LAY_RECT(ctx, child) = child_rect;
+        child = LAY_NEXT_SIBLING(ctx, child);
     }
+#endif
 }
 
 static LAY_FORCE_INLINE
@@ -1091,21 +2505,24 @@ void lay_arrange_overlay_squeezed_range(
         lay_scalar offset, lay_scalar space)
 {
     int wdim = dim + 2;
+#ifdef LAY_SIMD_SSE2
+    (void)wdim;
+    lay_arrange_overlay_simd(ctx, dim, start_item, end_item, offset, space, true);
+#else
     lay_id item = start_item;
     while (item != end_item) {
-        lay_item_t *pitem = lay_get_item(ctx, item);
-        const uint32_t b_flags = (pitem->flags & LAY_ITEM_LAYOUT_MASK) >> dim;
-        const lay_vec4 margins = pitem->margins;
-        lay_vec4 rect = ctx->rects[item];
-        lay_scalar min_size = lay_scalar_max(0, space - rect[dim] - margins[wdim]);
+        const uint32_t b_flags = (LAY_FLAGS(ctx, item) & LAY_ITEM_LAYOUT_MASK) >> dim;
+        const lay_scalar margin_end = LAY_MARGIN(ctx, item, wdim);
+        lay_vec4 rect = LAY_RECT(ctx, item);
+        lay_scalar min_size = lay_fill_size(space, rect[dim], margin_end);
         switch (b_flags & LAY_HFILL) {
             case LAY_HCENTER:
                 rect[2 + dim] = lay_scalar_min(rect[2 + dim], min_size);
-                rect[dim] += (space - rect[2 + dim]) / 2 - margins[wdim];
+                rect[dim] += (space - rect[2 + dim]) / 2 - margin_end;
                 break;
             case LAY_RIGHT:
                 rect[2 + dim] = lay_scalar_min(rect[2 + dim], min_size);
-                rect[dim] = space - rect[2 + dim] - margins[wdim];
+                rect[dim] = space - rect[2 + dim] - margin_end;
                 break;
             case LAY_HFILL:
                 rect[2 + dim] = min_size;
@@ -1115,9 +2532,10 @@ void lay_arrange_overlay_squeezed_range(
                 break;
         }
         rect[dim] += offset;
-        ctx->rects[item] = rect;
-        item = pitem->next_sibling;
+        LAY_RECT(ctx, item) = rect;
+        item = LAY_NEXT_SIBLING(ctx, item);
     }
+#endif
 }
 
 static LAY_FORCE_INLINE
@@ -1125,40 +2543,41 @@ lay_scalar lay_arrange_wrapped_overlay_squeezed(
         lay_context *ctx, lay_id item, int dim)
 {
     const int wdim = dim + 2;
-    lay_item_t *pitem = lay_get_item(ctx, item);
-    lay_scalar offset = ctx->rects[item][dim];
+    lay_scalar offset = LAY_RECT(ctx, item)[dim];
     lay_scalar need_size = 0;
-    lay_id child = pitem->first_child;
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
     lay_id start_child = child;
     while (child != LAY_INVALID_ID) {
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        if (pchild->flags & LAY_BREAK) {
+        if (LAY_FLAGS(ctx, child) & LAY_BREAK) {
             lay_arrange_overlay_squeezed_range(ctx, dim, start_child, child, offset, need_size);
             offset += need_size;
             start_child = child;
             need_size = 0;
         }
-        const lay_vec4 rect = ctx->rects[child];
-        lay_scalar child_size = rect[dim] + rect[2 + dim] + pchild->margins[wdim];
+        const lay_vec4 rect = LAY_RECT(ctx, child);
+        lay_scalar child_size = rect[dim] + rect[2 + dim] + LAY_MARGIN(ctx, child, wdim);
         need_size = lay_scalar_max(need_size, child_size);
-        child = pchild->next_sibling;
+        child = LAY_NEXT_SIBLING(ctx, child);
     }
     lay_arrange_overlay_squeezed_range(ctx, dim, start_child, LAY_INVALID_ID, offset, need_size);
     offset += need_size;
     return offset;
 }
 
-static void lay_arrange(lay_context *ctx, lay_id item, int dim)
+// Arranges the children of a single item, assuming the item's own rectangle has
+// already been arranged by its parent.
+static LAY_FORCE_INLINE
+void lay_arrange_item(lay_context *ctx, lay_id item, int dim)
 {
-    lay_item_t *pitem = lay_get_item(ctx, item);
+    LAY_STAT_ADD(ctx, arrange_items[dim], 1);
 
-    const uint32_t flags = pitem->flags;
+    const uint32_t flags = LAY_FLAGS(ctx, item);
     switch (flags & LAY_ITEM_BOX_MODEL_MASK) {
     case LAY_COLUMN | LAY_WRAP:
         if (dim != 0) {
             lay_arrange_stacked(ctx, item, 1, true);
             lay_scalar offset = lay_arrange_wrapped_overlay_squeezed(ctx, item, 0);
-            ctx->rects[item][2 + 0] = offset - ctx->rects[item][0];
+            LAY_RECT(ctx, item)[2 + 0] = offset - LAY_RECT(ctx, item)[0];
         }
         break;
     case LAY_ROW | LAY_WRAP:
@@ -1173,9 +2592,9 @@ static void lay_arrange(lay_context *ctx, lay_id item, int dim)
         if ((flags & 1) == (uint32_t)dim) {
             lay_arrange_stacked(ctx, item, dim, false);
         } else {
-            const lay_vec4 rect = ctx->rects[item];
+            const lay_vec4 rect = LAY_RECT(ctx, item);
             lay_arrange_overlay_squeezed_range(
-                ctx, dim, pitem->first_child, LAY_INVALID_ID,
+                ctx, dim, LAY_FIRST_CHILD(ctx, item), LAY_INVALID_ID,
                 rect[dim], rect[2 + dim]);
         }
         break;
@@ -1183,14 +2602,2094 @@ static void lay_arrange(lay_context *ctx, lay_id item, int dim)
         lay_arrange_overlay(ctx, item, dim);
         break;
     }
-    lay_id child = pitem->first_child;
+}
+
+// State for lay_set_track_changes(). previous holds the rects from the last
+// run, indexed by id, and damage is kept as (x0, y0, x1, y1) boxes.
+typedef struct lay_changes {
+    lay_vec4 *previous;
+    lay_id previous_capacity;
+    lay_id previous_count;
+    lay_id *ids;
+    lay_id count;
+    lay_id capacity;
+    float damage[LAY_DAMAGE_RECTS][4];
+    lay_id damage_count;
+} lay_changes;
+
+static void lay_add_damage(lay_changes *changes, lay_vec4 rect)
+{
+    if (rect[2] <= 0 || rect[3] <= 0)
+        return;
+    const float box[4] = {
+        (float)rect[0], (float)rect[1],
+        (float)rect[0] + (float)rect[2], (float)rect[1] + (float)rect[3]};
+    // Merge into the box that grows the least. If it doesn't touch any of them
+    // and there's still room, it gets a box of its own.
+    lay_id best = LAY_INVALID_ID;
+    float best_growth = 0;
+    bool touches = false;
+    for (lay_id i = 0; i < changes->damage_count; ++i) {
+        const float *d = changes->damage[i];
+        const float x0 = d[0] < box[0] ? d[0] : box[0];
+        const float y0 = d[1] < box[1] ? d[1] : box[1];
+        const float x1 = d[2] > box[2] ? d[2] : box[2];
+        const float y1 = d[3] > box[3] ? d[3] : box[3];
+        const float growth = (x1 - x0) * (y1 - y0) - (d[2] - d[0]) * (d[3] - d[1]);
+        if (best == LAY_INVALID_ID || growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+        if (box[0] <= d[2] && d[0] <= box[2] && box[1] <= d[3] && d[1] <= box[3])
+            touches = true;
+    }
+    if (best == LAY_INVALID_ID
+            || (!touches && changes->damage_count < LAY_DAMAGE_RECTS)) {
+        float *d = changes->damage[changes->damage_count++];
+        for (int k = 0; k < 4; ++k)
+            d[k] = box[k];
+        return;
+    }
+    float *d = changes->damage[best];
+    for (int k = 0; k < 2; ++k) {
+        if (box[k] < d[k]) d[k] = box[k];
+        if (box[2 + k] > d[2 + k]) d[2 + k] = box[2 + k];
+    }
+}
+
+static void lay_record_change(lay_context *ctx, lay_id item)
+{
+    lay_changes *changes = ctx->changes;
+    if (changes->count == changes->capacity) {
+        const lay_id capacity = changes->capacity ? changes->capacity * 2 : 64;
+        changes->ids = (lay_id*)lay_realloc(ctx, changes->ids,
+            changes->capacity * sizeof(lay_id), capacity * sizeof(lay_id));
+        changes->capacity = capacity;
+    }
+    changes->ids[changes->count++] = item;
+    const lay_vec4 rect = LAY_RECT(ctx, item);
+    if (item < changes->previous_count)
+        lay_add_damage(changes, changes->previous[item]);
+    lay_add_damage(changes, rect);
+    changes->previous[item] = rect;
+}
+
+static LAY_FORCE_INLINE bool lay_rect_unchanged(lay_context *ctx, lay_id item)
+{
+    const lay_changes *changes = ctx->changes;
+    if (item >= changes->previous_count)
+        return false;
+    const lay_vec4 rect = LAY_RECT(ctx, item);
+    const lay_vec4 old = changes->previous[item];
+    return old[0] == rect[0] && old[1] == rect[1]
+        && old[2] == rect[2] && old[3] == rect[3];
+}
+
+static LAY_FORCE_INLINE void lay_track_change(lay_context *ctx, lay_id item)
+{
+    if (!lay_rect_unchanged(ctx, item))
+        lay_record_change(ctx, item);
+}
+
+// A clean subtree that lay_run_dirty() skips in the last pass may still have
+// been moved horizontally in the first one. If its root is where it was, so is
+// everything in it.
+static void lay_track_clean_subtree(lay_context *ctx, lay_id root)
+{
+    if (lay_rect_unchanged(ctx, root))
+        return;
+    lay_id item = root;
+    do {
+        lay_track_change(ctx, item);
+        const lay_id child = LAY_FIRST_CHILD(ctx, item);
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+    } while (item != LAY_INVALID_ID);
+}
+
+// Returns false if there are items without a previous rect
+static bool lay_begin_changes(lay_context *ctx)
+{
+    lay_changes *changes = ctx->changes;
+    changes->count = 0;
+    changes->damage_count = 0;
+    if (changes->previous_capacity < ctx->capacity) {
+        changes->previous = (lay_vec4*)lay_realloc(ctx, changes->previous,
+            changes->previous_capacity * sizeof(lay_vec4), ctx->capacity * sizeof(lay_vec4));
+        changes->previous_capacity = ctx->capacity;
+    }
+    // Items that are gone since the last run leave damage where they were
+    for (lay_id i = ctx->count; i < changes->previous_count; ++i)
+        lay_add_damage(changes, changes->previous[i]);
+    if (changes->previous_count > ctx->count)
+        changes->previous_count = ctx->count;
+    // New items always count as changed in this run. Clear their slots in case
+    // the run doesn't reach them.
+    LAY_MEMSET(changes->previous + changes->previous_count, 0,
+        (ctx->count - changes->previous_count) * sizeof(lay_vec4));
+    return changes->previous_count == ctx->count;
+}
+
+static void lay_end_changes(lay_context *ctx)
+{
+    ctx->changes->previous_count = ctx->count;
+}
+
+static void lay_scan_changes(lay_context *ctx, lay_id item)
+{
+    if (ctx->changes == NULL)
+        return;
+    const lay_id root = item;
+    do {
+        lay_track_change(ctx, item);
+        const lay_id child = LAY_FIRST_CHILD(ctx, item);
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+    } while (item != LAY_INVALID_ID);
+    lay_end_changes(ctx);
+}
+
+// Wrapping columns place their children horizontally in the vertical pass
+static LAY_FORCE_INLINE bool lay_is_column_wrap(lay_context *ctx, lay_id item)
+{ return (LAY_FLAGS(ctx, item) & LAY_ITEM_BOX_MODEL_MASK) == (LAY_COLUMN | LAY_WRAP); }
+
+// lay_run_dirty() can arrange a wrapping column in the vertical pass when its
+// children were skipped by the horizontal one, so they still have the positions
+// and widths from the previous run. This puts back what the horizontal pass
+// leaves them with: the start margin and the calculated width.
+static void lay_restore_wrapped_children(lay_context *ctx, lay_id item)
+{
+    lay_id child = LAY_FIRST_CHILD(ctx, item);
+    while (child != LAY_INVALID_ID) {
+        lay_vec4 *rect = &LAY_RECT(ctx, child);
+        (*rect)[0] = LAY_MARGIN(ctx, child, 0);
+        (*rect)[2] = ctx->cache[child][0];
+        child = LAY_NEXT_SIBLING(ctx, child);
+    }
+}
+
+// With track, each item is compared with its previous rect once it has been
+// arranged. That's only done in the last pass, when the rect is final. dirty is
+// set when it's called from lay_run_dirty().
+static LAY_FORCE_INLINE
+void lay_arrange_impl(lay_context *ctx, lay_id item, int dim, bool track, bool dirty)
+{
+    const lay_id root = item;
+    do {
+        if (dirty && dim == 1 && lay_is_column_wrap(ctx, item))
+            lay_restore_wrapped_children(ctx, item);
+        lay_arrange_item(ctx, item, dim);
+        if (track)
+            lay_track_change(ctx, item);
+        const lay_id child = LAY_FIRST_CHILD(ctx, item);
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+    } while (item != LAY_INVALID_ID);
+}
+
+// A wrapping column in another one is moved horizontally in the vertical pass,
+// which the comparison of the vertical position and size doesn't see, and it
+// places its own children from there.
+static LAY_FORCE_INLINE bool lay_is_moved_column_wrap(lay_context *ctx, lay_id item, int dim)
+{ return dim == 1 && lay_is_column_wrap(ctx, item) && lay_is_column_wrap(ctx, LAY_PARENT(ctx, item)); }
+
+// Puts the calculated sizes from the cache back into the rects of all of the
+// items below a clean item, so that it can be arranged again. If the item is
+// being resized horizontally, the wrapping of its descendants may change, so
+// they're also marked dirty to have their vertical sizes recalculated.
+// Otherwise, only the wrapping columns in it (and the items above them) are
+// marked in the horizontal pass, since the horizontal positions of their
+// children are reset here and only put back by the vertical pass.
+static void lay_restore_calc_size(lay_context *ctx, lay_id root, int dim, bool mark)
+{
+    lay_id item = LAY_FIRST_CHILD(ctx, root);
+    while (item != LAY_INVALID_ID) {
+        lay_vec4 *rect = &LAY_RECT(ctx, item);
+        (*rect)[dim] = LAY_MARGIN(ctx, item, dim);
+        (*rect)[2 + dim] = ctx->cache[item][dim];
+        if (mark)
+            LAY_FLAGS(ctx, item) |= LAY_ITEM_DIRTY;
+        else if (dim == 0 && lay_is_column_wrap(ctx, item))
+            lay_mark_dirty(ctx, item);
+        const lay_id child = LAY_FIRST_CHILD(ctx, item);
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+    }
+}
+
+// Goes through the siblings starting at child, which have just been arranged by
+// their parent, and returns the first one that is dirty. A clean one that ends
+// up with the same rect as last time will also have the same results for all of
+// its descendants, so it can be skipped. Otherwise, its whole subtree is
+// arranged again.
+static LAY_FORCE_INLINE
+lay_id lay_arrange_clean_siblings(lay_context *ctx, lay_id child, int dim, bool track)
+{
     while (child != LAY_INVALID_ID) {
-        // NOTE: this is recursive and will run out of stack space if items are
-        // nested too deeply.
-        lay_arrange(ctx, child, dim);
-        lay_item_t *pchild = lay_get_item(ctx, child);
-        child = pchild->next_sibling;
+        if (LAY_FLAGS(ctx, child) & LAY_ITEM_DIRTY)
+            break;
+        const lay_vec4 rect = LAY_RECT(ctx, child);
+        const lay_vec4 cached = ctx->cache[child];
+        const bool resized = rect[2 + dim] != cached[3];
+        if (resized || rect[dim] != cached[2] || lay_is_moved_column_wrap(ctx, child, dim)) {
+            const bool mark = resized && dim == 0;
+            lay_restore_calc_size(ctx, child, dim, mark);
+            lay_arrange_impl(ctx, child, dim, track, true);
+            // Marked after we're done with it, so that it will only be visited
+            // again in the next pass.
+            if (mark || (dim == 0 && lay_is_column_wrap(ctx, child)))
+                LAY_FLAGS(ctx, child) |= LAY_ITEM_DIRTY;
+        } else if (track) {
+            lay_track_clean_subtree(ctx, child);
+        }
+        child = LAY_NEXT_SIBLING(ctx, child);
+    }
+    return child;
+}
+
+// Like lay_arrange, but only descends into dirty items.
+static LAY_FORCE_INLINE
+void lay_arrange_dirty_impl(lay_context *ctx, lay_id item, int dim, bool track)
+{
+    const lay_id root = item;
+    for (;;) {
+        if (dim == 1 && lay_is_column_wrap(ctx, item))
+            lay_restore_wrapped_children(ctx, item);
+        lay_arrange_item(ctx, item, dim);
+        // This is the last pass, so the item is done after this.
+        if (dim == 1)
+            LAY_FLAGS(ctx, item) &= ~(uint32_t)LAY_ITEM_DIRTY;
+        if (track)
+            lay_track_change(ctx, item);
+        lay_id child = lay_arrange_clean_siblings(ctx, LAY_FIRST_CHILD(ctx, item), dim, track);
+        while (child == LAY_INVALID_ID && item != root) {
+            child = lay_arrange_clean_siblings(ctx, LAY_NEXT_SIBLING(ctx, item), dim, track);
+            item = LAY_PARENT(ctx, item);
+        }
+        if (child == LAY_INVALID_ID)
+            return;
+        item = child;
+    }
+}
+
+// The passes are compiled once for each instruction set level, and called
+// through this table by lay_calc_size() etc.
+typedef struct lay_pass_procs {
+    void (*calc_size)(lay_context *ctx, lay_id item, int dim);
+    void (*arrange)(lay_context *ctx, lay_id item, int dim);
+    void (*calc_size_dirty)(lay_context *ctx, lay_id item, int dim);
+    void (*arrange_dirty)(lay_context *ctx, lay_id item, int dim);
+    void (*arrange_tracked)(lay_context *ctx, lay_id item, int dim);
+    void (*arrange_dirty_tracked)(lay_context *ctx, lay_id item, int dim);
+} lay_pass_procs;
+
+#define LAY_DEFINE_PASS_PROCS(suffix, target) \
+    static target void lay_calc_size_##suffix(lay_context *ctx, lay_id item, int dim) \
+    { lay_calc_size_impl(ctx, item, dim); } \
+    static target void lay_arrange_##suffix(lay_context *ctx, lay_id item, int dim) \
+    { lay_arrange_impl(ctx, item, dim, false, false); } \
+    static target void lay_calc_size_dirty_##suffix(lay_context *ctx, lay_id item, int dim) \
+    { lay_calc_size_dirty_impl(ctx, item, dim); } \
+    static target void lay_arrange_dirty_##suffix(lay_context *ctx, lay_id item, int dim) \
+    { lay_arrange_dirty_impl(ctx, item, dim, false); } \
+    static target void lay_arrange_tracked_##suffix(lay_context *ctx, lay_id item, int dim) \
+    { lay_arrange_impl(ctx, item, dim, true, false); } \
+    static target void lay_arrange_dirty_tracked_##suffix(lay_context *ctx, lay_id item, int dim) \
+    { lay_arrange_dirty_impl(ctx, item, dim, true); }
+
+#define LAY_PASS_PROCS(suffix) { \
+    lay_calc_size_##suffix, lay_arrange_##suffix, \
+    lay_calc_size_dirty_##suffix, lay_arrange_dirty_##suffix, \
+    lay_arrange_tracked_##suffix, lay_arrange_dirty_tracked_##suffix }
+
+LAY_DEFINE_PASS_PROCS(generic, )
+#ifdef LAY_DISPATCH_X86
+LAY_DEFINE_PASS_PROCS(avx2, LAY_TARGET_AVX2)
+LAY_DEFINE_PASS_PROCS(avx512, LAY_TARGET_AVX512)
+#endif
+
+static const lay_pass_procs lay_pass_procs_table[LAY_ISA_COUNT] = {
+    LAY_PASS_PROCS(generic),
+#ifdef LAY_DISPATCH_X86
+    LAY_PASS_PROCS(avx2),
+    LAY_PASS_PROCS(avx512)
+#else
+    LAY_PASS_PROCS(generic),
+    LAY_PASS_PROCS(generic)
+#endif
+};
+
+#undef LAY_DEFINE_PASS_PROCS
+#undef LAY_PASS_PROCS
+
+static void lay_calc_size(lay_context *ctx, lay_id item, int dim)
+{ lay_pass_procs_table[ctx->isa].calc_size(ctx, item, dim); }
+static void lay_arrange(lay_context *ctx, lay_id item, int dim)
+{ lay_pass_procs_table[ctx->isa].arrange(ctx, item, dim); }
+static void lay_calc_size_dirty(lay_context *ctx, lay_id item, int dim)
+{ lay_pass_procs_table[ctx->isa].calc_size_dirty(ctx, item, dim); }
+static void lay_arrange_dirty(lay_context *ctx, lay_id item, int dim)
+{ lay_pass_procs_table[ctx->isa].arrange_dirty(ctx, item, dim); }
+static void lay_arrange_tracked(lay_context *ctx, lay_id item, int dim)
+{ lay_pass_procs_table[ctx->isa].arrange_tracked(ctx, item, dim); }
+static void lay_arrange_dirty_tracked(lay_context *ctx, lay_id item, int dim)
+{ lay_pass_procs_table[ctx->isa].arrange_dirty_tracked(ctx, item, dim); }
+
+static const char *const lay_isa_names[LAY_ISA_COUNT] = {
+    "generic", "avx2", "avx512"
+};
+
+// The highest level supported by both this build and the CPU
+static lay_isa lay_detect_isa(void)
+{
+#ifdef LAY_DISPATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+        return LAY_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")
+        && __builtin_cpu_supports("bmi2"))
+        return LAY_ISA_AVX2;
+#endif
+    return LAY_ISA_GENERIC;
+}
+
+// Sequentially consistent, because lay_acquire_frame() and lay_begin_frame()
+// each write one variable and then read the one the other writes.
+#if defined(__GNUC__) || defined(__clang__)
+#define LAY_ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define LAY_ATOMIC_STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+#define LAY_ATOMIC_ADD(ptr, value) ((void)__atomic_add_fetch(ptr, value, __ATOMIC_SEQ_CST))
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define LAY_ATOMIC_LOAD(ptr) ((uint32_t)_InterlockedOr((volatile long*)(ptr), 0))
+#define LAY_ATOMIC_STORE(ptr, value) ((void)_InterlockedExchange((volatile long*)(ptr), (long)(value)))
+#define LAY_ATOMIC_ADD(ptr, value) ((void)_InterlockedExchangeAdd((volatile long*)(ptr), (long)(value)))
+#endif
+
+// These hold the lay_isa + 1, or 0 until they've been worked out. Contexts can
+// be created on several threads at once, so they're read and written
+// atomically. Threads that get there at the same time all work out the same
+// value, so it doesn't matter which of them stores it.
+static uint32_t lay_detected_isa = 0;
+static uint32_t lay_initial_isa = 0;
+
+static lay_isa lay_clamp_isa(lay_isa isa)
+{
+    uint32_t detected = LAY_ATOMIC_LOAD(&lay_detected_isa);
+    if (detected == 0) {
+        detected = (uint32_t)lay_detect_isa() + 1;
+        LAY_ATOMIC_STORE(&lay_detected_isa, detected);
+    }
+    return (uint32_t)isa < detected - 1 ? isa : (lay_isa)(detected - 1);
+}
+
+static lay_isa lay_default_isa(void)
+{
+    uint32_t initial = LAY_ATOMIC_LOAD(&lay_initial_isa);
+    if (initial == 0) {
+        lay_isa isa = LAY_ISA_AVX512;
+        const char *env = LAY_GETENV("LAY_ISA");
+        if (env != NULL) {
+            for (int i = 0; i < LAY_ISA_COUNT; ++i) {
+                const char *a = env;
+                const char *b = lay_isa_names[i];
+                while (*a != '\0' && *a == *b) {
+                    ++a;
+                    ++b;
+                }
+                if (*a == *b)
+                    isa = (lay_isa)i;
+            }
+        }
+        initial = (uint32_t)lay_clamp_isa(isa) + 1;
+        LAY_ATOMIC_STORE(&lay_initial_isa, initial);
+    }
+    return (lay_isa)(initial - 1);
+}
+
+lay_isa lay_set_isa(lay_context *ctx, lay_isa isa)
+{
+    LAY_ASSERT(ctx != NULL);
+    LAY_ASSERT(isa < LAY_ISA_COUNT);
+    ctx->isa = lay_clamp_isa(isa);
+    return (lay_isa)ctx->isa;
+}
+
+lay_isa lay_get_isa(const lay_context *ctx)
+{
+    LAY_ASSERT(ctx != NULL);
+    return (lay_isa)ctx->isa;
+}
+
+const char *lay_isa_name(lay_isa isa)
+{
+    LAY_ASSERT(isa < LAY_ISA_COUNT);
+    return lay_isa_names[isa];
+}
+
+// Moves each element i of an array to index remap[i], using scratch as
+// temporary storage.
+static void lay_permute(
+        void *data, void *scratch, size_t size,
+        const lay_id *remap, lay_id count)
+{
+    unsigned char *dst = (unsigned char*)data;
+    const unsigned char *src = (const unsigned char*)scratch;
+    LAY_MEMCPY(scratch, data, count * size);
+    for (lay_id i = 0; i < count; ++i)
+        LAY_MEMCPY(dst + remap[i] * size, src + i * size, size);
+}
+
+static LAY_FORCE_INLINE
+lay_id lay_remap_id(const lay_id *remap, lay_id id)
+{ return id != LAY_INVALID_ID ? remap[id] : LAY_INVALID_ID; }
+
+void lay_compact_context(lay_context *ctx, lay_compact_order order, lay_id *remap)
+{
+    LAY_ASSERT(ctx != NULL);
+    const lay_id count = ctx->count;
+    if (count == 0)
+        return;
+    lay_prepare_rects(ctx);
+
+    // The scratch buffer holds the new order (new id -> old id), followed by
+    // space for the copy of the largest of the arrays being permuted, and the
+    // remap table if the caller didn't give us one.
+#ifdef LAY_SOA
+    const size_t elem_size = sizeof(lay_vec4);
+#else
+    const size_t elem_size = sizeof(lay_item_t) > sizeof(lay_vec4)
+        ? sizeof(lay_item_t) : sizeof(lay_vec4);
+#endif
+    const size_t order_size = count * sizeof(lay_id);
+    const size_t copy_size = count * elem_size;
+    const size_t scratch_size = order_size + copy_size + (remap ? 0 : order_size);
+    unsigned char *scratch = (unsigned char*)lay_realloc(ctx, NULL, 0, scratch_size);
+    lay_id *new_order = (lay_id*)scratch;
+    void *copy = scratch + order_size;
+    if (remap == NULL)
+        remap = (lay_id*)(scratch + order_size + copy_size);
+
+    lay_id n = 0;
+    for (lay_id root = 0; root < count; ++root) {
+        if (LAY_FLAGS(ctx, root) & LAY_ITEM_INSERTED)
+            continue;
+        if (order == LAY_COMPACT_BREADTH_FIRST) {
+            // new_order doubles as the queue of items whose children haven't
+            // been added yet.
+            lay_id head = n;
+            new_order[n++] = root;
+            while (head < n) {
+                lay_id child = LAY_FIRST_CHILD(ctx, new_order[head++]);
+                while (child != LAY_INVALID_ID) {
+                    new_order[n++] = child;
+                    child = LAY_NEXT_SIBLING(ctx, child);
+                }
+            }
+        } else {
+            lay_id item = root;
+            while (item != LAY_INVALID_ID) {
+                new_order[n++] = item;
+                const lay_id child = LAY_FIRST_CHILD(ctx, item);
+                item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+            }
+        }
+    }
+    LAY_ASSERT(n == count);
+    for (lay_id i = 0; i < count; ++i)
+        remap[new_order[i]] = i;
+
+#ifdef LAY_SOA
+    lay_permute(ctx->flags, copy, sizeof(uint32_t), remap, count);
+    lay_permute(ctx->first_child, copy, sizeof(lay_id), remap, count);
+    lay_permute(ctx->last_child, copy, sizeof(lay_id), remap, count);
+    lay_permute(ctx->next_sibling, copy, sizeof(lay_id), remap, count);
+    lay_permute(ctx->parent, copy, sizeof(lay_id), remap, count);
+    lay_permute(ctx->margins[0], copy, sizeof(lay_vec2), remap, count);
+    lay_permute(ctx->margins[1], copy, sizeof(lay_vec2), remap, count);
+    lay_permute(ctx->sizes[0], copy, sizeof(lay_scalar), remap, count);
+    lay_permute(ctx->sizes[1], copy, sizeof(lay_scalar), remap, count);
+#elif defined(LAY_PAGED)
+    // The items and rects don't have a single array to permute, so they're
+    // copied out and back through the page table.
+    lay_item_t *items_copy = (lay_item_t*)copy;
+    for (lay_id i = 0; i < count; ++i)
+        items_copy[i] = *lay_get_item(ctx, i);
+    for (lay_id i = 0; i < count; ++i)
+        *lay_get_item(ctx, remap[i]) = items_copy[i];
+#else
+    lay_permute(ctx->items, copy, sizeof(lay_item_t), remap, count);
+#endif
+    for (lay_id i = 0; i < count; ++i) {
+        LAY_FIRST_CHILD(ctx, i) = lay_remap_id(remap, LAY_FIRST_CHILD(ctx, i));
+        LAY_LAST_CHILD(ctx, i) = lay_remap_id(remap, LAY_LAST_CHILD(ctx, i));
+        LAY_NEXT_SIBLING(ctx, i) = lay_remap_id(remap, LAY_NEXT_SIBLING(ctx, i));
+        LAY_PARENT(ctx, i) = lay_remap_id(remap, LAY_PARENT(ctx, i));
+    }
+#ifdef LAY_PAGED
+    lay_vec4 *rects_copy = (lay_vec4*)copy;
+    for (lay_id i = 0; i < count; ++i)
+        rects_copy[i] = LAY_RECT(ctx, i);
+    for (lay_id i = 0; i < count; ++i)
+        LAY_RECT(ctx, remap[i]) = rects_copy[i];
+#else
+    lay_permute(ctx->rects, copy, sizeof(lay_vec4), remap, count);
+#endif
+    // Items created since the last lay_run_dirty() may not have cache entries
+    // yet, but the clean items can be moved to their ids.
+    if (ctx->cache != NULL) {
+        lay_reserve_cache(ctx);
+        lay_permute(ctx->cache, copy, sizeof(lay_vec4), remap, count);
+    }
+    // If items were created since the last run, the ids with a previous rect
+    // are no longer contiguous, so they all count as changed in the next one.
+    if (ctx->changes != NULL) {
+        if (ctx->changes->previous_count == count)
+            lay_permute(ctx->changes->previous, copy, sizeof(lay_vec4), remap, count);
+        else
+            ctx->changes->previous_count = 0;
+    }
+
+    lay_free(ctx, scratch, scratch_size);
+}
+
+// A snapshot starts with this header. The item arrays follow it, and then the
+// rects if there are any, each starting at a multiple of LAY_SNAPSHOT_ALIGN
+// bytes from the start of the snapshot.
+#define LAY_SNAPSHOT_VERSION 1
+#define LAY_SNAPSHOT_ALIGN 16
+// Written in the byte order of the machine that saved the snapshot
+#define LAY_SNAPSHOT_BYTE_ORDER 0x01020304u
+// lay_snapshot_header::format
+#define LAY_SNAPSHOT_SOA 0x1u
+#define LAY_SNAPSHOT_FLOAT 0x2u
+#define LAY_SNAPSHOT_RECTS 0x4u
+
+typedef struct lay_snapshot_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t format;
+    // The bytes per item in the item arrays, and per rect
+    uint32_t item_size;
+    uint32_t rect_size;
+    lay_id count;
+    uint32_t reserved;
+} lay_snapshot_header;
+
+// The item arrays in a snapshot, in order. LAY_PAGED uses the same single array
+// of lay_item_t as the default storage, but copies the items through the pages.
+#ifdef LAY_SOA
+#define LAY_SNAPSHOT_ARRAYS(X) \
+    X(flags, uint32_t) X(first_child, lay_id) X(last_child, lay_id) \
+    X(next_sibling, lay_id) X(parent, lay_id) \
+    X(margins[0], lay_vec2) X(margins[1], lay_vec2) \
+    X(sizes[0], lay_scalar) X(sizes[1], lay_scalar)
+#else
+#define LAY_SNAPSHOT_ARRAYS(X) X(items, lay_item_t)
+#endif
+
+static LAY_FORCE_INLINE size_t lay_snapshot_align(size_t offset)
+{ return (offset + LAY_SNAPSHOT_ALIGN - 1) & ~(size_t)(LAY_SNAPSHOT_ALIGN - 1); }
+
+static uint32_t lay_snapshot_format(void)
+{
+    uint32_t format = 0;
+#ifdef LAY_SOA
+    format |= LAY_SNAPSHOT_SOA;
+#endif
+#if LAY_FLOAT == 1
+    format |= LAY_SNAPSHOT_FLOAT;
+#endif
+    return format;
+}
+
+static size_t lay_snapshot_size(lay_id count, bool with_rects)
+{
+    size_t offset = sizeof(lay_snapshot_header);
+#define LAY_SNAPSHOT_ARRAY_SIZE(_field, _type) \
+    offset = lay_snapshot_align(offset) + count * sizeof(_type);
+    LAY_SNAPSHOT_ARRAYS(LAY_SNAPSHOT_ARRAY_SIZE)
+#undef LAY_SNAPSHOT_ARRAY_SIZE
+    if (with_rects)
+        offset = lay_snapshot_align(offset) + count * sizeof(lay_vec4);
+    return offset;
+}
+
+// Returns the header if data holds a whole snapshot in the format of this
+// build, or NULL
+static const lay_snapshot_header *lay_check_snapshot(const void *data, size_t size)
+{
+    if (data == NULL || size < sizeof(lay_snapshot_header))
+        return NULL;
+    const lay_snapshot_header *header = (const lay_snapshot_header*)data;
+    uint32_t item_size = 0;
+#define LAY_SNAPSHOT_ITEM_SIZE(_field, _type) item_size += (uint32_t)sizeof(_type);
+    LAY_SNAPSHOT_ARRAYS(LAY_SNAPSHOT_ITEM_SIZE)
+#undef LAY_SNAPSHOT_ITEM_SIZE
+    if (header->magic[0] != 'L' || header->magic[1] != 'A'
+            || header->magic[2] != 'Y' || header->magic[3] != 'S'
+            || header->version != LAY_SNAPSHOT_VERSION
+            || header->byte_order != LAY_SNAPSHOT_BYTE_ORDER
+            || (header->format & ~LAY_SNAPSHOT_RECTS) != lay_snapshot_format()
+            || header->item_size != item_size
+            || header->rect_size != sizeof(lay_vec4))
+        return NULL;
+    if (size < lay_snapshot_size(header->count, (header->format & LAY_SNAPSHOT_RECTS) != 0))
+        return NULL;
+    return header;
+}
+
+size_t lay_save_context(const lay_context *ctx, int with_rects, void *data, size_t size)
+{
+    LAY_ASSERT(ctx != NULL);
+    const lay_id count = ctx->count;
+    const size_t snapshot_size = lay_snapshot_size(count, with_rects != 0);
+    if (data == NULL || size < snapshot_size)
+        return snapshot_size;
+#ifndef LAY_PAGED
+    // There have to be rects for all of the items
+    LAY_ASSERT(!with_rects || ctx->rects_count >= count);
+#endif
+
+    LAY_ASSERT(((uintptr_t)data & (LAY_SNAPSHOT_ALIGN - 1)) == 0);
+    unsigned char *out = (unsigned char*)data;
+    lay_snapshot_header header;
+    LAY_MEMSET(&header, 0, sizeof(header));
+    header.magic[0] = 'L';
+    header.magic[1] = 'A';
+    header.magic[2] = 'Y';
+    header.magic[3] = 'S';
+    header.version = LAY_SNAPSHOT_VERSION;
+    header.byte_order = LAY_SNAPSHOT_BYTE_ORDER;
+    header.format = lay_snapshot_format() | (with_rects ? LAY_SNAPSHOT_RECTS : 0);
+    header.rect_size = sizeof(lay_vec4);
+    header.count = count;
+    size_t offset = sizeof(lay_snapshot_header);
+#ifdef LAY_PAGED
+    offset = lay_snapshot_align(offset);
+    lay_item_t *items = (lay_item_t*)(out + offset);
+    for (lay_id i = 0; i < count; ++i) {
+        LAY_MEMCPY(&items[i], lay_get_item(ctx, i), sizeof(lay_item_t));
+        items[i].flags |= LAY_ITEM_DIRTY;
+    }
+    offset += count * sizeof(lay_item_t);
+    header.item_size = sizeof(lay_item_t);
+#else
+#define LAY_SNAPSHOT_SAVE_ARRAY(_field, _type) \
+    offset = lay_snapshot_align(offset); \
+    if (count > 0) \
+        LAY_MEMCPY(out + offset, ctx->_field, count * sizeof(_type)); \
+    offset += count * sizeof(_type); \
+    header.item_size += (uint32_t)sizeof(_type);
+    LAY_SNAPSHOT_ARRAYS(LAY_SNAPSHOT_SAVE_ARRAY)
+#undef LAY_SNAPSHOT_SAVE_ARRAY
+    // The first array is either the flags or the items
+#ifdef LAY_SOA
+    uint32_t *flags = (uint32_t*)(out + lay_snapshot_align(sizeof(lay_snapshot_header)));
+    for (lay_id i = 0; i < count; ++i)
+        flags[i] |= LAY_ITEM_DIRTY;
+#else
+    lay_item_t *items = (lay_item_t*)(out + lay_snapshot_align(sizeof(lay_snapshot_header)));
+    for (lay_id i = 0; i < count; ++i)
+        items[i].flags |= LAY_ITEM_DIRTY;
+#endif
+#endif
+    if (with_rects) {
+        offset = lay_snapshot_align(offset);
+#ifdef LAY_PAGED
+        lay_vec4 *rects = (lay_vec4*)(out + offset);
+        for (lay_id i = 0; i < count; ++i)
+            rects[i] = LAY_RECT(ctx, i);
+#else
+        if (count > 0)
+            LAY_MEMCPY(out + offset, ctx->rects, count * sizeof(lay_vec4));
+#endif
+    }
+    LAY_MEMCPY(out, &header, sizeof(header));
+    return snapshot_size;
+}
+
+#ifndef LAY_PAGED
+// Forgets the items and rects of a context from lay_map_context() without
+// writing to them, so that the context allocates its own the next time it
+// needs some.
+static void lay_unmap_context(lay_context *ctx)
+{
+#define LAY_UNMAP_ARRAY(_field, _type) ctx->_field = NULL;
+    LAY_SNAPSHOT_ARRAYS(LAY_UNMAP_ARRAY)
+#undef LAY_UNMAP_ARRAY
+    ctx->capacity = 0;
+    ctx->items_external = 0;
+    lay_free_rects(ctx);
+}
+#endif
+
+int lay_load_context(lay_context *ctx, const void *data, size_t size)
+{
+    LAY_ASSERT(ctx != NULL);
+    const lay_snapshot_header *header = lay_check_snapshot(data, size);
+    if (header == NULL)
+        return 0;
+    const lay_id count = header->count;
+    const unsigned char *in = (const unsigned char*)data;
+#ifndef LAY_PAGED
+    if (ctx->items_external)
+        lay_unmap_context(ctx);
+#endif
+    lay_reset_context(ctx);
+    lay_reserve_items_capacity(ctx, count);
+    ctx->count = count;
+    size_t offset = sizeof(lay_snapshot_header);
+#ifdef LAY_PAGED
+    offset = lay_snapshot_align(offset);
+    for (lay_id i = 0; i < count; ++i)
+        LAY_MEMCPY(lay_get_item(ctx, i), in + offset + i * sizeof(lay_item_t), sizeof(lay_item_t));
+    offset += count * sizeof(lay_item_t);
+    if (header->format & LAY_SNAPSHOT_RECTS) {
+        offset = lay_snapshot_align(offset);
+        for (lay_id i = 0; i < count; ++i)
+            LAY_MEMCPY(&LAY_RECT(ctx, i), in + offset + i * sizeof(lay_vec4), sizeof(lay_vec4));
+    } else {
+        for (lay_id i = 0; i < count; ++i)
+            LAY_MEMSET(&LAY_RECT(ctx, i), 0, sizeof(lay_vec4));
+    }
+#else
+#define LAY_SNAPSHOT_LOAD_ARRAY(_field, _type) \
+    offset = lay_snapshot_align(offset); \
+    if (count > 0) \
+        LAY_MEMCPY(ctx->_field, in + offset, count * sizeof(_type)); \
+    offset += count * sizeof(_type);
+    LAY_SNAPSHOT_ARRAYS(LAY_SNAPSHOT_LOAD_ARRAY)
+#undef LAY_SNAPSHOT_LOAD_ARRAY
+    if ((header->format & LAY_SNAPSHOT_RECTS) && count > 0) {
+        lay_prepare_rects(ctx);
+        LAY_MEMCPY(ctx->rects, in + lay_snapshot_align(offset), count * sizeof(lay_vec4));
+    }
+#endif
+    return 1;
+}
+
+#ifndef LAY_PAGED
+int lay_map_context(lay_context *ctx, const void *data, size_t size)
+{
+    LAY_ASSERT(ctx != NULL);
+    if (((uintptr_t)data & (LAY_SNAPSHOT_ALIGN - 1)) != 0)
+        return 0;
+    const lay_snapshot_header *header = lay_check_snapshot(data, size);
+    if (header == NULL)
+        return 0;
+    const lay_id count = header->count;
+    // Only written to if the layout is run, as described at lay_map_context()
+    unsigned char *in = (unsigned char*)data;
+    lay_free_storage(ctx);
+    ctx->capacity = count;
+    ctx->count = count;
+    ctx->items_external = 1;
+    size_t offset = sizeof(lay_snapshot_header);
+#define LAY_SNAPSHOT_MAP_ARRAY(_field, _type) \
+    offset = lay_snapshot_align(offset); \
+    ctx->_field = (_type*)(in + offset); \
+    offset += count * sizeof(_type);
+    LAY_SNAPSHOT_ARRAYS(LAY_SNAPSHOT_MAP_ARRAY)
+#undef LAY_SNAPSHOT_MAP_ARRAY
+    if (header->format & LAY_SNAPSHOT_RECTS) {
+        ctx->rects = (lay_vec4*)(in + lay_snapshot_align(offset));
+        ctx->rects_capacity = count;
+        ctx->rects_count = count;
+        ctx->rects_external = 1;
+    }
+    return 1;
+}
+#endif
+
+#ifdef LAY_SOA
+static void lay_copy_items(
+        lay_context *ctx, lay_id first, const lay_context *src, lay_id src_first, lay_id n)
+{
+#define LAY_COPY_ARRAY(_array, _type) \
+    LAY_MEMCPY(ctx->_array + first, src->_array + src_first, n * sizeof(_type))
+    LAY_COPY_ARRAY(flags, uint32_t);
+    LAY_COPY_ARRAY(first_child, lay_id);
+    LAY_COPY_ARRAY(last_child, lay_id);
+    LAY_COPY_ARRAY(next_sibling, lay_id);
+    LAY_COPY_ARRAY(parent, lay_id);
+    LAY_COPY_ARRAY(margins[0], lay_vec2);
+    LAY_COPY_ARRAY(margins[1], lay_vec2);
+    LAY_COPY_ARRAY(sizes[0], lay_scalar);
+    LAY_COPY_ARRAY(sizes[1], lay_scalar);
+#undef LAY_COPY_ARRAY
+}
+#elif defined(LAY_PAGED)
+// Copies the longest runs that don't cross a page boundary on either side, and
+// zeroes the rects, like lay_item() does.
+static void lay_copy_items(
+        lay_context *ctx, lay_id first, const lay_context *src, lay_id src_first, lay_id n)
+{
+    while (n > 0) {
+        lay_id run = LAY_PAGE_SIZE - first % LAY_PAGE_SIZE;
+        const lay_id src_run = LAY_PAGE_SIZE - src_first % LAY_PAGE_SIZE;
+        if (run > src_run) run = src_run;
+        if (run > n) run = n;
+        LAY_MEMCPY(lay_get_item(ctx, first), lay_get_item(src, src_first), run * sizeof(lay_item_t));
+        LAY_MEMSET(&LAY_RECT(ctx, first), 0, run * sizeof(lay_vec4));
+        first += run;
+        src_first += run;
+        n -= run;
+    }
+}
+#else
+static void lay_copy_items(
+        lay_context *ctx, lay_id first, const lay_context *src, lay_id src_first, lay_id n)
+{
+    LAY_MEMCPY(ctx->items + first, src->items + src_first, n * sizeof(lay_item_t));
+}
+#endif
+
+static LAY_FORCE_INLINE
+lay_id lay_offset_id(lay_id id, lay_id offset)
+{ return id != LAY_INVALID_ID ? (lay_id)(id + offset) : LAY_INVALID_ID; }
+
+lay_id lay_instantiate(
+        lay_context *ctx, const lay_context *template_ctx, lay_id template_root,
+        lay_id parent, lay_id count)
+{
+    LAY_ASSERT(ctx != NULL && template_ctx != NULL);
+    if (count == 0)
+        return LAY_INVALID_ID;
+
+    // Count the template's items, and check that they are one block
+    lay_id n = 0;
+    lay_id last = template_root;
+    lay_id item = template_root;
+    while (item != LAY_INVALID_ID) {
+        LAY_ASSERT(item >= template_root);
+        if (item > last) last = item;
+        ++n;
+        const lay_id child = LAY_FIRST_CHILD(template_ctx, item);
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(template_ctx, template_root, item);
+    }
+    LAY_ASSERT(last - template_root + 1 == n);
+    (void)last;
+
+    const lay_id first = ctx->count;
+    LAY_ASSERT(count <= (LAY_INVALID_ID - first) / n);
+    const lay_id end = first + n * count;
+    if (end > ctx->capacity)
+        lay_grow_items_for(ctx, end);
+    ctx->count = end;
+    // When the template is in ctx, it's below first, so growing ctx and copying
+    // into it doesn't disturb it.
+    for (lay_id k = 0; k < count; ++k) {
+        const lay_id root = first + k * n;
+        const lay_id offset = (lay_id)(root - template_root);
+        lay_copy_items(ctx, root, template_ctx, template_root, n);
+        for (lay_id i = root; i < root + n; ++i) {
+            LAY_FLAGS(ctx, i) |= LAY_ITEM_DIRTY;
+            LAY_FIRST_CHILD(ctx, i) = lay_offset_id(LAY_FIRST_CHILD(ctx, i), offset);
+            LAY_LAST_CHILD(ctx, i) = lay_offset_id(LAY_LAST_CHILD(ctx, i), offset);
+            LAY_NEXT_SIBLING(ctx, i) = lay_offset_id(LAY_NEXT_SIBLING(ctx, i), offset);
+            LAY_PARENT(ctx, i) = lay_offset_id(LAY_PARENT(ctx, i), offset);
+        }
+        // The copies' roots are chained as siblings of each other
+        LAY_PARENT(ctx, root) = parent;
+        if (parent != LAY_INVALID_ID) {
+            LAY_NEXT_SIBLING(ctx, root) = k + 1 < count ? root + n : LAY_INVALID_ID;
+            LAY_FLAGS(ctx, root) |= LAY_ITEM_INSERTED;
+        } else {
+            LAY_NEXT_SIBLING(ctx, root) = LAY_INVALID_ID;
+            LAY_FLAGS(ctx, root) &= ~(uint32_t)LAY_ITEM_INSERTED;
+        }
+    }
+
+    if (parent != LAY_INVALID_ID) {
+        LAY_ASSERT(parent < first);
+        if (LAY_FIRST_CHILD(ctx, parent) == LAY_INVALID_ID)
+            LAY_FIRST_CHILD(ctx, parent) = first;
+        else
+            LAY_NEXT_SIBLING(ctx, LAY_LAST_CHILD(ctx, parent)) = first;
+        LAY_LAST_CHILD(ctx, parent) = end - n;
+        lay_mark_dirty(ctx, parent);
+    }
+    return first;
+}
+
+// Rounds down, so that the first row of a virtual list never leaves a gap at
+// the start of the viewport.
+static lay_scalar lay_floor_scalar(double value)
+{
+#if LAY_FLOAT == 1
+    return (lay_scalar)value;
+#else
+    lay_scalar result = (lay_scalar)value;
+    if ((double)result > value) --result;
+    return result;
+#endif
+}
+
+static double lay_clamp_scroll(double scroll, double total, double viewport)
+{
+    if (scroll > total - viewport) scroll = total - viewport;
+    if (scroll < 0) scroll = 0;
+    return scroll;
+}
+
+lay_virtual_rows lay_virtual_rows_uniform(
+        lay_id num_rows, double row_extent, double scroll, double viewport)
+{
+    LAY_ASSERT(row_extent > 0);
+    lay_virtual_rows rows;
+    rows.total = (double)num_rows * row_extent;
+    scroll = lay_clamp_scroll(scroll, rows.total, viewport);
+    const double first = scroll / row_extent;
+    const double end = (scroll + viewport) / row_extent;
+    rows.first = first < (double)num_rows ? (lay_id)first : num_rows;
+    lay_id last = end < (double)num_rows ? (lay_id)end : num_rows;
+    if ((double)last < end && last < num_rows) ++last;
+    rows.count = last > rows.first ? last - rows.first : 0;
+    rows.offset = lay_floor_scalar((double)rows.first * row_extent - scroll);
+    return rows;
+}
+
+lay_virtual_rows lay_virtual_rows_varying(
+        lay_id num_rows, lay_row_offset_proc offset_proc, void *user_data,
+        double scroll, double viewport)
+{
+    LAY_ASSERT(offset_proc != NULL);
+    lay_virtual_rows rows;
+    rows.total = offset_proc(user_data, num_rows);
+    scroll = lay_clamp_scroll(scroll, rows.total, viewport);
+    // The first row that ends after scroll
+    lay_id lo = 0, hi = num_rows;
+    while (lo < hi) {
+        const lay_id mid = lo + (hi - lo) / 2;
+        if (offset_proc(user_data, mid + 1) > scroll) hi = mid;
+        else lo = mid + 1;
+    }
+    rows.first = lo;
+    // The first row that starts at or after the end of the viewport
+    hi = num_rows;
+    while (lo < hi) {
+        const lay_id mid = lo + (hi - lo) / 2;
+        if (offset_proc(user_data, mid) >= scroll + viewport) hi = mid;
+        else lo = mid + 1;
+    }
+    rows.count = lo - rows.first;
+    rows.offset = rows.first < num_rows
+        ? lay_floor_scalar(offset_proc(user_data, rows.first) - scroll) : 0;
+    return rows;
+}
+
+lay_id lay_virtual_list(
+        lay_context *ctx, lay_id viewport, int dim, const lay_virtual_rows *rows)
+{
+    LAY_ASSERT(ctx != NULL && rows != NULL);
+    LAY_ASSERT(dim == 0 || dim == 1);
+    const lay_id list = lay_item(ctx);
+    lay_set_contain(ctx, list, (dim == 0 ? LAY_ROW : LAY_COLUMN) | LAY_START);
+    lay_set_behave(ctx, list, dim == 0 ? LAY_VFILL | LAY_LEFT : LAY_HFILL | LAY_TOP);
+    LAY_MARGIN(ctx, list, dim) = rows->offset;
+    lay_insert(ctx, viewport, list);
+    return list;
+}
+
+typedef struct lay_parallel_pass {
+    lay_context *ctx;
+    // Pairs of [first, end) ranges of siblings
+    const lay_id *tasks;
+    int dim;
+} lay_parallel_pass;
+
+static void lay_parallel_calc_task(void *task_data, lay_id index)
+{
+    const lay_parallel_pass *pass = (const lay_parallel_pass*)task_data;
+    lay_id child = pass->tasks[2 * index];
+    const lay_id end = pass->tasks[2 * index + 1];
+    while (child != end) {
+        lay_calc_size(pass->ctx, child, pass->dim);
+        child = LAY_NEXT_SIBLING(pass->ctx, child);
+    }
+}
+
+static void lay_parallel_arrange_task(void *task_data, lay_id index)
+{
+    const lay_parallel_pass *pass = (const lay_parallel_pass*)task_data;
+    lay_id child = pass->tasks[2 * index];
+    const lay_id end = pass->tasks[2 * index + 1];
+    while (child != end) {
+        lay_arrange(pass->ctx, child, pass->dim);
+        child = LAY_NEXT_SIBLING(pass->ctx, child);
+    }
+}
+
+// Makes room in the scratch space for 4 lay_ids per item
+static void lay_reserve_tasks(lay_context *ctx)
+{
+    if (ctx->tasks_capacity < ctx->count) {
+        ctx->tasks = (lay_id*)lay_realloc(ctx, ctx->tasks,
+            4 * ctx->tasks_capacity * sizeof(lay_id), 4 * ctx->count * sizeof(lay_id));
+        ctx->tasks_capacity = ctx->count;
+    }
+}
+
+// Writes the number of items in the subtree of each item below root to sizes.
+static void lay_count_subtree_items(const lay_context *ctx, lay_id root, lay_id *sizes)
+{
+    lay_id item = root;
+    for (;;) {
+        lay_id child;
+        sizes[item] = 1;
+        while ((child = LAY_FIRST_CHILD(ctx, item)) != LAY_INVALID_ID) {
+            item = child;
+            sizes[item] = 1;
+        }
+        for (;;) {
+            if (item == root)
+                return;
+            const lay_id parent = LAY_PARENT(ctx, item);
+            sizes[parent] += sizes[item];
+            const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+            if (next != LAY_INVALID_ID) {
+                item = next;
+                break;
+            }
+            item = parent;
+        }
+    }
+}
+
+void lay_run_context_parallel(
+        lay_context *ctx, lay_id min_task_items,
+        lay_parallel_for_proc parallel_for, void *user_data)
+{
+    LAY_ASSERT(ctx != NULL);
+    LAY_ASSERT(parallel_for != NULL);
+
+    const lay_id count = ctx->count;
+#ifdef LAY_STATS
+    // The counters aren't atomic
+    min_task_items = count;
+#endif
+#ifdef LAY_TRACE
+    // Neither are the trace procedures
+    if (ctx->trace != NULL)
+        min_task_items = count;
+#endif
+    if (ctx->memo != NULL)
+        min_task_items = count;
+    if (count <= min_task_items) {
+        lay_run_context(ctx);
+        return;
+    }
+    lay_prepare_rects(ctx);
+    lay_reserve_tasks(ctx);
+    lay_id *sizes = ctx->tasks;
+    // The items that are too big to be a task, parents before children
+    lay_id *big = sizes + count;
+    lay_id *tasks = big + count;
+    lay_id num_big = 0;
+    lay_id num_tasks = 0;
+
+    lay_count_subtree_items(ctx, 0, sizes);
+    big[num_big++] = 0;
+    for (lay_id i = 0; i < num_big; ++i) {
+        lay_id group_start = LAY_INVALID_ID;
+        lay_id group_items = 0;
+        lay_id child = LAY_FIRST_CHILD(ctx, big[i]);
+        while (child != LAY_INVALID_ID) {
+            const lay_id next = LAY_NEXT_SIBLING(ctx, child);
+            if (sizes[child] > min_task_items) {
+                big[num_big++] = child;
+                if (group_start != LAY_INVALID_ID) {
+                    tasks[2 * num_tasks] = group_start;
+                    tasks[2 * num_tasks + 1] = child;
+                    ++num_tasks;
+                    group_start = LAY_INVALID_ID;
+                    group_items = 0;
+                }
+            } else {
+                if (group_start == LAY_INVALID_ID)
+                    group_start = child;
+                group_items += sizes[child];
+                if (group_items >= min_task_items) {
+                    tasks[2 * num_tasks] = group_start;
+                    tasks[2 * num_tasks + 1] = next;
+                    ++num_tasks;
+                    group_start = LAY_INVALID_ID;
+                    group_items = 0;
+                }
+            }
+            child = next;
+        }
+        if (group_start != LAY_INVALID_ID) {
+            tasks[2 * num_tasks] = group_start;
+            tasks[2 * num_tasks + 1] = LAY_INVALID_ID;
+            ++num_tasks;
+        }
+    }
+
+    // The same four passes as lay_run_item(). Each item only depends on its own
+    // subtree when calculating sizes, and on its parent when arranging, so the
+    // tasks can run in any order as long as the big items are calculated after
+    // them and arranged before them.
+    lay_parallel_pass pass;
+    pass.ctx = ctx;
+    pass.tasks = tasks;
+    for (int dim = 0; dim < 2; ++dim) {
+        pass.dim = dim;
+        if (num_tasks > 0)
+            parallel_for(user_data, lay_parallel_calc_task, &pass, num_tasks);
+        for (lay_id i = num_big; i-- > 0;)
+            lay_calc_item_size(ctx, big[i], dim);
+        for (lay_id i = 0; i < num_big; ++i)
+            lay_arrange_item(ctx, big[i], dim);
+        if (num_tasks > 0)
+            parallel_for(user_data, lay_parallel_arrange_task, &pass, num_tasks);
+    }
+    if (ctx->changes != NULL) {
+        lay_begin_changes(ctx);
+        lay_scan_changes(ctx, 0);
+    }
+}
+
+typedef struct lay_contexts_batch {
+    lay_context **ctxs;
+    size_t n;
+    size_t per_task;
+} lay_contexts_batch;
+
+static void lay_run_contexts_range(lay_context **ctxs, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i) {
+        lay_context *ctx = ctxs[i];
+        if (ctx->count > 0)
+            lay_run_item(ctx, 0);
+    }
+}
+
+static void lay_run_contexts_task(void *task_data, lay_id index)
+{
+    const lay_contexts_batch *batch = (const lay_contexts_batch*)task_data;
+    const size_t begin = (size_t)index * batch->per_task;
+    const size_t end = begin + batch->per_task < batch->n
+        ? begin + batch->per_task : batch->n;
+    lay_run_contexts_range(batch->ctxs, begin, end);
+}
+
+void lay_run_contexts(
+        lay_context **ctxs, size_t n, lay_id min_task_items,
+        lay_parallel_for_proc parallel_for, void *user_data)
+{
+    LAY_ASSERT(ctxs != NULL || n == 0);
+    if (parallel_for == NULL) {
+        lay_run_contexts_range(ctxs, 0, n);
+        return;
+    }
+    size_t total_items = 0;
+    for (size_t i = 0; i < n; ++i)
+        total_items += ctxs[i]->count;
+    if (total_items <= min_task_items) {
+        lay_run_contexts_range(ctxs, 0, n);
+        return;
+    }
+    // Assumes the contexts are about the same size
+    lay_contexts_batch batch;
+    batch.ctxs = ctxs;
+    batch.n = n;
+    batch.per_task = (size_t)min_task_items * n / total_items;
+    if (batch.per_task < 1)
+        batch.per_task = 1;
+    parallel_for(user_data, lay_run_contexts_task, &batch,
+        (lay_id)((n + batch.per_task - 1) / batch.per_task));
+}
+
+void lay_init_frames(lay_frames *frames, uint32_t num_contexts)
+{
+    LAY_ASSERT(frames != NULL);
+    LAY_ASSERT(num_contexts >= 2 && num_contexts <= LAY_MAX_FRAMES);
+    for (uint32_t i = 0; i < LAY_MAX_FRAMES; ++i) {
+        lay_init_context(&frames->contexts[i]);
+        frames->readers[i] = 0;
+    }
+    frames->latest = LAY_MAX_FRAMES;
+    frames->building = LAY_MAX_FRAMES;
+    frames->num_contexts = num_contexts;
+}
+
+void lay_destroy_frames(lay_frames *frames)
+{
+    LAY_ASSERT(frames != NULL);
+    for (uint32_t i = 0; i < LAY_MAX_FRAMES; ++i) {
+        LAY_ASSERT(frames->readers[i] == 0);
+        lay_destroy_context(&frames->contexts[i]);
+    }
+}
+
+lay_context *lay_begin_frame(lay_frames *frames)
+{
+    LAY_ASSERT(frames != NULL);
+    LAY_ASSERT(frames->building == LAY_MAX_FRAMES);
+    // Only the writer changes latest, so it can't change under us. A reader
+    // that gets past the check below can't hold this context either: it
+    // counts itself as a reader before it checks that the context is still
+    // the latest one, and it isn't.
+    const uint32_t latest = frames->latest;
+    for (uint32_t i = 0; i < frames->num_contexts; ++i) {
+        if (i == latest || LAY_ATOMIC_LOAD(&frames->readers[i]) != 0)
+            continue;
+        frames->building = i;
+        lay_reset_context(&frames->contexts[i]);
+        return &frames->contexts[i];
+    }
+    return NULL;
+}
+
+void lay_publish_frame(lay_frames *frames)
+{
+    LAY_ASSERT(frames != NULL);
+    LAY_ASSERT(frames->building != LAY_MAX_FRAMES);
+    LAY_ATOMIC_STORE(&frames->latest, frames->building);
+    frames->building = LAY_MAX_FRAMES;
+}
+
+const lay_context *lay_acquire_frame(lay_frames *frames)
+{
+    LAY_ASSERT(frames != NULL);
+    for (;;) {
+        const uint32_t latest = LAY_ATOMIC_LOAD(&frames->latest);
+        if (latest == LAY_MAX_FRAMES)
+            return NULL;
+        LAY_ATOMIC_ADD(&frames->readers[latest], 1);
+        // If another frame was published in the meantime, the writer may have
+        // already started building into this one.
+        if (LAY_ATOMIC_LOAD(&frames->latest) == latest)
+            return &frames->contexts[latest];
+        LAY_ATOMIC_ADD(&frames->readers[latest], (uint32_t)-1);
+    }
+}
+
+void lay_release_frame(lay_frames *frames, const lay_context *ctx)
+{
+    LAY_ASSERT(frames != NULL);
+    const uint32_t i = (uint32_t)(ctx - frames->contexts);
+    LAY_ASSERT(i < frames->num_contexts && LAY_ATOMIC_LOAD(&frames->readers[i]) > 0);
+    LAY_ATOMIC_ADD(&frames->readers[i], (uint32_t)-1);
+}
+
+#ifdef LAY_TRACE
+void lay_set_trace(
+        lay_context *ctx, lay_trace_proc trace, void *user_data, lay_id min_subtree_items)
+{
+    LAY_ASSERT(ctx != NULL);
+    ctx->trace = trace;
+    ctx->trace_data = user_data;
+    ctx->trace_min_items = min_subtree_items;
+}
+
+static LAY_FORCE_INLINE
+void lay_trace(lay_context *ctx, lay_trace_phase phase, const char *name, lay_id item, int dim)
+{ ctx->trace(ctx->trace_data, phase, name, item, dim); }
+
+// The same walk as lay_calc_size_impl(), but with a span around each subtree
+// that has more than min_items items. A subtree begins when the walk first goes
+// into it, and ends when the size of its root has been calculated.
+static void lay_calc_size_traced(
+        lay_context *ctx, lay_id item, int dim, const lay_id *sizes, lay_id min_items)
+{
+    const lay_id root = item;
+    for (;;) {
+        for (;;) {
+            if (sizes[item] > min_items)
+                lay_trace(ctx, LAY_TRACE_BEGIN, "subtree", item, dim);
+            const lay_id child = LAY_FIRST_CHILD(ctx, item);
+            if (child == LAY_INVALID_ID)
+                break;
+            item = child;
+        }
+        for (;;) {
+            lay_calc_item_size(ctx, item, dim);
+            if (sizes[item] > min_items)
+                lay_trace(ctx, LAY_TRACE_END, "subtree", item, dim);
+            if (item == root)
+                return;
+            const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+            if (next != LAY_INVALID_ID) {
+                item = next;
+                break;
+            }
+            item = LAY_PARENT(ctx, item);
+        }
+    }
+}
+
+// The same walk as lay_arrange_impl(), but with a span around each subtree that
+// has more than min_items items. A subtree begins when its root is arranged,
+// and ends when the walk leaves it.
+static void lay_arrange_traced(
+        lay_context *ctx, lay_id item, int dim, const lay_id *sizes, lay_id min_items)
+{
+    const lay_id root = item;
+    for (;;) {
+        if (sizes[item] > min_items)
+            lay_trace(ctx, LAY_TRACE_BEGIN, "subtree", item, dim);
+        lay_arrange_item(ctx, item, dim);
+        const lay_id child = LAY_FIRST_CHILD(ctx, item);
+        if (child != LAY_INVALID_ID) {
+            item = child;
+            continue;
+        }
+        for (;;) {
+            if (sizes[item] > min_items)
+                lay_trace(ctx, LAY_TRACE_END, "subtree", item, dim);
+            if (item == root)
+                return;
+            const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+            if (next != LAY_INVALID_ID) {
+                item = next;
+                break;
+            }
+            item = LAY_PARENT(ctx, item);
+        }
+    }
+}
+
+// lay_run_item() or lay_run_dirty() with the spans reported to the trace
+// procedure
+static void lay_run_traced(lay_context *ctx, lay_id item, bool dirty)
+{
+    static const char *const calc_names[2] = { "lay_calc_size", "lay_calc_size_dirty" };
+    static const char *const arrange_names[2] = { "lay_arrange", "lay_arrange_dirty" };
+    const char *run_name = dirty ? "lay_run_dirty" : "lay_run_item";
+    const lay_id *sizes = NULL;
+    if (ctx->trace_min_items > 0 && !dirty) {
+        lay_reserve_tasks(ctx);
+        lay_count_subtree_items(ctx, item, ctx->tasks);
+        sizes = ctx->tasks;
+    }
+    lay_trace(ctx, LAY_TRACE_BEGIN, run_name, item, -1);
+    for (int dim = 0; dim < 2; ++dim) {
+        lay_trace(ctx, LAY_TRACE_BEGIN, calc_names[dirty], item, dim);
+        if (dirty)
+            lay_calc_size_dirty(ctx, item, dim);
+        else if (sizes != NULL)
+            lay_calc_size_traced(ctx, item, dim, sizes, ctx->trace_min_items);
+        else
+            lay_calc_size(ctx, item, dim);
+        lay_trace(ctx, LAY_TRACE_END, calc_names[dirty], item, dim);
+
+        lay_trace(ctx, LAY_TRACE_BEGIN, arrange_names[dirty], item, dim);
+        if (dirty)
+            lay_arrange_dirty(ctx, item, dim);
+        else if (sizes != NULL)
+            lay_arrange_traced(ctx, item, dim, sizes, ctx->trace_min_items);
+        else
+            lay_arrange(ctx, item, dim);
+        lay_trace(ctx, LAY_TRACE_END, arrange_names[dirty], item, dim);
+    }
+    lay_trace(ctx, LAY_TRACE_END, run_name, item, -1);
+}
+
+void lay_trace_writer_init(lay_trace_writer *writer, double (*now_us)(void))
+{
+    LAY_ASSERT(writer != NULL);
+    LAY_ASSERT(now_us != NULL);
+    writer->now_us = now_us;
+    writer->events = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+}
+
+void lay_trace_writer_destroy(lay_trace_writer *writer)
+{
+    LAY_ASSERT(writer != NULL);
+    LAY_FREE(writer->events);
+    writer->events = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+}
+
+void lay_trace_writer_proc(
+        void *user_data, lay_trace_phase phase, const char *name, lay_id item, int dim)
+{
+    // Read the time first, so that growing the buffer isn't counted
+    lay_trace_writer *writer = (lay_trace_writer*)user_data;
+    const double time = writer->now_us();
+    if (writer->count == writer->capacity) {
+        const size_t capacity = writer->capacity < 1 ? 256 : writer->capacity * 2;
+        writer->events = (lay_trace_event*)LAY_REALLOC(
+            writer->events, capacity * sizeof(lay_trace_event));
+        LAY_ASSERT(writer->events != NULL);
+        writer->capacity = capacity;
+    }
+    lay_trace_event *event = &writer->events[writer->count++];
+    event->name = name;
+    event->time = time;
+    event->item = item;
+    event->dim = (int16_t)dim;
+    event->phase = (uint16_t)phase;
+}
+
+int lay_trace_writer_save(const lay_trace_writer *writer, const char *path)
+{
+    static const char *const dim_names[3] = { "", " x", " y" };
+    LAY_ASSERT(writer != NULL);
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return 0;
+    fprintf(out, "{\"traceEvents\": [\n");
+    for (size_t i = 0; i < writer->count; ++i) {
+        const lay_trace_event *event = &writer->events[i];
+        fprintf(out,
+            "{\"name\": \"%s%s\", \"cat\": \"layout\", \"ph\": \"%s\", "
+            "\"ts\": %.3f, \"pid\": 1, \"tid\": 1, \"args\": {\"item\": %lu}}%s\n",
+            event->name, dim_names[event->dim + 1],
+            event->phase == LAY_TRACE_BEGIN ? "B" : "E", event->time,
+            (unsigned long)event->item, i + 1 < writer->count ? "," : "");
+    }
+    fprintf(out, "],\n\"displayTimeUnit\": \"ns\"}\n");
+    return fclose(out) == 0;
+}
+#endif // LAY_TRACE
+
+#ifndef LAY_MEMO_MAX_ENTRIES
+// The most entries in a subtree cache. When it's full, it's emptied.
+#define LAY_MEMO_MAX_ENTRIES 65536
+#endif
+
+enum {
+    // The subtree has a wrapping container, so it can't be cached
+    LAY_MEMO_WRAP = 0x1,
+    // The size of the subtree was found in the cache in the horizontal or
+    // vertical pass, so its descendants haven't been calculated
+    LAY_MEMO_SIZE_REUSED = 0x2
+};
+
+// Per-item results of lay_memo_hash(), rebuilt for every run
+typedef struct lay_memo_item {
+    // Hash of the item's box flags and sizes, and of everything about its
+    // descendants. The item's margins and behavior only matter to its parent,
+    // so they aren't included.
+    uint64_t hash;
+    // Items in the subtree
+    lay_id items;
+    uint32_t state;
+} lay_memo_item;
+
+typedef struct lay_memo_entry {
+    // 0 for empty slots
+    uint64_t key;
+    // The arranged positions and sizes of the descendants, in pre-order, start
+    // at pool[offset]
+    size_t offset;
+    lay_id count;
+    lay_scalar size;
+} lay_memo_entry;
+
+typedef struct lay_memo {
+    lay_id max_items;
+    lay_memo_item *items;
+    lay_id items_capacity;
+    // Open addressing, with a power of 2 capacity
+    lay_memo_entry *entries;
+    uint32_t entries_capacity;
+    lay_scalar *pool;
+    size_t pool_count;
+    size_t pool_capacity;
+    lay_memo_stats stats;
+} lay_memo;
+
+static LAY_FORCE_INLINE uint64_t lay_memo_mix(uint64_t h)
+{
+    h ^= h >> 31;
+    h *= 0x7fb5d329728ea185ull;
+    h ^= h >> 27;
+    h *= 0x81dadef4bc2dd44dull;
+    h ^= h >> 33;
+    return h;
+}
+
+static LAY_FORCE_INLINE uint64_t lay_memo_combine(uint64_t h, uint64_t value)
+{ return lay_memo_mix(h * 0x9e3779b97f4a7c15ull + value); }
+
+static LAY_FORCE_INLINE uint64_t lay_scalar_bits(lay_scalar value)
+{
+#if LAY_FLOAT == 1
+    uint32_t bits;
+    LAY_MEMCPY(&bits, &value, sizeof(bits));
+    return bits;
+#else
+    return (uint16_t)value;
+#endif
+}
+
+// Hashes each subtree below root, and counts its items. Done in the same order
+// as lay_calc_size(), so that each item is finished after its children.
+static void lay_memo_hash(lay_context *ctx, lay_memo *memo, lay_id root)
+{
+    lay_memo_item *info = memo->items;
+    lay_id item = root;
+    for (;;) {
+        lay_id child;
+        info[item].hash = 0x243f6a8885a308d3ull;
+        info[item].items = 1;
+        info[item].state = 0;
+        while ((child = LAY_FIRST_CHILD(ctx, item)) != LAY_INVALID_ID) {
+            item = child;
+            info[item].hash = 0x243f6a8885a308d3ull;
+            info[item].items = 1;
+            info[item].state = 0;
+        }
+        for (;;) {
+            const uint32_t flags = LAY_FLAGS(ctx, item);
+            lay_memo_item *it = &info[item];
+            it->hash = lay_memo_combine(lay_memo_combine(it->hash, flags & LAY_ITEM_BOX_MASK),
+                lay_scalar_bits(LAY_SIZE(ctx, item, 0))
+                | lay_scalar_bits(LAY_SIZE(ctx, item, 1)) << 32);
+            if (flags & LAY_WRAP)
+                it->state |= LAY_MEMO_WRAP;
+            if (item == root)
+                return;
+            // What the parent sees of this item
+            uint64_t outer = lay_memo_combine(
+                it->hash, flags & (LAY_ITEM_LAYOUT_MASK | LAY_ITEM_FIXED_MASK));
+            outer = lay_memo_combine(outer, lay_scalar_bits(LAY_MARGIN(ctx, item, 0))
+                | lay_scalar_bits(LAY_MARGIN(ctx, item, 1)) << 32);
+            outer = lay_memo_combine(outer, lay_scalar_bits(LAY_MARGIN(ctx, item, 2))
+                | lay_scalar_bits(LAY_MARGIN(ctx, item, 3)) << 32);
+            const lay_id parent = LAY_PARENT(ctx, item);
+            lay_memo_item *p = &info[parent];
+            p->hash = lay_memo_combine(p->hash, outer);
+            p->items += it->items;
+            p->state |= it->state & LAY_MEMO_WRAP;
+            const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+            if (next != LAY_INVALID_ID) {
+                item = next;
+                break;
+            }
+            item = parent;
+        }
+    }
+}
+
+// The key for a subtree's size (kind 0 and 1) or its arrangement (kind 2 and
+// 3) in a dimension. Never 0.
+static LAY_FORCE_INLINE
+uint64_t lay_memo_key(uint64_t hash, int kind, lay_scalar extent)
+{
+    const uint64_t key = lay_memo_combine(hash, (uint64_t)kind << 32 | lay_scalar_bits(extent));
+    return key != 0 ? key : 1;
+}
+
+// Returns the entry with the key, or the empty slot where it would go
+static lay_memo_entry *lay_memo_find(lay_memo *memo, uint64_t key)
+{
+    const uint32_t mask = memo->entries_capacity - 1;
+    uint32_t i = (uint32_t)key & mask;
+    while (memo->entries[i].key != 0 && memo->entries[i].key != key)
+        i = (i + 1) & mask;
+    return &memo->entries[i];
+}
+
+static void lay_memo_clear(lay_memo *memo)
+{
+    LAY_MEMSET(memo->entries, 0, memo->entries_capacity * sizeof(lay_memo_entry));
+    memo->stats.entries = 0;
+    memo->pool_count = 0;
+}
+
+// Returns the entry for a key that wasn't found, after making room for it
+static lay_memo_entry *lay_memo_insert(lay_context *ctx, lay_memo *memo, uint64_t key)
+{
+    if (2 * (memo->stats.entries + 1) > memo->entries_capacity) {
+        if (memo->entries_capacity >= LAY_MEMO_MAX_ENTRIES) {
+            lay_memo_clear(memo);
+        } else {
+            lay_memo_entry *old = memo->entries;
+            const uint32_t old_capacity = memo->entries_capacity;
+            memo->entries_capacity = 2 * old_capacity;
+            memo->entries = (lay_memo_entry*)lay_realloc(ctx, NULL, 0,
+                memo->entries_capacity * sizeof(lay_memo_entry));
+            LAY_MEMSET(memo->entries, 0, memo->entries_capacity * sizeof(lay_memo_entry));
+            for (uint32_t i = 0; i < old_capacity; ++i) {
+                if (old[i].key != 0)
+                    *lay_memo_find(memo, old[i].key) = old[i];
+            }
+            lay_free(ctx, old, old_capacity * sizeof(lay_memo_entry));
+        }
+    }
+    lay_memo_entry *entry = lay_memo_find(memo, key);
+    if (entry->key == 0)
+        ++memo->stats.entries;
+    entry->key = key;
+    return entry;
+}
+
+// The biggest subtrees that can be cached are looked up
+static LAY_FORCE_INLINE
+bool lay_memo_cacheable(const lay_memo *memo, lay_id item)
+{
+    const lay_memo_item *info = &memo->items[item];
+    return info->items >= 2 && info->items <= memo->max_items && !(info->state & LAY_MEMO_WRAP);
+}
+
+static LAY_FORCE_INLINE
+bool lay_memo_is_root(const lay_context *ctx, const lay_memo *memo, lay_id root, lay_id item)
+{
+    return lay_memo_cacheable(memo, item)
+        && (item == root || !lay_memo_cacheable(memo, LAY_PARENT(ctx, item)));
+}
+
+// If the size of the subtree is in the cache, sets it like lay_calc_item_size()
+// would
+static bool lay_memo_reuse_size(lay_context *ctx, lay_memo *memo, lay_id item, int dim)
+{
+    lay_memo_item *info = &memo->items[item];
+    const uint64_t key = lay_memo_key(info->hash, dim, 0);
+    const lay_memo_entry *entry = lay_memo_find(memo, key);
+    ++memo->stats.size_lookups;
+    if (entry->key != key)
+        return false;
+    ++memo->stats.size_hits;
+    lay_vec4 *rect = &LAY_RECT(ctx, item);
+    (*rect)[dim] = LAY_MARGIN(ctx, item, dim);
+    (*rect)[2 + dim] = entry->size;
+    info->state |= LAY_MEMO_SIZE_REUSED << dim;
+    return true;
+}
+
+// Like lay_calc_size_impl(), but the subtrees whose sizes are found in the
+// cache aren't gone into
+static void lay_calc_size_memo(lay_context *ctx, lay_memo *memo, lay_id root, int dim)
+{
+    lay_id item = root;
+    for (;;) {
+        while (!(lay_memo_is_root(ctx, memo, root, item)
+                && lay_memo_reuse_size(ctx, memo, item, dim))) {
+            const lay_id child = LAY_FIRST_CHILD(ctx, item);
+            if (child == LAY_INVALID_ID)
+                break;
+            item = child;
+        }
+        for (;;) {
+            if (!(memo->items[item].state & (LAY_MEMO_SIZE_REUSED << dim))) {
+                lay_calc_item_size(ctx, item, dim);
+                if (lay_memo_is_root(ctx, memo, root, item)) {
+                    const uint64_t key = lay_memo_key(memo->items[item].hash, dim, 0);
+                    lay_memo_entry *entry = lay_memo_insert(ctx, memo, key);
+                    entry->offset = 0;
+                    entry->count = 0;
+                    entry->size = LAY_RECT(ctx, item)[2 + dim];
+                }
+            }
+            if (item == root)
+                return;
+            const lay_id next = LAY_NEXT_SIBLING(ctx, item);
+            if (next != LAY_INVALID_ID) {
+                item = next;
+                break;
+            }
+            item = LAY_PARENT(ctx, item);
+        }
+    }
+}
+
+// Arranges the descendants of a cacheable subtree, whose own rect has already
+// been set by its parent, from the cache if possible
+static void lay_arrange_subtree_memo(lay_context *ctx, lay_memo *memo, lay_id item, int dim)
+{
+    const lay_scalar pos = LAY_RECT(ctx, item)[dim];
+    const lay_scalar extent = LAY_RECT(ctx, item)[2 + dim];
+    const lay_memo_item *info = &memo->items[item];
+    const lay_id count = info->items - 1;
+    const uint64_t key = lay_memo_key(info->hash, 2 + dim, extent);
+    const lay_memo_entry *found = lay_memo_find(memo, key);
+    ++memo->stats.arrange_lookups;
+    if (found->key == key && found->count == count) {
+        ++memo->stats.arrange_hits;
+        memo->stats.items_reused += count;
+        const lay_scalar *src = memo->pool + found->offset;
+        lay_id d = LAY_FIRST_CHILD(ctx, item);
+        while (d != LAY_INVALID_ID) {
+            lay_vec4 *rect = &LAY_RECT(ctx, d);
+            (*rect)[dim] = (lay_scalar)(pos + src[0]);
+            (*rect)[2 + dim] = src[1];
+            src += 2;
+            const lay_id child = LAY_FIRST_CHILD(ctx, d);
+            d = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, item, d);
+        }
+        return;
+    }
+
+    // The descendants need their sizes for arranging them
+    if (info->state & (LAY_MEMO_SIZE_REUSED << dim)) {
+        lay_id child = LAY_FIRST_CHILD(ctx, item);
+        while (child != LAY_INVALID_ID) {
+            lay_calc_size(ctx, child, dim);
+            child = LAY_NEXT_SIBLING(ctx, child);
+        }
+    }
+    LAY_RECT(ctx, item)[dim] = 0;
+    lay_arrange(ctx, item, dim);
+    LAY_RECT(ctx, item)[dim] = pos;
+
+    // Save the positions relative to the subtree, and then move them into
+    // place
+    if (memo->pool_capacity < memo->pool_count + 2 * (size_t)count) {
+        size_t capacity = memo->pool_capacity < 1024 ? 1024 : memo->pool_capacity;
+        while (capacity < memo->pool_count + 2 * (size_t)count)
+            capacity *= 2;
+        memo->pool = (lay_scalar*)lay_realloc(ctx, memo->pool,
+            memo->pool_capacity * sizeof(lay_scalar), capacity * sizeof(lay_scalar));
+        memo->pool_capacity = capacity;
+    }
+    lay_memo_entry *entry = lay_memo_insert(ctx, memo, key);
+    // Inserting may have emptied the cache
+    entry->offset = memo->pool_count;
+    entry->count = count;
+    entry->size = 0;
+    lay_scalar *dst = memo->pool + memo->pool_count;
+    memo->pool_count += 2 * (size_t)count;
+    lay_id d = LAY_FIRST_CHILD(ctx, item);
+    while (d != LAY_INVALID_ID) {
+        lay_vec4 *rect = &LAY_RECT(ctx, d);
+        dst[0] = (*rect)[dim];
+        dst[1] = (*rect)[2 + dim];
+        dst += 2;
+        (*rect)[dim] = (lay_scalar)((*rect)[dim] + pos);
+        const lay_id child = LAY_FIRST_CHILD(ctx, d);
+        d = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, item, d);
+    }
+}
+
+// Like lay_arrange_impl(), but the cacheable subtrees are arranged by
+// lay_arrange_subtree_memo()
+static void lay_arrange_memo(lay_context *ctx, lay_memo *memo, lay_id root, int dim)
+{
+    lay_id item = root;
+    do {
+        if (lay_memo_is_root(ctx, memo, root, item)) {
+            lay_arrange_subtree_memo(ctx, memo, item, dim);
+            item = lay_next_preorder_up(ctx, root, item);
+            continue;
+        }
+        lay_arrange_item(ctx, item, dim);
+        const lay_id child = LAY_FIRST_CHILD(ctx, item);
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+    } while (item != LAY_INVALID_ID);
+}
+
+static void lay_run_memo(lay_context *ctx, lay_id item)
+{
+    lay_memo *memo = ctx->memo;
+    if (memo->items_capacity < ctx->capacity) {
+        memo->items = (lay_memo_item*)lay_realloc(ctx, memo->items,
+            memo->items_capacity * sizeof(lay_memo_item), ctx->capacity * sizeof(lay_memo_item));
+        memo->items_capacity = ctx->capacity;
+    }
+    lay_memo_hash(ctx, memo, item);
+    for (int dim = 0; dim < 2; ++dim) {
+        lay_calc_size_memo(ctx, memo, item, dim);
+        lay_arrange_memo(ctx, memo, item, dim);
+    }
+}
+
+void lay_set_memo(lay_context *ctx, lay_id max_subtree_items)
+{
+    LAY_ASSERT(ctx != NULL);
+    lay_memo *memo = ctx->memo;
+    if (max_subtree_items == 0) {
+        if (memo != NULL) {
+            if (memo->items != NULL)
+                lay_free(ctx, memo->items, memo->items_capacity * sizeof(lay_memo_item));
+            if (memo->pool != NULL)
+                lay_free(ctx, memo->pool, memo->pool_capacity * sizeof(lay_scalar));
+            lay_free(ctx, memo->entries, memo->entries_capacity * sizeof(lay_memo_entry));
+            lay_free(ctx, memo, sizeof(lay_memo));
+            ctx->memo = NULL;
+        }
+        return;
+    }
+    if (memo == NULL) {
+        memo = (lay_memo*)lay_realloc(ctx, NULL, 0, sizeof(lay_memo));
+        LAY_MEMSET(memo, 0, sizeof(lay_memo));
+        memo->entries_capacity = 256;
+        memo->entries = (lay_memo_entry*)lay_realloc(ctx, NULL, 0,
+            memo->entries_capacity * sizeof(lay_memo_entry));
+        LAY_MEMSET(memo->entries, 0, memo->entries_capacity * sizeof(lay_memo_entry));
+        ctx->memo = memo;
+    }
+    memo->max_items = max_subtree_items;
+}
+
+lay_memo_stats lay_get_memo_stats(const lay_context *ctx)
+{
+    LAY_ASSERT(ctx != NULL);
+    if (ctx->memo == NULL) {
+        lay_memo_stats stats;
+        LAY_MEMSET(&stats, 0, sizeof(stats));
+        return stats;
+    }
+    return ctx->memo->stats;
+}
+
+void lay_set_track_changes(lay_context *ctx, int enabled)
+{
+    LAY_ASSERT(ctx != NULL);
+    lay_changes *changes = ctx->changes;
+    if (!enabled) {
+        if (changes != NULL) {
+            if (changes->previous != NULL)
+                lay_free(ctx, changes->previous, changes->previous_capacity * sizeof(lay_vec4));
+            if (changes->ids != NULL)
+                lay_free(ctx, changes->ids, changes->capacity * sizeof(lay_id));
+            lay_free(ctx, changes, sizeof(lay_changes));
+            ctx->changes = NULL;
+        }
+        return;
+    }
+    if (changes == NULL) {
+        changes = (lay_changes*)lay_realloc(ctx, NULL, 0, sizeof(lay_changes));
+        LAY_MEMSET(changes, 0, sizeof(lay_changes));
+        ctx->changes = changes;
+    }
+}
+
+const lay_id *lay_get_changes(const lay_context *ctx, lay_id *count)
+{
+    LAY_ASSERT(ctx != NULL && count != NULL);
+    if (ctx->changes == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = ctx->changes->count;
+    return ctx->changes->ids;
+}
+
+lay_id lay_get_damage(const lay_context *ctx, lay_vec4 *rects)
+{
+    LAY_ASSERT(ctx != NULL && rects != NULL);
+    if (ctx->changes == NULL)
+        return 0;
+    const lay_changes *changes = ctx->changes;
+    for (lay_id i = 0; i < changes->damage_count; ++i) {
+        const float *d = changes->damage[i];
+        lay_vec4 rect;
+        rect[0] = (lay_scalar)d[0];
+        rect[1] = (lay_scalar)d[1];
+        rect[2] = (lay_scalar)(d[2] - d[0]);
+        rect[3] = (lay_scalar)(d[3] - d[1]);
+        rects[i] = rect;
+    }
+    return changes->damage_count;
+}
+
+#if LAY_FLOAT == 1
+// Rounds toward zero, and clamps to the int16_t range. NaN becomes INT16_MIN,
+// the same as with the SSE2 version.
+static LAY_FORCE_INLINE int16_t lay_scalar_to_i16(float v)
+{ return v > -32768.0f ? (v < 32767.0f ? (int16_t)v : INT16_MAX) : INT16_MIN; }
+#else
+static LAY_FORCE_INLINE int16_t lay_scalar_to_i16(int v)
+{ return (int16_t)v; }
+#endif
+
+// Converts n consecutive rects into out. The SSE2 loops do the bulk of the
+// work, and the scalar loops after them do whatever is left (or all of it,
+// without SSE2). Both give the same results.
+static void lay_convert_rects(
+        const lay_vec4 *LAY_RESTRICT rects, lay_id n, lay_rect_format format,
+        lay_scalar dx, lay_scalar dy, void *LAY_RESTRICT out)
+{
+    lay_id i = 0;
+    const float fdx = (float)dx;
+    const float fdy = (float)dy;
+    if (format == LAY_RECT_I16_XYWH) {
+        int16_t *dst = (int16_t*)out;
+#ifdef LAY_SIMD_SSE2
+#if LAY_FLOAT == 1
+        const __m128 t = _mm_set_ps(0.0f, 0.0f, fdy, fdx);
+        const __m128 lo = _mm_set1_ps(-32768.0f);
+        const __m128 hi = _mm_set1_ps(32767.0f);
+        for (; i + 2 <= n; i += 2) {
+            const float *src = (const float*)(rects + i);
+            __m128 a = _mm_add_ps(_mm_loadu_ps(src), t);
+            __m128 b = _mm_add_ps(_mm_loadu_ps(src + 4), t);
+            a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+            b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+            const __m128i packed = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+            _mm_storeu_si128((__m128i*)(dst + 4 * i), packed);
+        }
+#else
+        const __m128i t = _mm_set_epi16(0, 0, dy, dx, 0, 0, dy, dx);
+        for (; i + 2 <= n; i += 2) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(rects + i));
+            _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_add_epi16(v, t));
+        }
+#endif
+#endif
+        for (; i < n; ++i) {
+            const lay_vec4 r = rects[i];
+            dst[4 * i + 0] = lay_scalar_to_i16(r[0] + dx);
+            dst[4 * i + 1] = lay_scalar_to_i16(r[1] + dy);
+            dst[4 * i + 2] = lay_scalar_to_i16(r[2]);
+            dst[4 * i + 3] = lay_scalar_to_i16(r[3]);
+        }
+        return;
+    }
+
+    float *dst = (float*)out;
+    const bool corners = format == LAY_RECT_F32_X0Y0X1Y1;
+#ifdef LAY_SIMD_SSE2
+    const __m128 t = _mm_set_ps(0.0f, 0.0f, fdy, fdx);
+    const __m128 zero = _mm_setzero_ps();
+#if LAY_FLOAT == 1
+    for (; i < n; ++i) {
+        __m128 a = _mm_add_ps(_mm_loadu_ps((const float*)(rects + i)), t);
+        // (x, y, w, h) + (0, 0, x, y)
+        if (corners)
+            a = _mm_add_ps(a, _mm_movelh_ps(zero, a));
+        _mm_storeu_ps(dst + 4 * i, a);
+    }
+#else
+    for (; i + 2 <= n; i += 2) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(rects + i));
+        // Sign-extend to 32 bits
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        __m128 a = _mm_add_ps(_mm_cvtepi32_ps(lo), t);
+        __m128 b = _mm_add_ps(_mm_cvtepi32_ps(hi), t);
+        if (corners) {
+            a = _mm_add_ps(a, _mm_movelh_ps(zero, a));
+            b = _mm_add_ps(b, _mm_movelh_ps(zero, b));
+        }
+        _mm_storeu_ps(dst + 4 * i, a);
+        _mm_storeu_ps(dst + 4 * i + 4, b);
+    }
+#endif
+#endif
+    for (; i < n; ++i) {
+        const lay_vec4 r = rects[i];
+        const float x = (float)r[0] + fdx;
+        const float y = (float)r[1] + fdy;
+        dst[4 * i + 0] = x;
+        dst[4 * i + 1] = y;
+        dst[4 * i + 2] = corners ? (float)r[2] + x : (float)r[2];
+        dst[4 * i + 3] = corners ? (float)r[3] + y : (float)r[3];
+    }
+}
+
+static LAY_FORCE_INLINE
+size_t lay_rect_format_size(lay_rect_format format)
+{ return format == LAY_RECT_I16_XYWH ? 4 * sizeof(int16_t) : 4 * sizeof(float); }
+
+void lay_get_rects(
+        const lay_context *ctx, lay_id first, lay_id count,
+        lay_rect_format format, lay_scalar dx, lay_scalar dy, void *out)
+{
+    LAY_ASSERT(ctx != NULL);
+    if (count == 0)
+        return;
+#ifdef LAY_PAGED
+    LAY_ASSERT(first + count <= ctx->count);
+    // One page at a time
+    const size_t rect_size = lay_rect_format_size(format);
+    unsigned char *dst = (unsigned char*)out;
+    while (count > 0) {
+        lay_id n = LAY_PAGE_SIZE - first % LAY_PAGE_SIZE;
+        if (n > count)
+            n = count;
+        lay_convert_rects(&LAY_RECT(ctx, first), n, format, dx, dy, dst);
+        dst += n * rect_size;
+        first += n;
+        count -= n;
+    }
+#else
+    LAY_ASSERT(first + count <= ctx->rects_count);
+    lay_convert_rects(ctx->rects + first, count, format, dx, dy, out);
+#endif
+}
+
+void lay_get_rects_by_ids(
+        const lay_context *ctx, const lay_id *ids, lay_id count,
+        lay_rect_format format, lay_scalar dx, lay_scalar dy, void *out)
+{
+    LAY_ASSERT(ctx != NULL);
+    // The rects are gathered into a small buffer, and converted from there
+    enum { batch_size = 64 };
+    lay_vec4 batch[batch_size];
+    const size_t rect_size = lay_rect_format_size(format);
+    unsigned char *dst = (unsigned char*)out;
+    for (lay_id done = 0; done < count;) {
+        const lay_id n = count - done < (lay_id)batch_size ? count - done : (lay_id)batch_size;
+        for (lay_id i = 0; i < n; ++i) {
+#ifndef LAY_PAGED
+            LAY_ASSERT(ids[done + i] < ctx->rects_count);
+#endif
+            batch[i] = LAY_RECT(ctx, ids[done + i]);
+        }
+        lay_convert_rects(batch, n, format, dx, dy, dst);
+        dst += n * rect_size;
+        done += n;
+    }
+}
+
+static LAY_FORCE_INLINE
+bool lay_flags_match(uint32_t item_flags, uint32_t flags, uint32_t mask)
+{
+    if (mask == (uint32_t)LAY_ANY)
+        return flags == (uint32_t)LAY_ANY || (item_flags & flags) != 0;
+    return (item_flags & flags) == mask;
+}
+
+lay_id lay_find_item(
+        const lay_context *ctx, lay_id root, lay_scalar x, lay_scalar y,
+        uint32_t flags, uint32_t mask)
+{
+    LAY_ASSERT(ctx != NULL);
+#ifndef LAY_PAGED
+    LAY_ASSERT(root < ctx->rects_count);
+#endif
+    // The last match in a pre-order walk is the one oui's recursive search
+    // found: later siblings and their subtrees come after earlier ones, and
+    // children come after their parent.
+    lay_id found = LAY_INVALID_ID;
+    lay_id item = root;
+    while (item != LAY_INVALID_ID) {
+        const lay_vec4 rect = LAY_RECT(ctx, item);
+        lay_id child = LAY_INVALID_ID;
+        if (x >= rect[0] && y >= rect[1] && x < rect[0] + rect[2] && y < rect[1] + rect[3]) {
+            if (lay_flags_match(LAY_FLAGS(ctx, item), flags, mask))
+                found = item;
+            child = LAY_FIRST_CHILD(ctx, item);
+        }
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
+    }
+    return found;
+}
+
+lay_id lay_find_items(
+        const lay_context *ctx, lay_id root, lay_vec4 area,
+        uint32_t flags, uint32_t mask, lay_id *out, lay_id capacity)
+{
+    LAY_ASSERT(ctx != NULL);
+    LAY_ASSERT(out != NULL || capacity == 0);
+#ifndef LAY_PAGED
+    LAY_ASSERT(root < ctx->rects_count);
+#endif
+    lay_id count = 0;
+    lay_id item = root;
+    while (item != LAY_INVALID_ID) {
+        const lay_vec4 rect = LAY_RECT(ctx, item);
+        lay_id child = LAY_INVALID_ID;
+        if (rect[0] < area[0] + area[2] && area[0] < rect[0] + rect[2]
+                && rect[1] < area[1] + area[3] && area[1] < rect[1] + rect[3]) {
+            if (lay_flags_match(LAY_FLAGS(ctx, item), flags, mask)) {
+                if (count < capacity)
+                    out[count] = item;
+                ++count;
+            }
+            child = LAY_FIRST_CHILD(ctx, item);
+        }
+        item = child != LAY_INVALID_ID ? child : lay_next_preorder_up(ctx, root, item);
     }
+    return count;
 }
 
 #endif // LAY_IMPLEMENTATION
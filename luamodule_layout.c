@@ -10,9 +10,11 @@ extern "C" {
 
 #if LAY_FLOAT == 1
 #define LUALAY_CHECK_SCALAR luaL_checknumber
+#define LUALAY_TO_SCALAR lua_tonumber
 #define LUALAY_PUSH_SCALAR lua_pushnumber
 #else
 #define LUALAY_CHECK_SCALAR luaL_checkinteger
+#define LUALAY_TO_SCALAR lua_tointeger
 #define LUALAY_PUSH_SCALAR lua_pushinteger
 #endif
 
@@ -45,8 +47,7 @@ lay_id lualay_id_check(lua_State *L, lay_context *ctx, int pos)
 lay_id lualay_id_check_notinserted(lua_State* L, lay_context *ctx, int pos)
 {
     lay_id id = lualay_id_check(L, ctx, pos);
-    const lay_item_t* pitem = lay_get_item(ctx, id);
-    uint32_t inserted = pitem->flags & LAY_ITEM_INSERTED;
+    uint32_t inserted = LAY_FLAGS(ctx, id) & LAY_ITEM_INSERTED;
     luaL_argcheck(L, !inserted, pos, "Item has already been inserted");
     return id;
 }
@@ -161,6 +162,42 @@ int lualay_get_rect(lua_State* L)
     return 4;
 }
 
+// Returns a light userdata pointing at the calculated rects, the number of
+// items, and the name of the C type of the coordinates, for reading all of the
+// rects from LuaJIT FFI code without a call per item:
+//
+//   ctx:run()
+//   local ptr, count, scalar = ctx:rects()
+//   local rects = ffi.cast(scalar .. " *", ptr)
+//   -- item i (counting from 0) is at rects[4 * i] .. rects[4 * i + 3], as
+//   -- x, y, width, height
+//
+// The pointer is only valid until the context is changed: adding items can
+// make the next run move the rects to a bigger buffer, and they are freed with
+// the context when it's collected. Get the pointer again after each run, and
+// keep a reference to the context for as long as you use it. Raises an error
+// if the layout hasn't been run since the last item was created.
+int lualay_get_rects_pointer(lua_State* L)
+{
+    lay_context *ctx = lualay_context_check(L);
+#ifdef LAY_PAGED
+    (void)ctx;
+    return luaL_error(L, "Rects aren't in one block with LAY_PAGED");
+#else
+    if (ctx->rects_count < ctx->count)
+        return luaL_error(L, "Layout must be run before getting the rects");
+    lua_settop(L, 0);
+    lua_pushlightuserdata(L, ctx->rects);
+    lua_pushinteger(L, ctx->count);
+#if LAY_FLOAT == 1
+    lua_pushstring(L, "float");
+#else
+    lua_pushstring(L, "int16_t");
+#endif
+    return 3;
+#endif
+}
+
 // TODO make varargs
 
 int lualay_item_contain_set(lua_State* L)
@@ -218,6 +255,96 @@ int lualay_item_first_child(lua_State* L)
     return 1;
 }
 
+// Reads the flags in field `name` of the table at index, or 0 if there are none
+static uint32_t lualay_field_flags(lua_State *L, int index, const char *name, uint32_t mask)
+{
+    uint32_t flags = 0;
+    lua_getfield(L, index, name);
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isnumber(L, -1))
+            luaL_error(L, "`%s` must be a number", name);
+        flags = (uint32_t)lua_tointeger(L, -1);
+        if ((flags & mask) != flags)
+            luaL_error(L, "Invalid %s flag", name);
+    }
+    lua_pop(L, 1);
+    return flags;
+}
+
+// Reads n scalars from the array in field `name` of the table at index.
+// Returns 0 if the field isn't there.
+static int lualay_field_scalars(lua_State *L, int index, const char *name, lay_scalar *out, int n)
+{
+    lua_getfield(L, index, name);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    if (!lua_istable(L, -1))
+        luaL_error(L, "`%s` must be a table of %d numbers", name, n);
+    for (int i = 0; i < n; ++i) {
+        lua_rawgeti(L, -1, i + 1);
+        if (!lua_isnumber(L, -1))
+            luaL_error(L, "`%s` must be a table of %d numbers", name, n);
+        out[i] = (lay_scalar)LUALAY_TO_SCALAR(L, -1);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+// Creates the item described by the table at index, and its children
+static lay_id lualay_build_item(lua_State *L, lay_context *ctx, int index)
+{
+    luaL_checkstack(L, 3, "Layout tree is too deep");
+    if (!lua_istable(L, index))
+        luaL_error(L, "Item description must be a table");
+    lay_id item = lay_item(ctx);
+    lay_scalar v[4];
+    if (lualay_field_scalars(L, index, "size", v, 2))
+        lay_set_size_xy(ctx, item, v[0], v[1]);
+    if (lualay_field_scalars(L, index, "margins", v, 4))
+        lay_set_margins_ltrb(ctx, item, v[0], v[1], v[2], v[3]);
+    lay_set_contain(ctx, item, lualay_field_flags(L, index, "contain", LAY_ITEM_BOX_MASK));
+    lay_set_behave(ctx, item, lualay_field_flags(L, index, "behave", LAY_ITEM_LAYOUT_MASK));
+    const int n = (int)lua_objlen(L, index);
+    for (int i = 1; i <= n; ++i) {
+        lua_rawgeti(L, index, i);
+        lay_id child = lualay_build_item(L, ctx, lua_gettop(L));
+        lua_pop(L, 1);
+        lay_insert(ctx, item, child);
+    }
+    return item;
+}
+
+// Builds a whole subtree from a nested table in one call, instead of one call
+// per item and property:
+//
+//   local root = ctx:build({
+//       contain = Layout.ROW, size = {100, 20},
+//       {behave = Layout.FILL},
+//       {size = {20, 20}, margins = {2, 0, 2, 0}},
+//   })
+//
+// Every field is optional, and the children are in the array part of the
+// table. If a parent id is given as the third argument, the new subtree is
+// inserted into it. Returns the id of the root of the subtree. If the
+// description is invalid, an error is raised, and the items created up to that
+// point are left in the context.
+int lualay_build(lua_State* L)
+{
+    lay_context *ctx = lualay_context_check(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lay_id parent = LAY_INVALID_ID;
+    if (!lua_isnoneornil(L, 3))
+        parent = lualay_id_check(L, ctx, 3);
+    lay_id root = lualay_build_item(L, ctx, 2);
+    if (parent != LAY_INVALID_ID)
+        lay_insert(ctx, parent, root);
+    lua_pushinteger(L, root);
+    return 1;
+}
+
 static const struct luaL_reg laylib[] = {
     {"new", lualay_context_new},
     {"run", lualay_run_context},
@@ -225,6 +352,7 @@ static const struct luaL_reg laylib[] = {
     {"capacity", lualay_context_capacity},
     {"reserve", lualay_reserve_items_capacity},
     {"item", lualay_item_new},
+    {"build", lualay_build},
     {"insert", lualay_item_insert},
     {"append", lualay_item_append},
     {"push", lualay_item_push},
@@ -233,6 +361,7 @@ static const struct luaL_reg laylib[] = {
     {"set_contain", lualay_item_contain_set},
     {"set_behave", lualay_item_behave_set},
     {"rect", lualay_get_rect},
+    {"rects", lualay_get_rects_pointer},
     {"next_sibling", lualay_item_next_sibling},
     {"first_child", lualay_item_first_child},
     {"__gc", lualay_context_gc},
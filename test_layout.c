@@ -495,6 +495,36 @@ LTEST_DECLARE(deep_nest_1)
     free(items);
 }
 
+// Deep enough that a recursive implementation would run out of stack space.
+LTEST_DECLARE(deep_nest_2)
+{
+    lay_id root = lay_item(ctx);
+
+    const uint32_t num_items = 100000;
+    lay_reserve_items_capacity(ctx, num_items + 1);
+
+    lay_id parent = root;
+    for (uint32_t i = 0; i < num_items; ++i) {
+        lay_id item = lay_item(ctx);
+        lay_insert(ctx, parent, item);
+        parent = item;
+    }
+
+    lay_set_size_xy(ctx, parent, 77, 99);
+
+    lay_run_context(ctx);
+
+    LTEST_VEC4EQ(lay_get_rect(ctx, root), 0, 0, 77, 99);
+    LTEST_VEC4EQ(lay_get_rect(ctx, parent), 0, 0, 77, 99);
+
+    lay_run_dirty(ctx);
+    lay_set_size_xy(ctx, parent, 55, 44);
+    lay_run_dirty(ctx);
+
+    LTEST_VEC4EQ(lay_get_rect(ctx, root), 0, 0, 55, 44);
+    LTEST_VEC4EQ(lay_get_rect(ctx, parent), 0, 0, 55, 44);
+}
+
 LTEST_DECLARE(many_children_1)
 {
     const int16_t num_items = 20000;
@@ -920,6 +950,1602 @@ LTEST_DECLARE(anchor_right_margin2)
     LTEST_VEC4EQ(lay_get_rect(ctx, child), 40, 40, 50, 50);
 }
 
+// Margins large enough that the space left for the children doesn't fit in
+// int16. The fill sizes are still clamped to 0 instead of wrapping around.
+LTEST_DECLARE(overlay_large_margins)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 100, 100);
+
+    lay_id filled = lay_item(ctx);
+    lay_set_margins_ltrb(ctx, filled, 20000, 0, 20100, 0);
+    lay_set_behave(ctx, filled, LAY_HFILL);
+    lay_insert(ctx, root, filled);
+
+    lay_id row = lay_item(ctx);
+    lay_set_size_xy(ctx, row, 100, 100);
+    lay_set_contain(ctx, row, LAY_ROW);
+    lay_insert(ctx, root, row);
+
+    // Squeezed vertically by the row. The first one is centered.
+    lay_id squeezed = lay_item(ctx);
+    lay_set_size_xy(ctx, squeezed, 10, 10);
+    lay_set_margins_ltrb(ctx, squeezed, 0, 20000, 0, 20100);
+    lay_insert(ctx, row, squeezed);
+
+    lay_id squeezed_fill = lay_item(ctx);
+    lay_set_size_xy(ctx, squeezed_fill, 10, 0);
+    lay_set_margins_ltrb(ctx, squeezed_fill, 0, 20000, 0, 20100);
+    lay_set_behave(ctx, squeezed_fill, LAY_VFILL);
+    lay_insert(ctx, row, squeezed_fill);
+
+    lay_run_context(ctx);
+
+    LTEST_VEC4EQ(lay_get_rect(ctx, filled), 20000, 50, 0, 0);
+    LTEST_VEC4EQ(lay_get_rect(ctx, squeezed), 40, -50, 10, 0);
+    LTEST_VEC4EQ(lay_get_rect(ctx, squeezed_fill), 50, 20000, 10, 0);
+}
+
+// Builds a small window-like layout: a toolbar, a sidebar with a list of
+// entries, and a content area with a grid of cells.
+static void build_dirty_tree(lay_context *ctx)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 200, 150);
+    lay_set_contain(ctx, root, LAY_COLUMN);
+
+    lay_id toolbar = lay_item(ctx);
+    lay_set_size_xy(ctx, toolbar, 0, 20);
+    lay_set_behave(ctx, toolbar, LAY_HFILL);
+    lay_set_contain(ctx, toolbar, LAY_ROW | LAY_START);
+    lay_insert(ctx, root, toolbar);
+    for (int i = 0; i < 4; ++i) {
+        lay_id button = lay_item(ctx);
+        lay_set_size_xy(ctx, button, 16, 16);
+        lay_set_margins_ltrb(ctx, button, 2, 2, 2, 2);
+        lay_insert(ctx, toolbar, button);
+    }
+
+    lay_id body = lay_item(ctx);
+    lay_set_behave(ctx, body, LAY_FILL);
+    lay_set_contain(ctx, body, LAY_ROW);
+    lay_insert(ctx, root, body);
+
+    lay_id sidebar = lay_item(ctx);
+    lay_set_behave(ctx, sidebar, LAY_VFILL);
+    lay_set_contain(ctx, sidebar, LAY_COLUMN | LAY_START);
+    lay_insert(ctx, body, sidebar);
+    for (int i = 0; i < 6; ++i) {
+        lay_id entry = lay_item(ctx);
+        lay_set_size_xy(ctx, entry, 40, 10);
+        lay_set_margins_ltrb(ctx, entry, 1, 1, 1, 1);
+        lay_insert(ctx, sidebar, entry);
+    }
+
+    lay_id content = lay_item(ctx);
+    lay_set_behave(ctx, content, LAY_FILL);
+    lay_set_contain(ctx, content, LAY_COLUMN);
+    lay_insert(ctx, body, content);
+    for (int i = 0; i < 3; ++i) {
+        lay_id row = lay_item(ctx);
+        lay_set_behave(ctx, row, LAY_FILL);
+        lay_set_contain(ctx, row, LAY_ROW);
+        lay_insert(ctx, content, row);
+        for (int j = 0; j < 3; ++j) {
+            lay_id cell = lay_item(ctx);
+            lay_set_behave(ctx, cell, j == 1 ? LAY_FILL : LAY_VCENTER);
+            lay_set_size_xy(ctx, cell, j == 1 ? 0 : 20, 12);
+            lay_insert(ctx, row, cell);
+        }
+    }
+
+    // A status area at the bottom that would wrap its tags into more columns if
+    // they didn't fit. It isn't stretched, so resizing the root only moves it
+    // horizontally.
+    lay_id status = lay_item(ctx);
+    lay_set_size_xy(ctx, status, 0, 30);
+    lay_set_contain(ctx, status, LAY_COLUMN | LAY_WRAP);
+    lay_insert(ctx, root, status);
+    for (int i = 0; i < 3; ++i) {
+        lay_id tag = lay_item(ctx);
+        lay_set_size_xy(ctx, tag, 12, 8);
+        lay_set_margins_ltrb(ctx, tag, 1, 1, 1, 1);
+        lay_insert(ctx, status, tag);
+    }
+}
+
+static bool dirty_rects_match(lay_context *a, lay_context *b)
+{
+    if (lay_items_count(a) != lay_items_count(b))
+        return false;
+    for (lay_id i = 0; i < lay_items_count(a); ++i) {
+        lay_vec4 ra = lay_get_rect(a, i);
+        lay_vec4 rb = lay_get_rect(b, i);
+        if (ra[0] != rb[0] || ra[1] != rb[1] || ra[2] != rb[2] || ra[3] != rb[3])
+            return false;
+    }
+    return true;
+}
+
+LTEST_DECLARE(dirty_relayout)
+{
+    // ctx is updated incrementally, and ref is rebuilt from scratch with the
+    // same changes each time.
+    lay_context ref;
+    lay_init_context(&ref);
+
+    build_dirty_tree(ctx);
+    lay_run_dirty(ctx);
+    build_dirty_tree(&ref);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    for (lay_id i = 0; i < lay_items_count(ctx); ++i)
+        LTEST_FALSE(LAY_FLAGS(ctx, i) & LAY_ITEM_DIRTY);
+
+    // Setting the same values again doesn't mark anything
+    lay_set_size_xy(ctx, 0, 200, 150);
+    lay_set_margins_ltrb(ctx, 2, 2, 2, 2, 2);
+    LTEST_FALSE(LAY_FLAGS(ctx, 0) & LAY_ITEM_DIRTY);
+
+    // Grow one of the sidebar entries. This changes the width of the sidebar,
+    // which moves and resizes the content area.
+    lay_set_size_xy(ctx, 8, 60, 10);
+    LTEST_TRUE(LAY_FLAGS(ctx, 8) & LAY_ITEM_DIRTY);
+    LTEST_TRUE(LAY_FLAGS(ctx, 0) & LAY_ITEM_DIRTY);
+    lay_run_dirty(ctx);
+    lay_reset_context(&ref);
+    build_dirty_tree(&ref);
+    lay_set_size_xy(&ref, 8, 60, 10);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // Change a margin deep in the content area, and a toolbar button size
+    lay_set_margins_ltrb(ctx, 20, 3, 0, 0, 4);
+    lay_set_size_xy(ctx, 3, 30, 16);
+    lay_run_dirty(ctx);
+    lay_reset_context(&ref);
+    build_dirty_tree(&ref);
+    lay_set_size_xy(&ref, 8, 60, 10);
+    lay_set_margins_ltrb(&ref, 20, 3, 0, 0, 4);
+    lay_set_size_xy(&ref, 3, 30, 16);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // Insert new items, enough to make the context reallocate, and resize the
+    // root like a window being resized.
+    lay_id sidebar = lay_first_child(ctx, lay_next_sibling(ctx, 1));
+    lay_id ref_sidebar = lay_first_child(&ref, lay_next_sibling(&ref, 1));
+    for (int i = 0; i < 40; ++i) {
+        lay_id entry = lay_item(ctx);
+        lay_set_size_xy(ctx, entry, 5, 2);
+        lay_push(ctx, sidebar, entry);
+        lay_id ref_entry = lay_item(&ref);
+        lay_set_size_xy(&ref, ref_entry, 5, 2);
+        lay_push(&ref, ref_sidebar, ref_entry);
+    }
+    lay_set_size_xy(ctx, 0, 300, 200);
+    lay_set_size_xy(&ref, 0, 300, 200);
+    lay_run_dirty(ctx);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // Only change the width of the root, which moves the wrapping status area
+    // sideways without changing anything else about it.
+    lay_set_size_xy(ctx, 0, 250, 200);
+    lay_set_size_xy(&ref, 0, 250, 200);
+    lay_run_dirty(ctx);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    lay_destroy_context(&ref);
+}
+
+// A small linear congruential generator, so that the random trees are the same
+// on every platform
+static uint32_t dirty_random(uint32_t *state, uint32_t n)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return (*state >> 8) % n;
+}
+
+// Changes one property of an item to a random value. Half of the changes are
+// to the container flags, which start and stop wrapping columns.
+static void dirty_random_change(lay_context *ctx, lay_id item, uint32_t *state)
+{
+    static const uint32_t contains[] = {
+        LAY_ROW, LAY_COLUMN, LAY_LAYOUT, LAY_ROW | LAY_START, LAY_COLUMN | LAY_END,
+        LAY_ROW | LAY_JUSTIFY, LAY_COLUMN | LAY_WRAP, LAY_COLUMN | LAY_WRAP | LAY_START
+    };
+    static const uint32_t behaves[] = {
+        0, LAY_FILL, LAY_HFILL, LAY_VFILL, LAY_LEFT, LAY_TOP | LAY_RIGHT, LAY_BOTTOM, LAY_CENTER
+    };
+    switch (dirty_random(state, 8)) {
+    case 0:
+        if (item == 0)
+            lay_set_size_xy(ctx, item, (lay_scalar)(100 + dirty_random(state, 300)),
+                (lay_scalar)(100 + dirty_random(state, 200)));
+        else
+            lay_set_size_xy(ctx, item, (lay_scalar)dirty_random(state, 60),
+                (lay_scalar)dirty_random(state, 60));
+        break;
+    case 1:
+        lay_set_behave(ctx, item, behaves[dirty_random(state, 8)]);
+        break;
+    case 2:
+    case 3:
+        lay_set_margins_ltrb(ctx, item,
+            (lay_scalar)dirty_random(state, 9), (lay_scalar)dirty_random(state, 9),
+            (lay_scalar)dirty_random(state, 9), (lay_scalar)dirty_random(state, 9));
+        break;
+    default:
+        lay_set_contain(ctx, item, contains[dirty_random(state, 8)]);
+        break;
+    }
+}
+
+LTEST_DECLARE(dirty_random_wrapped_columns)
+{
+    // Wrapping columns place their children horizontally in the vertical pass,
+    // so random trees with them are changed a few times, and ctx is updated
+    // incrementally while ref gets the same changes and a full run. The breaks
+    // are cleared before each run, so that the results don't depend on the
+    // breaks left over from earlier runs.
+    lay_context ref;
+    lay_init_context(&ref);
+    for (uint32_t seed = 1; seed <= 2000; ++seed) {
+        uint32_t state = seed;
+        lay_reset_context(ctx);
+        lay_reset_context(&ref);
+        const lay_id count = (lay_id)(2 + dirty_random(&state, 40));
+        for (lay_id i = 0; i < count; ++i) {
+            lay_item(ctx);
+            lay_item(&ref);
+        }
+        for (lay_id i = 1; i < count; ++i) {
+            const lay_id parent = (lay_id)dirty_random(&state, i);
+            lay_insert(ctx, parent, i);
+            lay_insert(&ref, parent, i);
+        }
+        for (int step = 0; step < 8; ++step) {
+            // Every item is set up in the first step
+            const lay_id changes = step == 0 ? count : (lay_id)(1 + dirty_random(&state, 4));
+            for (lay_id i = 0; i < changes; ++i) {
+                const lay_id item = step == 0 ? i : (lay_id)dirty_random(&state, count);
+                uint32_t ref_state = state;
+                dirty_random_change(ctx, item, &state);
+                dirty_random_change(&ref, item, &ref_state);
+            }
+            for (lay_id i = 0; i < count; ++i) {
+                lay_clear_item_break(ctx, i);
+                lay_clear_item_break(&ref, i);
+            }
+            lay_run_dirty(ctx);
+            lay_run_context(&ref);
+            LTEST_TRUE(dirty_rects_match(ctx, &ref));
+        }
+    }
+    lay_destroy_context(&ref);
+}
+
+// Builds 4 columns of 5 items each under a row root, using the item ids in a
+// scrambled order, so that the tree order doesn't match the creation order.
+// Item 25 is created but never inserted.
+static void build_scrambled_tree(lay_context *ctx)
+{
+    for (int i = 0; i < 26; ++i)
+        lay_item(ctx);
+    lay_set_size_xy(ctx, 0, 100, 50);
+    lay_set_contain(ctx, 0, LAY_ROW);
+    lay_id columns[4];
+    for (int i = 0; i < 24; ++i) {
+        lay_id id = (lay_id)((i * 7) % 24 + 1);
+        if (i < 4) {
+            columns[i] = id;
+            lay_set_contain(ctx, id, LAY_COLUMN);
+            lay_set_behave(ctx, id, LAY_FILL);
+            lay_insert(ctx, 0, id);
+        } else {
+            lay_set_size_xy(ctx, id, (lay_scalar)(i % 5 + 1), 4);
+            lay_set_margins_ltrb(ctx, id, 1, 0, 0, (lay_scalar)(i % 3));
+            lay_insert(ctx, columns[i % 4], id);
+        }
+    }
+}
+
+// Checks that the last child kept by each item is the one at the end of its
+// list of children
+static bool last_children_match(lay_context *ctx)
+{
+    for (lay_id i = 0; i < lay_items_count(ctx); ++i) {
+        lay_id child = lay_first_child(ctx, i);
+        lay_id last = LAY_INVALID_ID;
+        while (child != LAY_INVALID_ID) {
+            last = child;
+            child = lay_next_sibling(ctx, child);
+        }
+        if (lay_last_child(ctx, i) != last)
+            return false;
+    }
+    return true;
+}
+
+LTEST_DECLARE(compact_context)
+{
+    lay_vec4 old_rects[26];
+    lay_id remap[26];
+    lay_id remap_many[202];
+
+    for (int pass = 0; pass < 2; ++pass) {
+        const lay_compact_order order = pass == 0
+            ? LAY_COMPACT_DEPTH_FIRST : LAY_COMPACT_BREADTH_FIRST;
+        lay_reset_context(ctx);
+        build_scrambled_tree(ctx);
+        lay_run_dirty(ctx);
+        for (lay_id i = 0; i < 26; ++i)
+            old_rects[i] = lay_get_rect(ctx, i);
+
+        lay_compact_context(ctx, order, remap);
+        LTEST_TRUE(remap[0] == 0);
+        LTEST_TRUE(remap[25] == 25);
+        LTEST_TRUE(last_children_match(ctx));
+        for (lay_id i = 0; i < 25; ++i) {
+            lay_id child = lay_first_child(ctx, i);
+            lay_id next = lay_next_sibling(ctx, i);
+            if (order == LAY_COMPACT_DEPTH_FIRST) {
+                LTEST_TRUE(child == LAY_INVALID_ID || child == i + 1);
+            } else {
+                LTEST_TRUE(next == LAY_INVALID_ID || next == i + 1);
+            }
+        }
+
+        // The previous results move along with the items
+        for (lay_id i = 0; i < 26; ++i) {
+            lay_vec4 r = lay_get_rect(ctx, remap[i]);
+            LTEST_VEC4EQ(r, old_rects[i][0], old_rects[i][1], old_rects[i][2], old_rects[i][3]);
+        }
+        lay_run_context(ctx);
+        for (lay_id i = 0; i < 26; ++i) {
+            lay_vec4 r = lay_get_rect(ctx, remap[i]);
+            LTEST_VEC4EQ(r, old_rects[i][0], old_rects[i][1], old_rects[i][2], old_rects[i][3]);
+        }
+
+        // And so does the state for lay_run_dirty()
+        lay_set_size_xy(ctx, remap[(2 * 7) % 24 + 1], 10, 0);
+        lay_run_dirty(ctx);
+        lay_context ref;
+        lay_init_context(&ref);
+        build_scrambled_tree(&ref);
+        lay_set_size_xy(&ref, (2 * 7) % 24 + 1, 10, 0);
+        lay_run_context(&ref);
+        for (lay_id i = 0; i < 26; ++i) {
+            lay_vec4 r = lay_get_rect(ctx, remap[i]);
+            lay_vec4 e = lay_get_rect(&ref, i);
+            LTEST_VEC4EQ(r, e[0], e[1], e[2], e[3]);
+        }
+        lay_destroy_context(&ref);
+    }
+
+    // Items created after lay_run_dirty(), enough to make a new context
+    // reallocate, and put in front of the old ones so that they're moved
+    lay_context grown;
+    lay_init_context(&grown);
+    lay_id root = lay_item(&grown);
+    lay_set_size_xy(&grown, root, 100, 0);
+    lay_set_contain(&grown, root, LAY_COLUMN);
+    lay_id first = lay_item(&grown);
+    lay_set_size_xy(&grown, first, 10, 10);
+    lay_insert(&grown, root, first);
+    lay_run_dirty(&grown);
+    for (int i = 0; i < 200; ++i) {
+        lay_id child = lay_item(&grown);
+        lay_set_size_xy(&grown, child, (lay_scalar)(i % 7 + 1), 2);
+        lay_push(&grown, root, child);
+    }
+    lay_compact_context(&grown, LAY_COMPACT_DEPTH_FIRST, remap_many);
+    LTEST_TRUE(remap_many[first] == 201);
+    lay_run_dirty(&grown);
+    lay_vec4 dirty_rects[202];
+    for (lay_id i = 0; i < 202; ++i)
+        dirty_rects[i] = lay_get_rect(&grown, i);
+    lay_run_context(&grown);
+    for (lay_id i = 0; i < 202; ++i) {
+        lay_vec4 r = lay_get_rect(&grown, i);
+        LTEST_VEC4EQ(r, dirty_rects[i][0], dirty_rects[i][1], dirty_rects[i][2], dirty_rects[i][3]);
+    }
+    LTEST_VEC4EQ(lay_get_rect(&grown, 201), 45, 400, 10, 10);
+    lay_destroy_context(&grown);
+}
+
+// Rows and columns that wrap, each of their children holding a filling item,
+// and a row of columns which get their size from their contents.
+static void build_wrapping_tree(lay_context *ctx)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 90, 160);
+    lay_set_contain(ctx, root, LAY_COLUMN);
+    lay_id shrink = lay_item(ctx);
+    lay_set_contain(ctx, shrink, LAY_ROW);
+    lay_insert(ctx, root, shrink);
+    for (int i = 0; i < 3; ++i) {
+        lay_id column = lay_item(ctx);
+        lay_set_contain(ctx, column, LAY_COLUMN);
+        lay_set_margins_ltrb(ctx, column, 1, 0, 1, 0);
+        lay_insert(ctx, shrink, column);
+        for (int j = 0; j < 2; ++j) {
+            lay_id child = lay_item(ctx);
+            lay_set_size_xy(ctx, child, (lay_scalar)(5 + i * 2 + j), (lay_scalar)(4 + j));
+            lay_insert(ctx, column, child);
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        lay_id box = lay_item(ctx);
+        lay_set_behave(ctx, box, LAY_FILL);
+        lay_set_contain(ctx, box, (i == 0 ? LAY_ROW : LAY_COLUMN) | LAY_WRAP);
+        lay_insert(ctx, root, box);
+        for (int j = 0; j < 12; ++j) {
+            lay_id child = lay_item(ctx);
+            lay_set_size_xy(ctx, child, (lay_scalar)(10 + j % 4 * 3), (lay_scalar)(8 + j % 3 * 4));
+            lay_set_margins_ltrb(ctx, child, 1, 2, 1, 0);
+            lay_set_contain(ctx, child, LAY_ROW);
+            lay_insert(ctx, box, child);
+            lay_id inner = lay_item(ctx);
+            lay_set_behave(ctx, inner, LAY_FILL);
+            lay_insert(ctx, child, inner);
+        }
+    }
+}
+
+// Runs the tasks one at a time, last to first, so that the results would be
+// different if any of them depended on the order.
+static void reverse_parallel_for(void *user_data, lay_task_proc task, void *task_data, lay_id count)
+{
+    lay_id *num_tasks = (lay_id*)user_data;
+    *num_tasks += count;
+    while (count-- > 0)
+        task(task_data, count);
+}
+
+LTEST_DECLARE(run_parallel)
+{
+    static void (*const builders[])(lay_context*) = {
+        build_dirty_tree, build_scrambled_tree, build_wrapping_tree
+    };
+    static const lay_id min_task_items[] = { 1, 2, 3, 7, 20, 1000 };
+    lay_context ref;
+    lay_init_context(&ref);
+    for (size_t b = 0; b < sizeof(builders) / sizeof(builders[0]); ++b) {
+        lay_reset_context(&ref);
+        builders[b](&ref);
+        lay_run_context(&ref);
+        for (size_t m = 0; m < sizeof(min_task_items) / sizeof(min_task_items[0]); ++m) {
+            lay_reset_context(ctx);
+            builders[b](ctx);
+            lay_id num_tasks = 0;
+            lay_run_context_parallel(ctx, min_task_items[m], reverse_parallel_for, &num_tasks);
+            LTEST_TRUE(dirty_rects_match(ctx, &ref));
+#ifndef LAY_STATS
+            LTEST_TRUE((num_tasks > 0) == (lay_items_count(ctx) > min_task_items[m]));
+#endif
+            // The second run on the same context, with the wrapping already
+            // done, also has to match.
+            lay_run_context_parallel(ctx, min_task_items[m], reverse_parallel_for, &num_tasks);
+            LTEST_TRUE(dirty_rects_match(ctx, &ref));
+        }
+    }
+    lay_destroy_context(&ref);
+}
+
+LTEST_DECLARE(run_contexts)
+{
+    static void (*const builders[])(lay_context*) = {
+        build_dirty_tree, build_scrambled_tree, build_wrapping_tree
+    };
+    enum { num_ctxs = 7 };
+    lay_context ctxs[num_ctxs];
+    lay_context *ptrs[num_ctxs];
+    for (int pass = 0; pass < 3; ++pass) {
+        for (int i = 0; i < num_ctxs; ++i) {
+            lay_init_context(&ctxs[i]);
+            // One of them is empty
+            if (i != 4)
+                builders[i % 3](&ctxs[i]);
+            ptrs[i] = &ctxs[i];
+        }
+        lay_id num_tasks = 0;
+        if (pass == 0) {
+            lay_run_contexts(ptrs, num_ctxs, 1, NULL, NULL);
+        } else {
+            lay_run_contexts(ptrs, num_ctxs, pass == 1 ? 1 : 100, reverse_parallel_for, &num_tasks);
+            LTEST_TRUE(pass == 1 ? num_tasks == num_ctxs : (num_tasks > 1 && num_tasks < num_ctxs));
+        }
+        for (int i = 0; i < num_ctxs; ++i) {
+            lay_reset_context(ctx);
+            if (i != 4)
+                builders[i % 3](ctx);
+            lay_run_context(ctx);
+            LTEST_TRUE(dirty_rects_match(&ctxs[i], ctx));
+            lay_destroy_context(&ctxs[i]);
+        }
+    }
+}
+
+LTEST_DECLARE(isa_levels)
+{
+    static void (*const builders[])(lay_context*) = {
+        build_dirty_tree, build_scrambled_tree, build_wrapping_tree
+    };
+    lay_context ref;
+    lay_init_context(&ref);
+    LTEST_TRUE(lay_set_isa(&ref, LAY_ISA_GENERIC) == LAY_ISA_GENERIC);
+    for (int isa = 0; isa < LAY_ISA_COUNT; ++isa) {
+        const lay_isa used = lay_set_isa(ctx, (lay_isa)isa);
+        LTEST_TRUE((int)used <= isa);
+        LTEST_TRUE(lay_get_isa(ctx) == used);
+        LTEST_TRUE(lay_isa_name(used) != NULL);
+        for (size_t b = 0; b < sizeof(builders) / sizeof(builders[0]); ++b) {
+            lay_reset_context(ctx);
+            lay_reset_context(&ref);
+            builders[b](ctx);
+            builders[b](&ref);
+            lay_run_context(ctx);
+            lay_run_context(&ref);
+            LTEST_TRUE(dirty_rects_match(ctx, &ref));
+            lay_set_size_xy(ctx, 0, 77, 91);
+            lay_set_size_xy(&ref, 0, 77, 91);
+            lay_run_dirty(ctx);
+            lay_run_context(&ref);
+            LTEST_TRUE(dirty_rects_match(ctx, &ref));
+        }
+    }
+    lay_destroy_context(&ref);
+}
+
+// An allocator for lay_set_allocator() which keeps the size of each block in
+// front of it, to check the old_size that the context passes back.
+typedef struct counting_allocator {
+    size_t live_bytes;
+    uint32_t num_allocs;
+    uint32_t num_bad_sizes;
+} counting_allocator;
+
+static void *counting_alloc(void *user_data, void *block, size_t old_size, size_t new_size)
+{
+    counting_allocator *allocator = (counting_allocator*)user_data;
+    // Big enough to keep the blocks aligned for the float lay_vec4
+    const size_t header_size = 16;
+    unsigned char *base = NULL;
+    if (block != NULL) {
+        base = (unsigned char*)block - header_size;
+        size_t size;
+        memcpy(&size, base, sizeof(size));
+        if (size != old_size)
+            ++allocator->num_bad_sizes;
+        allocator->live_bytes -= size;
+    } else if (old_size != 0) {
+        ++allocator->num_bad_sizes;
+    }
+    if (new_size == 0) {
+        free(base);
+        return NULL;
+    }
+    base = (unsigned char*)realloc(base, header_size + new_size);
+    memcpy(base, &new_size, sizeof(new_size));
+    allocator->live_bytes += new_size;
+    ++allocator->num_allocs;
+    return base + header_size;
+}
+
+LTEST_DECLARE(allocator)
+{
+    static void (*const builders[])(lay_context*) = {
+        build_dirty_tree, build_scrambled_tree, build_wrapping_tree
+    };
+    counting_allocator allocator = { 0, 0, 0 };
+    lay_context actx;
+    lay_init_context(&actx);
+    lay_set_allocator(&actx, counting_alloc, &allocator);
+    for (size_t b = 0; b < sizeof(builders) / sizeof(builders[0]); ++b) {
+        lay_reset_context(ctx);
+        lay_reset_context(&actx);
+        builders[b](ctx);
+        builders[b](&actx);
+        // Each of these allocates something different: the dirty cache, the
+        // parallel task lists and the compaction scratch buffer.
+        lay_run_context(ctx);
+        lay_run_dirty(&actx);
+        LTEST_TRUE(dirty_rects_match(&actx, ctx));
+        lay_id num_tasks = 0;
+        lay_run_context_parallel(&actx, 2, reverse_parallel_for, &num_tasks);
+        LTEST_TRUE(dirty_rects_match(&actx, ctx));
+        lay_compact_context(ctx, LAY_COMPACT_BREADTH_FIRST, NULL);
+        lay_compact_context(&actx, LAY_COMPACT_BREADTH_FIRST, NULL);
+        lay_run_context(&actx);
+        LTEST_TRUE(dirty_rects_match(&actx, ctx));
+    }
+#ifdef LAY_PAGED
+    // Growing doesn't move the existing items
+    const lay_item_t *first = lay_get_item(&actx, 0);
+    lay_reserve_items_capacity(&actx, lay_items_capacity(&actx) + 3 * LAY_PAGE_SIZE);
+    for (int i = 0; i < 3 * LAY_PAGE_SIZE; ++i)
+        lay_item(&actx);
+    LTEST_TRUE(lay_get_item(&actx, 0) == first);
+#endif
+    LTEST_TRUE(allocator.num_allocs > 0);
+    LTEST_TRUE(allocator.live_bytes > 0);
+    lay_destroy_context(&actx);
+    LTEST_TRUE(allocator.live_bytes == 0);
+    LTEST_TRUE(allocator.num_bad_sizes == 0);
+}
+
+#ifndef LAY_PAGED
+LTEST_DECLARE(rects_buffer)
+{
+    enum { buffer_capacity = 256 };
+    lay_vec4 buffer[buffer_capacity];
+    lay_context ref;
+    lay_init_context(&ref);
+    build_wrapping_tree(&ref);
+    lay_run_context(&ref);
+
+    build_wrapping_tree(ctx);
+    const lay_id count = lay_items_count(ctx);
+    LTEST_TRUE(count < buffer_capacity);
+    memset(buffer, 0x55, sizeof(buffer));
+    lay_set_rects_buffer(ctx, buffer, buffer_capacity);
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    for (lay_id i = 0; i < count; ++i) {
+        const lay_vec4 rect = lay_get_rect(&ref, i);
+        LTEST_VEC4EQ(buffer[i], rect[0], rect[1], rect[2], rect[3]);
+    }
+
+    // An item that isn't inserted anywhere gets an empty rect
+    lay_id loose = lay_item(ctx);
+    lay_item(&ref);
+    lay_run_context(ctx);
+    lay_run_context(&ref);
+    LTEST_VEC4EQ(buffer[loose], 0, 0, 0, 0);
+
+    // Switching buffers makes lay_run_dirty() start over
+    lay_vec4 other[buffer_capacity];
+    memset(other, 0x55, sizeof(other));
+    lay_set_rects_buffer(ctx, other, buffer_capacity);
+    lay_run_dirty(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    lay_set_size_xy(ctx, 0, 61, 47);
+    lay_set_size_xy(&ref, 0, 61, 47);
+    lay_run_dirty(ctx);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // Two contexts sharing one buffer, run one after the other
+    lay_set_rects_buffer(&ref, buffer, buffer_capacity);
+    lay_run_context(&ref);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    lay_set_rects_buffer(ctx, buffer, buffer_capacity);
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // And back to an allocated buffer
+    lay_set_rects_buffer(ctx, NULL, 0);
+    lay_run_context(ctx);
+    LTEST_TRUE(ctx->rects != buffer);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    lay_destroy_context(&ref);
+}
+#endif
+
+// Checks the output of lay_get_rects() or lay_get_rects_by_ids() against
+// lay_get_rect(). If ids is NULL, the items are first, first + 1, etc.
+static bool exported_rects_match(
+        lay_context *ctx, const lay_id *ids, lay_id first, lay_id count,
+        lay_scalar dx, lay_scalar dy,
+        const int16_t *i16, const float *f32, const float *corners)
+{
+    for (lay_id i = 0; i < count; ++i) {
+        const lay_vec4 r = lay_get_rect(ctx, ids ? ids[i] : first + i);
+        for (int c = 0; c < 4; ++c) {
+#if LAY_FLOAT == 1
+            float v = r[c] + (c == 0 ? dx : c == 1 ? dy : 0);
+            v = v < -32768.0f ? -32768.0f : v > 32767.0f ? 32767.0f : v;
+            if (i16[4 * i + c] != (int16_t)v)
+                return false;
+#else
+            if (i16[4 * i + c] != (int16_t)(r[c] + (c == 0 ? dx : c == 1 ? dy : 0)))
+                return false;
+#endif
+        }
+        const float x = (float)r[0] + (float)dx;
+        const float y = (float)r[1] + (float)dy;
+        if (f32[4 * i] != x || f32[4 * i + 1] != y
+                || f32[4 * i + 2] != (float)r[2] || f32[4 * i + 3] != (float)r[3])
+            return false;
+        if (corners[4 * i] != x || corners[4 * i + 1] != y
+                || corners[4 * i + 2] != x + (float)r[2] || corners[4 * i + 3] != y + (float)r[3])
+            return false;
+    }
+    return true;
+}
+
+LTEST_DECLARE(get_rects)
+{
+    // More items than lay_get_rects_by_ids() converts in one batch
+    enum { num_items = 150 };
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 120, 0);
+    lay_set_contain(ctx, root, LAY_ROW | LAY_WRAP);
+    for (int i = 1; i < num_items; ++i) {
+        lay_id child = lay_item(ctx);
+        lay_set_size_xy(ctx, child, (lay_scalar)(i % 7 + 3), (lay_scalar)(i % 5 + 2));
+        lay_set_margins_ltrb(ctx, child, 1, (lay_scalar)(i % 3), 2, 0);
+        lay_insert(ctx, root, child);
+    }
+#if LAY_FLOAT == 1
+    // Doesn't fit in an int16_t. It's the root of its own layout.
+    lay_id huge = lay_item(ctx);
+    lay_set_size_xy(ctx, huge, 40000.5f, -70000.25f);
+    lay_run_item(ctx, huge);
+#endif
+    lay_run_context(ctx);
+    const lay_id count = lay_items_count(ctx);
+    int16_t i16[4 * (num_items + 1)];
+    float f32[4 * (num_items + 1)];
+    float corners[4 * (num_items + 1)];
+    const lay_scalar dx = 3;
+    const lay_scalar dy = -5;
+    // Odd and even starts and lengths, to cover the leftovers after the
+    // SIMD loops
+    for (lay_id first = 0; first < 3; ++first) {
+        for (lay_id n = count - first - 1; n <= count - first; ++n) {
+            lay_get_rects(ctx, first, n, LAY_RECT_I16_XYWH, dx, dy, i16);
+            lay_get_rects(ctx, first, n, LAY_RECT_F32_XYWH, dx, dy, f32);
+            lay_get_rects(ctx, first, n, LAY_RECT_F32_X0Y0X1Y1, dx, dy, corners);
+            LTEST_TRUE(exported_rects_match(ctx, NULL, first, n, dx, dy, i16, f32, corners));
+        }
+    }
+    lay_id ids[num_items + 1];
+    for (lay_id i = 0; i < count; ++i)
+        ids[i] = count - 1 - i;
+    lay_get_rects_by_ids(ctx, ids, count, LAY_RECT_I16_XYWH, 0, 0, i16);
+    lay_get_rects_by_ids(ctx, ids, count, LAY_RECT_F32_XYWH, 0, 0, f32);
+    lay_get_rects_by_ids(ctx, ids, count, LAY_RECT_F32_X0Y0X1Y1, 0, 0, corners);
+    LTEST_TRUE(exported_rects_match(ctx, ids, 0, count, 0, 0, i16, f32, corners));
+#if LAY_FLOAT == 1
+    LTEST_TRUE(i16[4 * 0 + 2] == 32767 && i16[4 * 0 + 3] == -32768);
+#endif
+}
+
+// A column of list rows which are all the same, except for the width of the
+// text in one of them
+static void build_list(lay_context *ctx, lay_scalar odd_text_width)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 200, 1000);
+    lay_set_contain(ctx, root, LAY_COLUMN | LAY_START);
+    for (int i = 0; i < 50; ++i) {
+        lay_id row = lay_item(ctx);
+        lay_set_size_xy(ctx, row, 0, 20);
+        lay_set_behave(ctx, row, LAY_HFILL);
+        lay_set_contain(ctx, row, LAY_ROW);
+        lay_insert(ctx, root, row);
+        lay_id icon = lay_item(ctx);
+        lay_set_size_xy(ctx, icon, 16, 16);
+        lay_set_margins_ltrb(ctx, icon, 2, 0, 2, 0);
+        lay_insert(ctx, row, icon);
+        lay_id label = lay_item(ctx);
+        lay_set_behave(ctx, label, LAY_HFILL | LAY_VFILL);
+        lay_set_contain(ctx, label, LAY_LAYOUT);
+        lay_insert(ctx, row, label);
+        lay_id text = lay_item(ctx);
+        lay_set_size_xy(ctx, text, i == 7 ? odd_text_width : 40, 10);
+        lay_set_behave(ctx, text, LAY_LEFT);
+        lay_insert(ctx, label, text);
+        lay_id button = lay_item(ctx);
+        lay_set_size_xy(ctx, button, 24, 16);
+        lay_set_behave(ctx, button, LAY_BOTTOM);
+        lay_insert(ctx, row, button);
+    }
+}
+
+LTEST_DECLARE(memo)
+{
+    lay_context ref;
+    lay_init_context(&ref);
+    build_list(&ref, 40);
+    lay_run_context(&ref);
+    build_list(ctx, 40);
+    lay_set_memo(ctx, 8);
+
+    // Each row is 5 items. The first one is calculated, and the other 49 are
+    // copied from it, in both dimensions.
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    lay_memo_stats stats = lay_get_memo_stats(ctx);
+    LTEST_TRUE(stats.size_lookups == 100 && stats.size_hits == 98);
+    LTEST_TRUE(stats.arrange_lookups == 100 && stats.arrange_hits == 98);
+    LTEST_TRUE(stats.items_reused == 98 * 4);
+    LTEST_TRUE(stats.entries == 4);
+
+    // Everything is found the second time
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    stats = lay_get_memo_stats(ctx);
+    LTEST_TRUE(stats.size_hits == 198 && stats.arrange_hits == 198);
+
+    // The cache outlives the items. The changed row isn't mixed up with the
+    // others, and misses in both dimensions.
+    lay_reset_context(&ref);
+    build_list(&ref, 60);
+    lay_run_context(&ref);
+    lay_reset_context(ctx);
+    build_list(ctx, 60);
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    stats = lay_get_memo_stats(ctx);
+    LTEST_TRUE(stats.size_hits == 296 && stats.arrange_hits == 296);
+    LTEST_TRUE(stats.entries == 8);
+
+    // Resizing the root changes the extent of the rows horizontally
+    lay_set_size_xy(&ref, 0, 300, 1000);
+    lay_set_size_xy(ctx, 0, 300, 1000);
+    lay_run_context(&ref);
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // Justified cells with justified items are at fractional positions in
+    // both levels, but the cached ones are still placed exactly the same
+    lay_context *contexts[] = { &ref, ctx };
+    for (int c = 0; c < 2; ++c) {
+        lay_context *target = contexts[c];
+        lay_reset_context(target);
+        lay_id row = lay_item(target);
+        lay_set_size_xy(target, row, 100, 20);
+        lay_set_contain(target, row, LAY_ROW | LAY_JUSTIFY);
+        for (int i = 0; i < 3; ++i) {
+            lay_id cell = lay_item(target);
+            lay_set_size_xy(target, cell, 17, 20);
+            lay_set_contain(target, cell, LAY_ROW | LAY_JUSTIFY);
+            lay_insert(target, row, cell);
+            for (int j = 0; j < 4; ++j) {
+                lay_id item = lay_item(target);
+                lay_set_size_xy(target, item, 3, 5);
+                lay_insert(target, cell, item);
+            }
+        }
+        lay_run_context(target);
+    }
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+#ifndef LAY_FLOAT
+    LTEST_VEC4EQ(lay_get_rect(ctx, 6), 41, 0, 17, 20);
+    LTEST_VEC4EQ(lay_get_rect(ctx, 15), 97, 7, 3, 5);
+#endif
+
+    // Trees with wrapping, where most subtrees can't be cached
+    static void (*const builders[])(lay_context*) = {
+        build_dirty_tree, build_scrambled_tree, build_wrapping_tree
+    };
+    for (size_t b = 0; b < sizeof(builders) / sizeof(builders[0]); ++b) {
+        lay_reset_context(&ref);
+        lay_reset_context(ctx);
+        builders[b](&ref);
+        builders[b](ctx);
+        lay_run_context(&ref);
+        lay_run_context(ctx);
+        LTEST_TRUE(dirty_rects_match(ctx, &ref));
+        lay_run_context(ctx);
+        LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    }
+
+    lay_set_memo(ctx, 0);
+    LTEST_TRUE(lay_get_memo_stats(ctx).size_lookups == 0);
+    lay_destroy_context(&ref);
+}
+
+LTEST_DECLARE(instantiate)
+{
+    // The same list as build_list() makes, with its rows copied from a template
+    lay_context ref;
+    lay_init_context(&ref);
+    build_list(&ref, 40);
+    lay_run_context(&ref);
+
+    lay_context tmpl;
+    lay_init_context(&tmpl);
+    build_list(&tmpl, 40);
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 200, 1000);
+    lay_set_contain(ctx, root, LAY_COLUMN | LAY_START);
+    lay_id first = lay_instantiate(ctx, &tmpl, 1, root, 50);
+    LTEST_TRUE(first == 1 && lay_items_count(ctx) == 251);
+    LTEST_TRUE(lay_first_child(ctx, root) == 1);
+    LTEST_TRUE(LAY_PARENT(ctx, 246) == root && lay_next_sibling(ctx, 246) == LAY_INVALID_ID);
+    LTEST_TRUE(LAY_PARENT(ctx, 248) == 246 && lay_next_sibling(ctx, 248) == 250);
+    LTEST_TRUE(LAY_PARENT(ctx, 249) == 248 && lay_first_child(ctx, 248) == 249);
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+    LTEST_TRUE(last_children_match(ctx));
+
+    // From the context itself, after an existing child
+    lay_reset_context(ctx);
+    root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 200, 1000);
+    lay_set_contain(ctx, root, LAY_COLUMN | LAY_START);
+    LTEST_TRUE(lay_instantiate(ctx, &tmpl, 1, root, 1) == 1);
+    LTEST_TRUE(lay_instantiate(ctx, ctx, 1, root, 49) == 6);
+    lay_run_context(ctx);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // Copies that aren't inserted anywhere are each their own root
+    first = lay_instantiate(ctx, &tmpl, 1, LAY_INVALID_ID, 2);
+    LTEST_TRUE(first == 251 && lay_items_count(ctx) == 261);
+    LTEST_TRUE(!(LAY_FLAGS(ctx, 251) & LAY_ITEM_INSERTED) && !(LAY_FLAGS(ctx, 256) & LAY_ITEM_INSERTED));
+    LTEST_TRUE(lay_next_sibling(ctx, 251) == LAY_INVALID_ID && LAY_PARENT(ctx, 256) == LAY_INVALID_ID);
+    lay_run_item(ctx, 256);
+    LTEST_VEC4EQ(lay_get_rect(ctx, 256), 0, 0, 84, 20);
+    LTEST_TRUE(lay_instantiate(ctx, &tmpl, 1, root, 0) == LAY_INVALID_ID);
+
+    lay_destroy_context(&tmpl);
+    lay_destroy_context(&ref);
+}
+
+LTEST_DECLARE(insert_range)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 1000, 10);
+    lay_set_contain(ctx, root, LAY_ROW | LAY_START);
+    lay_id a = lay_item(ctx);
+    lay_insert(ctx, root, a);
+    lay_id first = lay_items(ctx, 100);
+    LTEST_TRUE(first == 2 && lay_items_count(ctx) == 102);
+    for (lay_id i = first; i < first + 100; ++i)
+        lay_set_size_xy(ctx, i, 5, 4);
+    lay_insert_range(ctx, root, first, 100);
+    LTEST_TRUE(lay_next_sibling(ctx, a) == first && lay_last_child(ctx, root) == 101);
+    LTEST_TRUE(lay_items(ctx, 0) == LAY_INVALID_ID);
+
+    // The last child is kept up to date by each way of inserting
+    lay_id b = lay_item(ctx);
+    lay_id c = lay_item(ctx);
+    lay_id d = lay_item(ctx);
+    lay_push(ctx, root, b);
+    lay_append(ctx, 101, c);
+    LTEST_TRUE(lay_last_child(ctx, root) == c);
+    lay_insert(ctx, root, d);
+    LTEST_TRUE(lay_last_child(ctx, root) == d && lay_next_sibling(ctx, c) == d);
+    lay_id e = lay_item(ctx);
+    lay_append(ctx, first, e);
+    LTEST_TRUE(lay_last_child(ctx, root) == d);
+    lay_id f = lay_item(ctx);
+    lay_push(ctx, a, f);
+    lay_id g = lay_items(ctx, 2);
+    lay_insert_range(ctx, f, g, 2);
+    LTEST_TRUE(last_children_match(ctx));
+
+    lay_run_context(ctx);
+    LTEST_VEC4EQ(lay_get_rect(ctx, b), 0, 5, 0, 0);
+    LTEST_VEC4EQ(lay_get_rect(ctx, first), 0, 3, 5, 4);
+    LTEST_VEC4EQ(lay_get_rect(ctx, e), 5, 5, 0, 0);
+    LTEST_VEC4EQ(lay_get_rect(ctx, first + 1), 5, 3, 5, 4);
+    LTEST_VEC4EQ(lay_get_rect(ctx, 101), 495, 3, 5, 4);
+    LTEST_VEC4EQ(lay_get_rect(ctx, d), 500, 5, 0, 0);
+}
+
+// Rows of 10, 15 and 20 high, repeating
+static double varying_row_offset(void *user_data, lay_id index)
+{
+    (void)user_data;
+    return (double)(index / 3 * 45 + (index % 3) * (index % 3 + 3) * 5 / 2);
+}
+
+LTEST_DECLARE(virtual_list)
+{
+    // A million rows of 20, scrolled 5 into row 617
+    lay_virtual_rows rows = lay_virtual_rows_uniform(1000000, 20, 12345, 100);
+    LTEST_TRUE(rows.first == 617 && rows.count == 6 && rows.offset == -5);
+    LTEST_TRUE(rows.total == 20000000.0);
+
+    lay_context tmpl;
+    lay_init_context(&tmpl);
+    lay_id row = lay_item(&tmpl);
+    lay_set_size_xy(&tmpl, row, 0, 18);
+    lay_set_margins_ltrb(&tmpl, row, 0, 1, 0, 1);
+    lay_set_behave(&tmpl, row, LAY_HFILL);
+    lay_id viewport = lay_item(ctx);
+    lay_set_size_xy(ctx, viewport, 200, 100);
+    lay_id list = lay_virtual_list(ctx, viewport, 1, &rows);
+    lay_id first = lay_instantiate(ctx, &tmpl, row, list, rows.count);
+    lay_run_context(ctx);
+    LTEST_VEC4EQ(lay_get_rect(ctx, list), 0, -5, 200, 120);
+    for (lay_id i = 0; i < rows.count; ++i)
+        LTEST_VEC4EQ(lay_get_rect(ctx, first + i), 0, (lay_scalar)(-4 + 20 * (int)i), 200, 18);
+
+    // Exactly on a row boundary, and at the ends
+    rows = lay_virtual_rows_uniform(1000000, 20, 200, 100);
+    LTEST_TRUE(rows.first == 10 && rows.count == 5 && rows.offset == 0);
+    rows = lay_virtual_rows_uniform(1000000, 20, -50, 100);
+    LTEST_TRUE(rows.first == 0 && rows.count == 5 && rows.offset == 0);
+    rows = lay_virtual_rows_uniform(1000000, 20, 1e9, 100);
+    LTEST_TRUE(rows.first == 999995 && rows.count == 5 && rows.offset == 0);
+    rows = lay_virtual_rows_uniform(3, 20, 0, 100);
+    LTEST_TRUE(rows.first == 0 && rows.count == 3);
+    rows = lay_virtual_rows_uniform(0, 20, 0, 100);
+    LTEST_TRUE(rows.count == 0 && rows.total == 0);
+
+    // Horizontally, with rows of varying widths: 10 + 15 + 20 + 10 + 15 = 70,
+    // so 68 is 2 into the fifth row, which is the first one in view
+    rows = lay_virtual_rows_varying(300000, varying_row_offset, NULL, 68, 50);
+    LTEST_TRUE(rows.first == 4 && rows.offset == -13);
+    // The viewport ends at 118, in the ninth row (index 8, 115 .. 135)
+    LTEST_TRUE(rows.count == 5 && rows.total == 4500000.0);
+    for (lay_id i = 0; i < 40; ++i) {
+        lay_virtual_rows a = lay_virtual_rows_varying(300000, varying_row_offset, NULL, 7.0 * i, 30);
+        lay_id expect_first = 0;
+        while (varying_row_offset(NULL, expect_first + 1) <= 7.0 * i)
+            ++expect_first;
+        lay_id expect_end = expect_first;
+        while (varying_row_offset(NULL, expect_end) < 7.0 * i + 30)
+            ++expect_end;
+        LTEST_TRUE(a.first == expect_first && a.count == expect_end - expect_first);
+    }
+    lay_reset_context(ctx);
+    viewport = lay_item(ctx);
+    lay_set_size_xy(ctx, viewport, 50, 30);
+    list = lay_virtual_list(ctx, viewport, 0, &rows);
+    LTEST_TRUE(lay_items(ctx, rows.count) == 2);
+    for (lay_id i = 0; i < rows.count; ++i) {
+        lay_id index = rows.first + i;
+        lay_set_size_xy(ctx, 2 + i, (lay_scalar)(varying_row_offset(NULL, index + 1) - varying_row_offset(NULL, index)), 0);
+        lay_set_behave(ctx, 2 + i, LAY_VFILL);
+    }
+    lay_insert_range(ctx, list, 2, rows.count);
+    lay_run_context(ctx);
+    LTEST_VEC4EQ(lay_get_rect(ctx, 2), -13, 0, 15, 30);
+    LTEST_VEC4EQ(lay_get_rect(ctx, 3), 2, 0, 20, 30);
+    LTEST_VEC4EQ(lay_get_rect(ctx, 5), 32, 0, 15, 30);
+
+    lay_destroy_context(&tmpl);
+}
+
+LTEST_DECLARE(find_item)
+{
+    // Two overlapping boxes with a child each, and a child which sticks out of
+    // the first box
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 100, 100);
+    lay_id a = lay_item(ctx);
+    lay_set_size_xy(ctx, a, 60, 60);
+    lay_set_behave(ctx, a, LAY_LEFT | LAY_TOP);
+    lay_insert(ctx, root, a);
+    lay_id a1 = lay_item(ctx);
+    lay_set_size_xy(ctx, a1, 20, 20);
+    lay_set_behave(ctx, a1, LAY_LEFT | LAY_TOP);
+    LAY_FLAGS(ctx, a1) |= 0x10000;
+    lay_insert(ctx, a, a1);
+    lay_id a2 = lay_item(ctx);
+    lay_set_size_xy(ctx, a2, 10, 10);
+    lay_set_margins_ltrb(ctx, a2, 70, 0, 0, 0);
+    lay_set_behave(ctx, a2, LAY_LEFT | LAY_TOP);
+    lay_insert(ctx, a, a2);
+    lay_id b = lay_item(ctx);
+    lay_set_size_xy(ctx, b, 60, 60);
+    lay_set_behave(ctx, b, LAY_RIGHT | LAY_BOTTOM);
+    LAY_FLAGS(ctx, b) |= 0x20000;
+    lay_insert(ctx, root, b);
+    lay_id b1 = lay_item(ctx);
+    lay_set_size_xy(ctx, b1, 20, 20);
+    lay_set_behave(ctx, b1, LAY_LEFT | LAY_TOP);
+    lay_insert(ctx, b, b1);
+    lay_run_context(ctx);
+    LTEST_VEC4EQ(lay_get_rect(ctx, a2), 70, 0, 10, 10);
+
+    LTEST_TRUE(lay_find_item(ctx, root, 10, 10, LAY_ANY, LAY_ANY) == a1);
+    LTEST_TRUE(lay_find_item(ctx, root, 30, 30, LAY_ANY, LAY_ANY) == a);
+    LTEST_TRUE(lay_find_item(ctx, root, 50, 50, LAY_ANY, LAY_ANY) == b1);
+    LTEST_TRUE(lay_find_item(ctx, root, 70, 70, LAY_ANY, LAY_ANY) == b);
+    LTEST_TRUE(lay_find_item(ctx, root, 99, 99, LAY_ANY, LAY_ANY) == b);
+    LTEST_TRUE(lay_find_item(ctx, root, 100, 50, LAY_ANY, LAY_ANY) == LAY_INVALID_ID);
+    LTEST_TRUE(lay_find_item(ctx, root, -1, 50, LAY_ANY, LAY_ANY) == LAY_INVALID_ID);
+    LTEST_TRUE(lay_find_item(ctx, a, 50, 50, LAY_ANY, LAY_ANY) == a);
+    // Outside of its parent, like it's clipped
+    LTEST_TRUE(lay_find_item(ctx, root, 75, 5, LAY_ANY, LAY_ANY) == root);
+
+    // Filtered by the user bits
+    LTEST_TRUE(lay_find_item(ctx, root, 50, 50, 0x20000, LAY_ANY) == b);
+    LTEST_TRUE(lay_find_item(ctx, root, 10, 10, 0x20000, 0x20000) == LAY_INVALID_ID);
+    LTEST_TRUE(lay_find_item(ctx, root, 10, 10, 0x30000, LAY_ANY) == a1);
+    LTEST_TRUE(lay_find_item(ctx, root, 10, 10, LAY_USERMASK, 0) == a);
+    LTEST_TRUE(lay_find_item(ctx, root, 70, 70, LAY_USERMASK, 0) == root);
+
+    // Areas, in drawing order
+    lay_id found[8];
+    lay_vec4 area;
+    area[0] = 15; area[1] = 15; area[2] = 30; area[3] = 30;
+    LTEST_TRUE(lay_find_items(ctx, root, area, LAY_ANY, LAY_ANY, found, 8) == 5);
+    LTEST_TRUE(found[0] == root && found[1] == a && found[2] == a1 && found[3] == b && found[4] == b1);
+    LTEST_TRUE(lay_find_items(ctx, root, area, LAY_ANY, LAY_ANY, found, 2) == 5);
+    LTEST_TRUE(lay_find_items(ctx, root, area, LAY_USERMASK, 0, NULL, 0) == 3);
+    area[0] = 20; area[1] = 20; area[2] = 20; area[3] = 20;
+    LTEST_TRUE(lay_find_items(ctx, root, area, LAY_ANY, LAY_ANY, found, 8) == 2);
+    LTEST_TRUE(found[0] == root && found[1] == a);
+}
+
+// Builds a frame whose root is the given width
+static void build_frame(lay_context *ctx, lay_scalar width)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, width, 10);
+    lay_id child = lay_item(ctx);
+    lay_set_behave(ctx, child, LAY_FILL);
+    lay_insert(ctx, root, child);
+    lay_run_context(ctx);
+}
+
+LTEST_DECLARE(frames)
+{
+    (void)ctx;
+    for (uint32_t num_contexts = 2; num_contexts <= 3; ++num_contexts) {
+        lay_frames frames;
+        lay_init_frames(&frames, num_contexts);
+        LTEST_TRUE(lay_acquire_frame(&frames) == NULL);
+
+        lay_context *w = lay_begin_frame(&frames);
+        LTEST_TRUE(w != NULL);
+        build_frame(w, 100);
+        // Not seen until it's published
+        LTEST_TRUE(lay_acquire_frame(&frames) == NULL);
+        lay_publish_frame(&frames);
+        const lay_context *r1 = lay_acquire_frame(&frames);
+        LTEST_TRUE(r1 == w);
+        LTEST_VEC4EQ(lay_get_rect(r1, 1), 0, 0, 100, 10);
+
+        // The next frame goes into another context, and the reader still sees
+        // the old one until it acquires again
+        w = lay_begin_frame(&frames);
+        LTEST_TRUE(w != NULL && w != r1);
+        build_frame(w, 200);
+        lay_publish_frame(&frames);
+        LTEST_VEC4EQ(lay_get_rect(r1, 1), 0, 0, 100, 10);
+        const lay_context *r2 = lay_acquire_frame(&frames);
+        LTEST_TRUE(r2 == w);
+        LTEST_VEC4EQ(lay_get_rect(r2, 1), 0, 0, 200, 10);
+
+        // r1 is still held, and r2 is the latest, so with two contexts there's
+        // nothing left to build in
+        w = lay_begin_frame(&frames);
+        if (num_contexts == 2) {
+            LTEST_TRUE(w == NULL);
+            lay_release_frame(&frames, r1);
+            w = lay_begin_frame(&frames);
+            LTEST_TRUE(w == r1);
+        } else {
+            LTEST_TRUE(w != NULL && w != r1 && w != r2);
+            lay_release_frame(&frames, r1);
+        }
+        build_frame(w, 300);
+        lay_publish_frame(&frames);
+        LTEST_VEC4EQ(lay_get_rect(r2, 1), 0, 0, 200, 10);
+        lay_release_frame(&frames, r2);
+        const lay_context *r3 = lay_acquire_frame(&frames);
+        const lay_context *r4 = lay_acquire_frame(&frames);
+        LTEST_TRUE(r3 == w && r4 == w);
+        LTEST_VEC4EQ(lay_get_rect(r3, 1), 0, 0, 300, 10);
+        lay_release_frame(&frames, r3);
+        lay_release_frame(&frames, r4);
+        lay_destroy_frames(&frames);
+    }
+}
+
+static void build_tracked_row(lay_context *ctx, lay_scalar first_width, int num_children)
+{
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 100, 50);
+    lay_set_contain(ctx, root, LAY_ROW | LAY_START);
+    for (int i = 0; i < num_children; ++i) {
+        lay_id child = lay_item(ctx);
+        lay_set_size_xy(ctx, child, i == 0 ? first_width : 10, 10);
+        lay_insert(ctx, root, child);
+    }
+}
+
+LTEST_DECLARE(track_changes)
+{
+    lay_id count;
+    lay_vec4 damage[LAY_DAMAGE_RECTS];
+    const lay_id *changes = lay_get_changes(ctx, &count);
+    LTEST_TRUE(changes == NULL && count == 0);
+
+    lay_set_track_changes(ctx, 1);
+    build_tracked_row(ctx, 10, 3);
+    // Everything is new in the first run
+    lay_run_context(ctx);
+    changes = lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 4);
+    for (lay_id i = 0; i < count; ++i)
+        LTEST_TRUE(changes[i] == i);
+    LTEST_TRUE(lay_get_damage(ctx, damage) == 1);
+    LTEST_VEC4EQ(damage[0], 0, 0, 100, 50);
+
+    lay_run_context(ctx);
+    lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 0);
+    LTEST_TRUE(lay_get_damage(ctx, damage) == 0);
+
+    // Growing the first child pushes the ones after it along
+    lay_set_size_xy(ctx, 1, 20, 10);
+    lay_run_context(ctx);
+    changes = lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 3);
+    LTEST_TRUE(changes[0] == 1 && changes[1] == 2 && changes[2] == 3);
+    LTEST_TRUE(lay_get_damage(ctx, damage) == 1);
+    LTEST_VEC4EQ(damage[0], 0, 20, 40, 10);
+
+    // Rebuilt from scratch in the same order, but with one less child. Only
+    // the removed one leaves damage.
+    lay_reset_context(ctx);
+    build_tracked_row(ctx, 20, 2);
+    lay_run_context(ctx);
+    lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 0);
+    LTEST_TRUE(lay_get_damage(ctx, damage) == 1);
+    LTEST_VEC4EQ(damage[0], 30, 20, 10, 10);
+
+    // Changes far apart get separate rects
+    lay_id far = lay_item(ctx);
+    lay_set_size_xy(ctx, far, 10, 10);
+    lay_set_behave(ctx, far, LAY_RIGHT | LAY_BOTTOM);
+    lay_insert(ctx, 0, far);
+    lay_set_size_xy(ctx, 1, 10, 10);
+    lay_run_context(ctx);
+    changes = lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 3);
+    LTEST_TRUE(changes[0] == 1 && changes[1] == 2 && changes[2] == far);
+    LTEST_TRUE(lay_get_damage(ctx, damage) == 2);
+    LTEST_VEC4EQ(damage[0], 0, 20, 30, 10);
+    LTEST_VEC4EQ(damage[1], 20, 40, 10, 10);
+
+    // The same through lay_run_dirty(). The last item is clean, and is only
+    // moved horizontally.
+    lay_run_dirty(ctx);
+    lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 0);
+    lay_set_size_xy(ctx, 2, 15, 10);
+    lay_run_dirty(ctx);
+    changes = lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 2);
+    LTEST_TRUE(changes[0] == 2 && changes[1] == far);
+    LTEST_TRUE(lay_get_damage(ctx, damage) == 2);
+    LTEST_VEC4EQ(damage[0], 10, 20, 15, 10);
+    LTEST_VEC4EQ(damage[1], 20, 40, 15, 10);
+    lay_run_dirty(ctx);
+    lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 0);
+
+    // Compacting keeps the previous rects with their items
+    lay_compact_context(ctx, LAY_COMPACT_BREADTH_FIRST, NULL);
+    lay_run_context(ctx);
+    lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 0);
+
+    lay_set_track_changes(ctx, 0);
+    lay_get_changes(ctx, &count);
+    LTEST_TRUE(count == 0);
+}
+
+LTEST_DECLARE(snapshot)
+{
+    // A wrapped row, so that the saved flags include breaks
+    lay_id root = lay_item(ctx);
+    lay_set_size_xy(ctx, root, 50, 60);
+    lay_set_contain(ctx, root, LAY_ROW | LAY_WRAP | LAY_START);
+    for (int i = 0; i < 7; ++i) {
+        lay_id child = lay_item(ctx);
+        lay_set_size_xy(ctx, child, 20, (lay_scalar)(10 + i));
+        lay_insert(ctx, root, child);
+    }
+    lay_run_context(ctx);
+
+    const size_t size = lay_save_context(ctx, 1, NULL, 0);
+    const size_t size_no_rects = lay_save_context(ctx, 0, NULL, 0);
+    LTEST_TRUE(size_no_rects < size);
+    unsigned char *data = (unsigned char*)malloc(size);
+    LTEST_TRUE(lay_save_context(ctx, 1, data, size - 1) == size);
+    LTEST_TRUE(lay_save_context(ctx, 1, data, size) == size);
+
+    // Loaded with the rects, they're there without running it
+    lay_context loaded;
+    lay_init_context(&loaded);
+    lay_set_track_changes(&loaded, 1);
+    LTEST_TRUE(lay_load_context(&loaded, data, size));
+    LTEST_TRUE(dirty_rects_match(ctx, &loaded));
+    LTEST_TRUE(lay_last_child(&loaded, 0) == lay_last_child(ctx, 0));
+    LTEST_TRUE(lay_next_sibling(&loaded, 3) == 4);
+    lay_run_dirty(&loaded);
+    LTEST_TRUE(dirty_rects_match(ctx, &loaded));
+    lay_id changed;
+    lay_get_changes(&loaded, &changed);
+    LTEST_TRUE(changed == lay_items_count(&loaded));
+    // A loaded context can be added to
+    lay_id extra = lay_item(&loaded);
+    lay_set_size_xy(&loaded, extra, 20, 10);
+    lay_insert(&loaded, 0, extra);
+    lay_run_dirty(&loaded);
+    LTEST_VEC4EQ(lay_get_rect(&loaded, extra), 20, 42, 20, 10);
+
+    // Without the rects, it has to be run
+    LTEST_TRUE(lay_save_context(ctx, 0, data, size) == size_no_rects);
+    LTEST_TRUE(lay_load_context(&loaded, data, size_no_rects));
+    LTEST_TRUE(lay_items_count(&loaded) == lay_items_count(ctx));
+    lay_run_context(&loaded);
+    LTEST_TRUE(dirty_rects_match(ctx, &loaded));
+    lay_destroy_context(&loaded);
+
+#ifndef LAY_PAGED
+    // Mapped, the context uses the snapshot in place
+    LTEST_TRUE(lay_save_context(ctx, 1, data, size) == size);
+    lay_context mapped;
+    lay_init_context(&mapped);
+    // The memo and change tracking are kept, along with the memo's counters
+    lay_set_memo(&mapped, 8);
+    lay_set_track_changes(&mapped, 1);
+    lay_id memo_root = lay_item(&mapped);
+    lay_insert(&mapped, memo_root, lay_item(&mapped));
+    lay_run_context(&mapped);
+    const uint64_t size_lookups = lay_get_memo_stats(&mapped).size_lookups;
+    LTEST_TRUE(size_lookups > 0);
+    LTEST_TRUE(lay_map_context(&mapped, data, size));
+    LTEST_TRUE(lay_get_memo_stats(&mapped).size_lookups == size_lookups);
+    LTEST_TRUE(dirty_rects_match(ctx, &mapped));
+    LTEST_TRUE(lay_first_child(&mapped, 0) == 1);
+    // The memory is writable here, so it can be changed and run again
+    lay_set_size_xy(&mapped, 1, 30, 10);
+    lay_run_dirty(&mapped);
+    LTEST_TRUE(lay_get_rect(&mapped, 1)[2] == 30);
+    LTEST_TRUE(lay_get_rect(&mapped, 2)[0] == 30);
+    lay_get_changes(&mapped, &changed);
+    LTEST_TRUE(changed == lay_items_count(&mapped));
+    lay_destroy_context(&mapped);
+
+    // Without rects, the context allocates its own, with the allocator it
+    // was given before being mapped
+    LTEST_TRUE(lay_save_context(ctx, 0, data, size) == size_no_rects);
+    counting_allocator allocator = { 0, 0, 0 };
+    lay_init_context(&mapped);
+    lay_set_allocator(&mapped, counting_alloc, &allocator);
+    LTEST_TRUE(lay_map_context(&mapped, data, size_no_rects));
+    lay_run_context(&mapped);
+    LTEST_TRUE(dirty_rects_match(ctx, &mapped));
+    LTEST_TRUE(allocator.num_allocs > 0);
+    lay_destroy_context(&mapped);
+    LTEST_TRUE(allocator.live_bytes == 0);
+    LTEST_TRUE(allocator.num_bad_sizes == 0);
+    LTEST_FALSE(lay_map_context(&mapped, data + 4, size_no_rects - 4));
+
+    // Loading into a mapped context leaves the snapshot it was using alone,
+    // and gives the context its own items, which can be added to
+    LTEST_TRUE(lay_save_context(ctx, 1, data, size) == size);
+    unsigned char *other = (unsigned char*)malloc(size);
+    memcpy(other, data, size);
+    LTEST_TRUE(lay_map_context(&mapped, other, size));
+    lay_reset_context(ctx);
+    lay_id small = lay_item(ctx);
+    lay_set_size_xy(ctx, small, 5, 5);
+    const size_t small_size = lay_save_context(ctx, 0, NULL, 0);
+    unsigned char *small_data = (unsigned char*)malloc(small_size);
+    LTEST_TRUE(lay_save_context(ctx, 0, small_data, small_size) == small_size);
+    LTEST_TRUE(lay_load_context(&mapped, small_data, small_size));
+    LTEST_TRUE(memcmp(other, data, size) == 0);
+    LTEST_TRUE(lay_items_count(&mapped) == 1);
+    lay_id added = lay_item(&mapped);
+    lay_insert(&mapped, 0, added);
+    lay_run_context(&mapped);
+    LTEST_VEC4EQ(lay_get_rect(&mapped, 0), 0, 0, 5, 5);
+    LTEST_TRUE(memcmp(other, data, size) == 0);
+    lay_destroy_context(&mapped);
+    free(small_data);
+    free(other);
+#endif
+
+    // Snapshots that are cut short, or from another version, are rejected
+    lay_init_context(&loaded);
+    LTEST_FALSE(lay_load_context(&loaded, data, size_no_rects - 1));
+    LTEST_FALSE(lay_load_context(&loaded, data, 8));
+    data[4] ^= 0xff;
+    LTEST_FALSE(lay_load_context(&loaded, data, size_no_rects));
+    LTEST_TRUE(lay_items_count(&loaded) == 0);
+    lay_destroy_context(&loaded);
+    free(data);
+}
+
+#ifdef LAY_STATS
+LTEST_DECLARE(stats)
+{
+    // Uses its own context, so that the reallocations are counted from the
+    // start
+    (void)ctx;
+    lay_context sctx;
+    lay_init_context(&sctx);
+    lay_id root = lay_item(&sctx);
+    lay_set_size_xy(&sctx, root, 100, 100);
+    lay_set_contain(&sctx, root, LAY_COLUMN);
+
+    // 25 boxes wrapped into 5 lines
+    lay_id wrap = lay_item(&sctx);
+    lay_set_size_xy(&sctx, wrap, 50, 50);
+    lay_set_contain(&sctx, wrap, LAY_ROW | LAY_WRAP);
+    lay_insert(&sctx, root, wrap);
+    for (int i = 0; i < 25; ++i) {
+        lay_id box = lay_item(&sctx);
+        lay_set_size_xy(&sctx, box, 10, 10);
+        lay_insert(&sctx, wrap, box);
+    }
+
+    // 2 fillers
+    lay_id fill_row = lay_item(&sctx);
+    lay_set_size_xy(&sctx, fill_row, 100, 10);
+    lay_set_contain(&sctx, fill_row, LAY_ROW);
+    lay_insert(&sctx, root, fill_row);
+    for (int i = 0; i < 2; ++i) {
+        lay_id filler = lay_item(&sctx);
+        lay_set_behave(&sctx, filler, LAY_HFILL);
+        lay_insert(&sctx, fill_row, filler);
+    }
+
+    // 3 boxes squeezed into the space of 2. Items with a fixed size can't be
+    // squeezed, so the boxes get their size from what's inside them instead.
+    lay_id squeeze_row = lay_item(&sctx);
+    lay_set_size_xy(&sctx, squeeze_row, 20, 10);
+    lay_set_contain(&sctx, squeeze_row, LAY_ROW);
+    lay_insert(&sctx, root, squeeze_row);
+    for (int i = 0; i < 3; ++i) {
+        lay_id box = lay_item(&sctx);
+        lay_insert(&sctx, squeeze_row, box);
+        lay_id inner = lay_item(&sctx);
+        lay_set_size_xy(&sctx, inner, 10, 10);
+        lay_insert(&sctx, box, inner);
+    }
+
+    lay_run_context(&sctx);
+    lay_stats stats = lay_get_stats(&sctx);
+    const uint64_t count = lay_items_count(&sctx);
+    LTEST_TRUE(count == 37);
+    for (int dim = 0; dim < 2; ++dim) {
+        LTEST_TRUE(stats.calc_size_items[dim] == count);
+        LTEST_TRUE(stats.arrange_items[dim] == count);
+    }
+    LTEST_TRUE(stats.wrapped_lines[0] == 5);
+    LTEST_TRUE(stats.wrapped_lines[1] == 0);
+    LTEST_TRUE(stats.filler_items[0] == 2);
+    LTEST_TRUE(stats.filler_items[1] == 0);
+    LTEST_TRUE(stats.squeezed_items[0] == 3);
+    LTEST_TRUE(stats.squeezed_items[1] == 0);
+    LTEST_TRUE(stats.max_depth == 3);
+#ifdef LAY_PAGED
+    LTEST_TRUE(stats.item_reallocs == 1);
+#else
+    // Grown to 32, and then to 128
+    LTEST_TRUE(stats.item_reallocs == 2);
+#endif
+
+    // The counters add up until they're reset
+    lay_run_context(&sctx);
+    stats = lay_get_stats(&sctx);
+    LTEST_TRUE(stats.calc_size_items[0] == 2 * count);
+    LTEST_TRUE(stats.wrapped_lines[0] == 10);
+    lay_reset_stats(&sctx);
+    stats = lay_get_stats(&sctx);
+    LTEST_TRUE(stats.calc_size_items[0] == 0);
+    LTEST_TRUE(stats.item_reallocs == 0);
+    LTEST_TRUE(stats.max_depth == 0);
+
+    // Only the items that are recalculated are counted
+    lay_run_dirty(&sctx);
+    LTEST_TRUE(lay_get_stats(&sctx).calc_size_items[0] == count);
+    lay_set_size_xy(&sctx, squeeze_row, 30, 10);
+    lay_reset_stats(&sctx);
+    lay_run_dirty(&sctx);
+    stats = lay_get_stats(&sctx);
+    LTEST_TRUE(stats.calc_size_items[0] > 0 && stats.calc_size_items[0] < count);
+    LTEST_TRUE(stats.squeezed_items[0] == 0);
+
+    lay_destroy_context(&sctx);
+}
+#endif
+
+#ifdef LAY_TRACE
+// Checks that the spans are nested, and counts them
+typedef struct trace_checker {
+    const char *names[64];
+    lay_id items[64];
+    int depth;
+    int max_depth;
+    int num_spans;
+    int num_subtrees;
+    bool ok;
+} trace_checker;
+
+static void check_trace(void *user_data, lay_trace_phase phase, const char *name, lay_id item, int dim)
+{
+    trace_checker *checker = (trace_checker*)user_data;
+    (void)dim;
+    if (phase == LAY_TRACE_BEGIN) {
+        if (checker->depth == 64) {
+            checker->ok = false;
+            return;
+        }
+        checker->names[checker->depth] = name;
+        checker->items[checker->depth] = item;
+        if (++checker->depth > checker->max_depth)
+            checker->max_depth = checker->depth;
+    } else {
+        if (checker->depth == 0 || checker->names[checker->depth - 1] != name
+            || checker->items[checker->depth - 1] != item) {
+            checker->ok = false;
+            return;
+        }
+        --checker->depth;
+        ++checker->num_spans;
+        if (strcmp(name, "subtree") == 0)
+            ++checker->num_subtrees;
+    }
+}
+
+static double fake_clock_us(void)
+{
+    static double now = 0.0;
+    return now += 1.0;
+}
+
+LTEST_DECLARE(trace)
+{
+    lay_context ref;
+    lay_init_context(&ref);
+    build_wrapping_tree(&ref);
+    lay_run_context(&ref);
+    build_wrapping_tree(ctx);
+
+    // Without subtrees: the run, and a size and arrange pass per dimension
+    trace_checker checker;
+    memset(&checker, 0, sizeof(checker));
+    checker.ok = true;
+    lay_set_trace(ctx, check_trace, &checker, 0);
+    lay_run_context(ctx);
+    LTEST_TRUE(checker.ok && checker.depth == 0);
+    LTEST_TRUE(checker.num_spans == 5 && checker.num_subtrees == 0);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    // The root and the two wrapping boxes (25 items each) have more than 20
+    memset(&checker, 0, sizeof(checker));
+    checker.ok = true;
+    lay_set_trace(ctx, check_trace, &checker, 20);
+    lay_run_context(ctx);
+    LTEST_TRUE(checker.ok && checker.depth == 0);
+    LTEST_TRUE(checker.num_subtrees == 4 * 3);
+    LTEST_TRUE(checker.max_depth == 4);
+    LTEST_TRUE(dirty_rects_match(ctx, &ref));
+
+    memset(&checker, 0, sizeof(checker));
+    checker.ok = true;
+    lay_set_size_xy(ctx, 0, 120, 90);
+    lay_run_dirty(ctx);
+    LTEST_TRUE(checker.ok && checker.depth == 0);
+    LTEST_TRUE(checker.num_spans == 5 && checker.num_subtrees == 0);
+
+    // The writer records every call
+    lay_trace_writer writer;
+    lay_trace_writer_init(&writer, fake_clock_us);
+    lay_set_trace(ctx, lay_trace_writer_proc, &writer, 1);
+    lay_run_context(ctx);
+    LTEST_TRUE(writer.count > 10 && writer.count % 2 == 0);
+    for (size_t i = 1; i < writer.count; ++i)
+        LTEST_TRUE(writer.events[i].time > writer.events[i - 1].time);
+    LTEST_TRUE(writer.events[0].phase == LAY_TRACE_BEGIN && writer.events[0].dim == -1);
+    lay_trace_writer_destroy(&writer);
+
+    lay_set_trace(ctx, NULL, NULL, 0);
+    lay_destroy_context(&ref);
+}
+#endif
+
 // Call in main to run a test by name
 //
 // Resets string buffer and lay context before running test
@@ -952,6 +2578,7 @@ int main(int argc, char** argv)
     LTEST_RUN(simple_margins_1);
     LTEST_RUN(nested_boxes_1);
     LTEST_RUN(deep_nest_1);
+    LTEST_RUN(deep_nest_2);
     LTEST_RUN(many_children_1);
     LTEST_RUN(child_align_1);
     LTEST_RUN(child_align_2);
@@ -966,6 +2593,32 @@ int main(int argc, char** argv)
     LTEST_RUN(wrap_column_4);
     LTEST_RUN(anchor_right_margin1);
     LTEST_RUN(anchor_right_margin2);
+    LTEST_RUN(overlay_large_margins);
+    LTEST_RUN(dirty_relayout);
+    LTEST_RUN(dirty_random_wrapped_columns);
+    LTEST_RUN(compact_context);
+    LTEST_RUN(run_parallel);
+    LTEST_RUN(run_contexts);
+    LTEST_RUN(isa_levels);
+    LTEST_RUN(allocator);
+#ifndef LAY_PAGED
+    LTEST_RUN(rects_buffer);
+#endif
+    LTEST_RUN(get_rects);
+    LTEST_RUN(memo);
+    LTEST_RUN(instantiate);
+    LTEST_RUN(insert_range);
+    LTEST_RUN(virtual_list);
+    LTEST_RUN(find_item);
+    LTEST_RUN(frames);
+    LTEST_RUN(track_changes);
+    LTEST_RUN(snapshot);
+#ifdef LAY_STATS
+    LTEST_RUN(stats);
+#endif
+#ifdef LAY_TRACE
+    LTEST_RUN(trace);
+#endif
 
     printf("Finished tests\n");
 
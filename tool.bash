@@ -9,6 +9,10 @@ Commands:
         Configs: debug, release
         Targets: tests, bench
         Output: build/<config>/<target>
+    trace
+        Builds the benchmarks with LAY_TRACE, and runs them to write a
+        Chrome trace of the layout passes to build/layout_trace.json,
+        which can be opened in Perfetto (ui.perfetto.dev)
     clean
         Removes build/
     info
@@ -19,6 +23,8 @@ Options:
                   Default: \$CC, or cc
     -t            Use a particular C or C++ standard.
                   Default: c99 or c++11
+    -D <macro>    Define a preprocessor macro when compiling. Can be used
+                  more than once. Example: -D LAY_FLOAT=1 -D LAY_SOA
     -d            Enable compiler safeguards like -fstack-protector.
                   You should probably do this if you plan to give the
                   compiled binary to other people.
@@ -47,8 +53,9 @@ protections_enabled=0
 stats_enabled=0
 pie_enabled=0
 static_enabled=0
+defines=()
 
-while getopts c:dhst:v-: opt_val; do
+while getopts c:D:dhst:v-: opt_val; do
   case "$opt_val" in
     -)
       case "$OPTARG" in
@@ -63,6 +70,7 @@ while getopts c:dhst:v-: opt_val; do
       esac
       ;;
     c) cc_exe="$OPTARG";;
+    D) defines+=("-D$OPTARG");;
     d) protections_enabled=1;;
     h) print_usage; exit 0;;
     s) stats_enabled=1;;
@@ -246,6 +254,9 @@ build_target() {
   if [[ $static_enabled = 1 ]]; then
     add cc_flags -static
   fi
+  if [[ ${#defines[@]} -gt 0 ]]; then
+    add cc_flags "${defines[@]}"
+  fi
   case "$1" in
     debug)
       build_subdir=debug
@@ -283,37 +294,30 @@ build_target() {
     *) fatal "Unknown build config \"$1\"";;
   esac
 
-  case $arch in
-    x86_64)
-      case $cc_id in
-        gcc)
-          if cc_vers_is_gte 4.9; then
-            add cc_flags -march=nehalem
-          fi
-          ;;
-        clang)
-          add cc_flags -march=nehalem
-          ;;
-      esac
-      ;;
-  esac
+  # No -march here. layout.h compiles its hot code for several instruction
+  # set levels and picks one at runtime, so the binaries run on any x86-64 CPU.
 
   case "$2" in
     test|tests)
       add source_files test_layout.c
       out_exe=lay_tests
       ;;
-    bench|benchmark)
+    bench|benchmark|trace)
       add cc_flags -isystem thirdparty
       add source_files benchmark_layout.c
       case $os in
         linux|cygwin*|*bsd*)
           # librt and high-res posix timers on Linux (and BSD?)
-          add libraries -lrt
+          add libraries -lrt -pthread
           add cc_flags -D_POSIX_C_SOURCE=200809L
           ;;
       esac
-      out_exe=lay_bench
+      if [[ $2 = trace ]]; then
+        add cc_flags -DLAY_TRACE
+        out_exe=lay_bench_trace
+      else
+        out_exe=lay_bench
+      fi
       ;;
   esac
   try_make_dir "$build_dir"
@@ -370,6 +374,13 @@ case "$1" in
     fi
     build_target "$2" "$3"
     ;;
+  trace)
+    if [[ "$#" -gt 1 ]]; then
+      fatal "Too many arguments for 'trace'"
+    fi
+    build_target release trace
+    verbose_echo "$build_dir/release/lay_bench_trace" --trace "$build_dir/layout_trace.json"
+    ;;
   clean)
     if [[ -d "$build_dir" ]]; then
       verbose_echo rm -rf "$build_dir"